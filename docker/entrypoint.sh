@@ -4,6 +4,8 @@ set -e
 # Allow overriding server config via command-line args
 CACHE_CAPACITY="${1:-1000}"
 THREADS="${2:-16}"
+# Anything after the first two arguments is passed through as server flags
+EXTRA_ARGS=("${@:3}")
 
 # Start PostgreSQL (system package). Initialize data dir if necessary
 if [ ! -d "/var/lib/postgresql/12/main" ] && [ ! -d "/var/lib/postgresql/data" ]; then
@@ -25,6 +27,7 @@ su - postgres -c "psql -f /init.sql" || true
 echo "Databases:"
 su - postgres -c "psql -l"
 
-# Launch server in foreground
+# Launch server in foreground; exec so `docker stop` (SIGTERM) reaches it
+# and the shutdown path runs (e.g. writing the --snapshot file)
 echo "Starting KV server..."
-/opt/kv_server/server/kv_server "$CACHE_CAPACITY" "$THREADS"
+exec /opt/kv_server/server/kv_server "$CACHE_CAPACITY" "$THREADS" "${EXTRA_ARGS[@]}"
@@ -44,6 +44,7 @@ typedef struct {
     workload_t workload;
     size_t key_pool_size;   /* default 100000 */
     size_t popular_size;    /* default 100 */
+    size_t seed_size;       /* keys bulk-loaded before the run, default 0 */
 } config_t;
 
 /* ---------- Extern Globals (defined in main.c) ---------- */
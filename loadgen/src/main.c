@@ -54,6 +54,54 @@ static int do_post_once(CURL *curl, const char *key, const char *value) {
     return (res == CURLE_OK && rc == 200) ? 1 : 0;
 }
 
+/* NDJSON rows <prefix>_<tag>_<i>, generated as curl asks for them */
+typedef struct {
+    const char *tag;
+    size_t next, n;
+} bulk_src_t;
+
+static size_t bulk_read_cb(char *buf, size_t size, size_t nmemb, void *userdata) {
+    bulk_src_t *src = userdata;
+    size_t cap = size * nmemb, len = 0;
+    while (src->next < src->n) {
+        char line[384];
+        int l = snprintf(line, sizeof(line), "{\"key\":\"%s_%s_%zu\",\"value\":\"v_%s_%zu\"}\n",
+                         g_cfg.key_prefix, src->tag, src->next, src->tag, src->next);
+        if (len + (size_t)l > cap) break;
+        memcpy(buf + len, line, (size_t)l);
+        len += (size_t)l;
+        src->next++;
+    }
+    return len;
+}
+
+/* Loads n keys in one streamed POST to the server's /admin/bulk, next to
+ * /kv; returns 1 on success */
+static int do_bulk_seed(const char *tag, size_t n) {
+    char url[600];
+    size_t base = strlen(g_cfg.server_url);
+    if (base >= 3 && strcmp(g_cfg.server_url + base - 3, "/kv") == 0) base -= 3;
+    snprintf(url, sizeof(url), "%.*s/admin/bulk", (int)base, g_cfg.server_url);
+    CURL *curl = curl_easy_init();
+    if (!curl) return 0;
+    bulk_src_t src = { tag, 0, n };
+    struct curl_slist *hdrs = NULL;
+    hdrs = curl_slist_append(hdrs, "Content-Type: application/x-ndjson");
+    hdrs = curl_slist_append(hdrs, "Transfer-Encoding: chunked");
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, bulk_read_cb);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &src);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_cb);
+    CURLcode res = curl_easy_perform(curl);
+    long rc = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &rc);
+    curl_slist_free_all(hdrs);
+    curl_easy_cleanup(curl);
+    return (res == CURLE_OK && rc == 200) ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--server") == 0 && i+1 < argc) {
@@ -80,6 +128,8 @@ int main(int argc, char **argv) {
             g_cfg.key_pool_size = (size_t)atol(argv[++i]);
         } else if (strcmp(argv[i], "--popular-size") == 0 && i+1 < argc) {
             g_cfg.popular_size = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc) {
+            g_cfg.seed_size = (size_t)atol(argv[++i]);
         } else if (strcmp(argv[i], "--help") == 0) {
             usage(argv[0]); return 0;
         } else {
@@ -102,8 +152,34 @@ int main(int argc, char **argv) {
 
     curl_global_init(CURL_GLOBAL_ALL);
 
-    /* Seed popular keys if requested */
-    if (g_cfg.workload == WL_GET_POPULAR) {
+    /* Bulk-load the seed set; the registry takes what fits */
+    if (g_cfg.seed_size > 0) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (!do_bulk_seed("seed", g_cfg.seed_size)) {
+            fprintf(stderr, "Bulk seeding %zu keys failed\n", g_cfg.seed_size);
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        char key[128];
+        for (size_t i = 0; i < g_cfg.seed_size; ++i) {
+            snprintf(key, sizeof(key), "%s_seed_%zu", g_cfg.key_prefix, i);
+            if (!keys_try_add(&g_keys, key)) break;
+        }
+        printf("Seeded %zu keys in %.2f s (pool size now %zu)\n", g_cfg.seed_size,
+               (double)timespec_diff_ns(&t0, &t1) / 1e9, (size_t)keys_count(&g_keys));
+    }
+
+    /* Seed popular keys if requested: one bulk load, or one POST per key
+     * against servers without /admin/bulk */
+    if (g_cfg.workload == WL_GET_POPULAR && do_bulk_seed("pop", g_cfg.popular_size)) {
+        char key[128];
+        for (size_t i = 0; i < g_cfg.popular_size; ++i) {
+            snprintf(key, sizeof(key), "%s_pop_%zu", g_cfg.key_prefix, i);
+            keys_try_add(&g_keys, key);
+        }
+        printf("Seeded %zu popular keys (pool size now %zu)\n", g_cfg.popular_size, (size_t)keys_count(&g_keys));
+    } else if (g_cfg.workload == WL_GET_POPULAR) {
         CURL *curl = curl_easy_init();
         if (!curl) { fprintf(stderr, "curl init failed for seeding\n"); return 1; }
         for (size_t i = 0; i < g_cfg.popular_size; ++i) {
@@ -168,7 +244,8 @@ static void usage(const char *prog) {
     fprintf(stderr,
         "Usage: %s [--server url] [--threads N] [--duration S] [--mix GET,POST,DELETE]\n"
         "       [--key-prefix prefix] [--workload put-all|get-all|get-popular|mix]\n"
-        "       [--key-pool-size N] [--popular-size N]\n"
-        "Defaults: server=http://kv_server:8080/kv threads=4 duration=20 mix=60,30,10 key-prefix=key\n",
+        "       [--key-pool-size N] [--popular-size N] [--seed N]\n"
+        "Defaults: server=http://kv_server:8080/kv threads=4 duration=20 mix=60,30,10 key-prefix=key\n"
+        "--seed N bulk-loads N keys through /admin/bulk before the run (default 0)\n",
         prog);
 }
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "cache.h"
+
+/* Cache microbenchmark. Only uses the public cache.h API so the same file
+ * builds against older cache.c revisions for before/after comparisons.
+ *
+ * Usage: cache_bench [entries] [value_size] [threads]
+ */
+
+static lru_cache_t *cache;
+static size_t n_entries = 200000;
+static size_t value_size = 64;
+static int n_threads = 4;
+
+static inline uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+static long rss_bytes(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+typedef struct {
+    int id;
+    int op; /* 0 = put, 1 = get */
+} bench_arg_t;
+
+static void *bench_thread(void *arg) {
+    bench_arg_t *a = arg;
+    char key[64];
+    char *val = malloc(value_size + 1);
+    memset(val, 'v', value_size);
+    val[value_size] = '\0';
+    size_t per = n_entries / n_threads;
+    size_t lo = per * a->id, hi = lo + per;
+    for (size_t i = lo; i < hi; ++i) {
+        /* gets walk the keys in a scattered order so insertion-order
+         * locality doesn't flatter either layout */
+        size_t k = a->op == 0 ? i : (i * 7919UL) % n_entries;
+        snprintf(key, sizeof(key), "bench_key_%zu", k);
+        if (a->op == 0) {
+            lru_cache_put(cache, key, val);
+        } else {
+            char *out = NULL;
+            if (lru_cache_get(cache, key, &out) == 0) free(out);
+        }
+    }
+    free(val);
+    return NULL;
+}
+
+static double run(int op) {
+    pthread_t tids[n_threads];
+    bench_arg_t args[n_threads];
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < n_threads; ++i) {
+        args[i].id = i;
+        args[i].op = op;
+        pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+    }
+    for (int i = 0; i < n_threads; ++i) pthread_join(tids[i], NULL);
+    return (double)(now_ns() - t0);
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2) n_entries = (size_t)atol(argv[1]);
+    if (argc >= 3) value_size = (size_t)atol(argv[2]);
+    if (argc >= 4) n_threads = atoi(argv[3]);
+    if (n_threads < 1) n_threads = 1;
+
+    long rss0 = rss_bytes();
+    cache = lru_cache_create(n_entries);
+    if (!cache) { fprintf(stderr, "Failed to create cache\n"); return 1; }
+
+    double put_ns = run(0);
+    long rss1 = rss_bytes();
+    double get_ns = run(1);
+
+    size_t done = (n_entries / n_threads) * n_threads;
+    printf("entries=%zu value_size=%zu threads=%d\n", done, value_size, n_threads);
+    printf("put: %.1f ns/op (wall, all threads)\n", put_ns / done);
+    printf("get: %.1f ns/op (wall, all threads)\n", get_ns / done);
+    printf("rss: %.1f bytes/entry\n", (double)(rss1 - rss0) / done);
+
+    lru_cache_destroy(cache);
+    return 0;
+}
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "hash_index.h"
+
+/* Hash index microbenchmark: the Swiss-table index from hash_index.c against
+ * the separate chaining the cache used before (djb2, capacity * 2 + 1
+ * buckets, strcmp per chain entry, rehash on eviction).
+ *
+ * Usage: index_bench [entries]
+ */
+
+typedef struct entry {
+    struct entry *hnext;
+    uint64_t hash;
+    char key[32];
+} entry_t;
+
+static inline uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+static unsigned long djb2(const char *s) {
+    unsigned long h = 5381;
+    int c;
+    while ((c = *s++)) h = ((h << 5) + h) + c;
+    return h;
+}
+
+static uint64_t mixed(const char *s) {
+    uint64_t h = djb2(s);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* ---- baseline: separate chaining ---- */
+
+typedef struct {
+    entry_t **buckets;
+    size_t n_buckets;
+} chain_t;
+
+static void chain_insert(chain_t *t, entry_t *e) {
+    unsigned long h = djb2(e->key) % t->n_buckets;
+    e->hnext = t->buckets[h];
+    t->buckets[h] = e;
+}
+
+static entry_t *chain_find(chain_t *t, const char *key) {
+    entry_t *cur = t->buckets[djb2(key) % t->n_buckets];
+    while (cur) {
+        if (strcmp(cur->key, key) == 0) return cur;
+        cur = cur->hnext;
+    }
+    return NULL;
+}
+
+static void chain_remove(chain_t *t, entry_t *e) {
+    unsigned long h = djb2(e->key) % t->n_buckets;
+    entry_t *cur = t->buckets[h], *prev = NULL;
+    while (cur) {
+        if (cur == e) {
+            if (prev) prev->hnext = cur->hnext;
+            else t->buckets[h] = cur->hnext;
+            return;
+        }
+        prev = cur;
+        cur = cur->hnext;
+    }
+}
+
+/* ---- Swiss index ---- */
+
+static int entry_eq(const void *e, uint64_t hash, const void *key) {
+    const entry_t *en = e;
+    return en->hash == hash && strcmp(en->key, (const char *)key) == 0;
+}
+
+static uint64_t entry_hash(const void *e) {
+    return ((const entry_t *)e)->hash;
+}
+
+static void report(const char *name, const char *op, uint64_t ns, size_t n) {
+    printf("%-6s %-8s %8.1f ns/op\n", name, op, (double)ns / n);
+}
+
+int main(int argc, char **argv) {
+    size_t n = 1000000;
+    if (argc >= 2) n = (size_t)atol(argv[1]);
+
+    entry_t *entries = calloc(n, sizeof(entry_t));
+    char (*miss)[32] = calloc(n, 32);
+    if (!entries || !miss) { fprintf(stderr, "alloc failed\n"); return 1; }
+    for (size_t i = 0; i < n; ++i) {
+        snprintf(entries[i].key, sizeof(entries[i].key), "key_%zu", i);
+        entries[i].hash = mixed(entries[i].key);
+        snprintf(miss[i], 32, "miss_%zu", i);
+    }
+    /* random access order: sequential keys hash to neighbouring djb2
+     * buckets, which would flatter the chained table */
+    size_t *order = malloc(n * sizeof(size_t));
+    for (size_t i = 0; i < n; ++i) order[i] = i;
+    srand(42);
+    for (size_t i = n - 1; i > 0; --i) {
+        size_t j = ((size_t)rand() * RAND_MAX + rand()) % (i + 1);
+        size_t t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+    /* lookups use a copy of the key, as a request would, so the entry
+     * itself is not already in cache when the probe starts */
+    char (*query)[32] = calloc(n, 32);
+    for (size_t i = 0; i < n; ++i) memcpy(query[i], entries[order[i]].key, 32);
+    volatile size_t found = 0;
+    uint64_t t0;
+
+    chain_t ch = { .n_buckets = n * 2 + 1 };
+    ch.buckets = calloc(ch.n_buckets, sizeof(entry_t *));
+    t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) chain_insert(&ch, &entries[i]);
+    report("chain", "insert", now_ns() - t0, n);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) found += chain_find(&ch, query[i]) != NULL;
+    report("chain", "hit", now_ns() - t0, n);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) found += chain_find(&ch, miss[order[i]]) != NULL;
+    report("chain", "miss", now_ns() - t0, n);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) chain_remove(&ch, &entries[order[i]]);
+    report("chain", "evict", now_ns() - t0, n);
+    printf("chain  memory   %8.1f bytes/entry (buckets + hnext)\n",
+           (double)(ch.n_buckets * sizeof(entry_t *) + n * sizeof(entry_t *)) / n);
+    free(ch.buckets);
+
+    /* start small so the timing includes incremental growth */
+    epoch_domain_t ep;
+    epoch_domain_init(&ep);
+    hash_index_t idx;
+    hidx_init(&idx, 16, entry_eq, entry_hash, &ep);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) hidx_insert(&idx, entries[i].hash, &entries[i]);
+    report("swiss", "insert", now_ns() - t0, n);
+    size_t mem = hidx_memory(&idx);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        found += hidx_find(&idx, mixed(query[i]), query[i]) != NULL;
+    }
+    report("swiss", "hit", now_ns() - t0, n);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) found += hidx_find(&idx, mixed(miss[order[i]]), miss[order[i]]) != NULL;
+    report("swiss", "miss", now_ns() - t0, n);
+    t0 = now_ns();
+    for (size_t i = 0; i < n; ++i) hidx_remove(&idx, entries[order[i]].hash, &entries[order[i]]);
+    report("swiss", "evict", now_ns() - t0, n);
+    printf("swiss  memory   %8.1f bytes/entry (ctrl + slots)\n", (double)mem / n);
+    hidx_destroy(&idx);
+    epoch_domain_destroy(&ep);
+
+    if (found != 2 * n) fprintf(stderr, "unexpected hit count %zu\n", (size_t)found);
+    free(query);
+    free(order);
+    free(entries);
+    free(miss);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+/* Admission policy benchmark: hit ratio of a hot working set while one-off
+ * scan keys stream through the cache, the way loadgen's put-all/get-all
+ * workloads run next to a popular-key workload. Misses are filled with a
+ * put, as get_kv_handler does after a DB read.
+ *
+ * Usage: policy_bench [capacity] [scan_percent]
+ */
+
+static void run(const char *name, lru_cache_policy_t policy, size_t capacity, int scan_pct) {
+    lru_cache_config_t cfg = { .capacity = capacity, .policy = policy };
+    lru_cache_t *c = lru_cache_create_with(&cfg);
+    if (!c) { fprintf(stderr, "Failed to create cache\n"); exit(1); }
+    /* hot set fits in half the cache, skewed so some keys are hotter */
+    size_t hot = capacity / 2, scan_next = 0;
+    size_t ops = capacity * 50, hot_ops = 0, hot_hits = 0;
+    char key[64];
+    srand(42);
+    for (size_t i = 0; i < ops; ++i) {
+        int is_scan = rand() % 100 < scan_pct;
+        if (is_scan) {
+            snprintf(key, sizeof(key), "scan_%zu", scan_next++);
+        } else {
+            size_t r = (size_t)rand() % hot;
+            snprintf(key, sizeof(key), "hot_%zu", (r * r) / hot);
+        }
+        /* only count hot lookups after a warm-up pass */
+        int counted = !is_scan && i >= capacity * 5;
+        char *out = NULL;
+        if (lru_cache_get(c, key, &out) == 0) {
+            hot_hits += counted;
+            free(out);
+        } else {
+            lru_cache_put(c, key, "value");
+        }
+        hot_ops += counted;
+    }
+    lru_cache_stats_t st;
+    lru_cache_get_stats(c, &st);
+    printf("%-8s hot hit ratio %5.1f%%  admitted=%zu rejected=%zu\n", name,
+           100.0 * (double)hot_hits / (double)(hot_ops ? hot_ops : 1), st.admitted, st.rejected);
+    lru_cache_destroy(c);
+}
+
+int main(int argc, char **argv) {
+    size_t capacity = 100000;
+    int scan_pct = 50;
+    if (argc >= 2) capacity = (size_t)atol(argv[1]);
+    if (argc >= 3) scan_pct = atoi(argv[2]);
+    printf("capacity=%zu scan=%d%%\n", capacity, scan_pct);
+    run("clock", LRU_POLICY_CLOCK, capacity, scan_pct);
+    run("tinylfu", LRU_POLICY_TINYLFU, capacity, scan_pct);
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Bloom filter over string keys. Adds and lookups are lock-free (atomic
+ * OR into 64-bit words), so any number of threads may use one filter. No
+ * false negatives; false positives at roughly the configured rate while
+ * the filter holds no more than the key count it was sized for.
+ */
+
+typedef struct {
+    _Atomic uint64_t *words;
+    size_t n_bits;     /* multiple of 64 */
+    unsigned n_hashes;
+    size_t capacity;   /* keys it was sized for */
+    _Atomic size_t added;
+} bloom_t;
+
+bloom_t *bloom_create(size_t expected_keys, double fpr);
+void bloom_destroy(bloom_t *b);
+
+void bloom_add(bloom_t *b, const char *key);
+/* 0 = definitely absent, 1 = maybe present */
+int bloom_may_contain(const bloom_t *b, const char *key);
+
+size_t bloom_memory(const bloom_t *b);
+/* From the fraction of bits set; walks the whole bit array */
+double bloom_estimated_fpr(const bloom_t *b);
+
+#endif /* BLOOM_H */
@@ -10,16 +10,97 @@
 
 typedef struct lru_cache lru_cache_t;
 
+/* Immutable cached value pinned by lru_cache_acquire */
+typedef struct lru_value lru_value_t;
+
+#define LRU_CACHE_DEFAULT_SHARDS 16
+
+typedef enum {
+    LRU_POLICY_CLOCK = 0, /* admit everything, evict with CLOCK */
+    LRU_POLICY_TINYLFU,   /* W-TinyLFU: admit only keys hotter than the victim */
+} lru_cache_policy_t;
+
+typedef struct {
+    size_t capacity;        /* total entries, split evenly across shards; 0 = no entry limit */
+    size_t max_bytes;       /* total bytes (key + value + per-entry overhead); 0 = no byte limit */
+    size_t max_entry_bytes; /* larger entries are not cached; 0 = per-shard budget */
+    size_t n_shards;        /* rounded down to a power of two; 0 = default */
+    int hugepages;          /* back node slabs with 2 MiB pages */
+    lru_cache_policy_t policy;
+    size_t l1_size;         /* per-thread near cache slots (rounded up to a power of two); 0 = off */
+    size_t compress_min;    /* LZ4-compress values at least this long; 0 = off */
+    unsigned hot_replicas;  /* read copies per lru_cache_replicate'd key; 0 = off */
+} lru_cache_config_t;
+
+typedef struct {
+    size_t entries;
+    size_t bytes;               /* charged against max_bytes */
+    size_t retired;             /* unlinked nodes not yet reclaimed */
+    size_t slab_used_bytes;     /* node memory handed out */
+    size_t slab_reserved_bytes; /* node memory taken from the OS */
+    size_t index_bytes;         /* hash index control + slot arrays */
+    size_t sketch_bytes;        /* TinyLFU frequency sketch */
+    size_t admitted;            /* TinyLFU: window entries that beat the victim */
+    size_t rejected;            /* TinyLFU: window entries dropped at the door */
+    size_t l1_hits;             /* reads served by a thread's near cache */
+    size_t expired;             /* entries dropped because their TTL ran out */
+    size_t compressed_entries;  /* entries stored LZ4 compressed */
+    size_t compressed_bytes;    /* their values as stored */
+    size_t compressed_raw_bytes; /* the same values uncompressed */
+    size_t decompressions;      /* hits that had to inflate a value */
+    size_t decompress_ns;       /* total time spent inflating */
+    size_t replicated;          /* hot keys served from per-thread copies */
+    size_t replica_bytes;       /* memory held by those copies */
+} lru_cache_stats_t;
+
 /* Create/destroy cache */
 lru_cache_t *lru_cache_create(size_t capacity);
+lru_cache_t *lru_cache_create_with(const lru_cache_config_t *cfg);
 void lru_cache_destroy(lru_cache_t *cache);
 
 /* Thread-safe operations:
  * Returns 0 on success and fills *out_value (caller frees)
- * Returns -1 if not found
+ * Returns -1 if not found (put: -1 if the entry was too large to cache)
+ * lru_cache_get never blocks on a lock; put/delete serialize per shard.
  */
 int lru_cache_get(lru_cache_t *cache, const char *key, char **out_value);
 int lru_cache_put(lru_cache_t *cache, const char *key, const char *value);
+/* As lru_cache_put, but the entry stops being served ttl_sec seconds from
+ * now (0 = never) and is dropped within a second after that. */
+int lru_cache_put_ttl(lru_cache_t *cache, const char *key, const char *value, unsigned ttl_sec);
 int lru_cache_delete(lru_cache_t *cache, const char *key);
+/* Drop every entry, one shard at a time; returns how many were dropped */
+size_t lru_cache_clear(lru_cache_t *cache);
+
+/* Give the key's current entry hot_replicas read-only copies, so handles
+ * for it pin per-thread copies instead of one shared line. Lasts until
+ * the entry is updated, deleted or evicted; repeating the call is cheap.
+ * The copies are not charged to max_bytes. Returns -1 if the key is not
+ * cached, is stored compressed or replication is off. */
+int lru_cache_replicate(lru_cache_t *cache, const char *key);
+
+/* Zero-copy read: pins the cached value instead of copying it. The bytes
+ * stay valid (and unchanged) until lru_value_release, even if the key is
+ * updated, deleted or evicted meanwhile. Returns -1 if not found.
+ * Release every handle before lru_cache_destroy, and on the thread that
+ * acquired it (a near cache hit lends out the thread's own slot).
+ */
+int lru_cache_acquire(lru_cache_t *cache, const char *key, lru_value_t **out);
+const char *lru_value_data(const lru_value_t *v); /* NUL-terminated */
+size_t lru_value_len(const lru_value_t *v);
+void lru_value_release(lru_value_t *v);
+
+/* Warm restart. lru_cache_save writes every entry, most recently used
+ * first, to path (via path.tmp + rename). lru_cache_load maps the file and
+ * inserts entries in that order until shards are full, never evicting;
+ * records are checksummed and loading stops at the first bad one. A file
+ * older than max_age_sec (0 = any age) or with a bad header is ignored.
+ * Load returns the number of entries added, -1 if nothing was usable.
+ */
+int lru_cache_save(lru_cache_t *cache, const char *path);
+long lru_cache_load(lru_cache_t *cache, const char *path, unsigned max_age_sec);
+
+/* Snapshot of counters summed over all shards */
+void lru_cache_get_stats(lru_cache_t *cache, lru_cache_stats_t *st);
 
 #endif /* CACHE_H */
@@ -0,0 +1,11 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32 (IEEE 802.3, the zlib/PNG polynomial). Pass 0 to start, or the
+ * previous result to continue over more bytes. Thread-safe. */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32_H */
@@ -2,20 +2,164 @@
 #define DB_H
 
 #include <libpq-fe.h>
+#include <stddef.h>
+#include <stdint.h>
 
-/* Initialize DB connection (conninfo is libpq connection string).
+typedef enum {
+    DB_MODE_SYNC = 0, /* a statement holds a connection for its round trip */
+    DB_MODE_PIPELINE  /* one reactor thread keeps many statements in flight per connection */
+} db_mode_t;
+
+/* Open a pool of n_conns connections (conninfo is libpq connection string).
+ * In sync mode each call below checks one out for the length of its
+ * statement, waiting if all are busy; in pipeline mode it hands the
+ * statement to the reactor and waits for the result.
  * Returns 0 on success, non-zero on failure.
  */
-int db_init(const char *conninfo);
+int db_init(const char *conninfo, int n_conns, db_mode_t mode);
 void db_close(void);
 
-/* create or update key */
-int db_put(const char *key, const char *value);
+typedef struct {
+    size_t size;
+    size_t in_use;
+    uint64_t checkouts;
+    uint64_t waits;      /* checkouts that found every connection busy */
+    uint64_t wait_ns;    /* total time spent waiting for one */
+    uint64_t busy_ns;    /* total time connections were checked out */
+    uint64_t uptime_ns;  /* since db_init; busy_ns / (size * uptime_ns) = utilization */
+    uint64_t reconnects;
+    int pipeline;        /* pipeline mode: checkouts counts statements, never waits */
+    uint64_t in_flight;  /* statements sent and not answered yet */
+    uint64_t max_in_flight; /* deepest any one connection's pipeline got */
+} db_pool_stats_t;
+
+/* Returns -1 if the pool is not open */
+int db_get_pool_stats(db_pool_stats_t *st);
+
+/* create or update key; ttl_sec > 0 makes it expire that many seconds
+ * from now, otherwise it lives until deleted */
+int db_put(const char *key, const char *value, long ttl_sec);
 
-/* read key; returns 0 and sets *out_value (caller must free), -1 if not found */
-int db_get(const char *key, char **out_value);
+/* read key; returns 0 and sets *out_value (caller must free), -1 if not found
+ * or expired. If ttl_left is non-NULL it gets the seconds the key has left,
+ * 0 if it never expires. */
+int db_get(const char *key, char **out_value, long *ttl_left);
 
-/* delete key; returns 0 on success, -1 if not present */
+/* db_get for n keys in one statement. Sets values[i] (caller frees) and,
+ * if ttls is non-NULL, ttls[i] for every key found, values[i] = NULL for
+ * the rest; a key may appear more than once. Returns how many were found,
+ * or -1 on error with nothing set. */
+long db_get_many(size_t n, const char *const *keys, char **values, long *ttls);
+
+/* delete key; returns 0 on success, -1 if not present or on error (a
+ * connection lost mid-statement is an error: the delete may have run) */
 int db_delete(const char *key);
 
+/* Completion-callback variants of the three calls above. They return as
+ * soon as the statement is queued; cb then runs exactly once with what
+ * the blocking call would have returned (value only lives for the
+ * callback). In pipeline mode cb runs on the DB reactor thread, so it
+ * must be quick and must not use the blocking calls, which would wait on
+ * that same thread; queueing more async work from it is fine. In sync
+ * mode the statement runs right away and cb is called before return.
+ * Return -1, without calling cb, if the statement could not be queued. */
+typedef void (*db_get_cb)(int rc, const char *value, long ttl_left, void *arg);
+typedef void (*db_write_cb)(int rc, void *arg);
+
+int db_get_async(const char *key, db_get_cb cb, void *arg);
+int db_put_async(const char *key, const char *value, long ttl_sec, db_write_cb cb, void *arg);
+int db_delete_async(const char *key, db_write_cb cb, void *arg);
+
+/* Apply n_put upserts and n_del deletes in one transaction. Keys must be
+ * distinct across both lists. On success sets deleted[i] to whether
+ * del_keys[i] existed and returns 0; on error -1 is returned and nothing
+ * was applied. -2 means the connection was lost after the batch went out,
+ * so it may or may not have committed. put_ttls as in db_put. */
+int db_write_batch(size_t n_put, const char *const *put_keys, const char *const *put_values,
+                   const long *put_ttls, size_t n_del, const char *const *del_keys, int *deleted);
+
+/* Delete up to batch rows whose TTL has passed. Returns the number deleted,
+ * or -1 on error. Expired rows are already invisible to db_get; this only
+ * gives the space back. */
+long db_purge_expired(int batch);
+
+/* Stream every key to cb on a separate connection (no pool slot is held).
+ * cb returns non-zero to stop early. Returns the number of keys seen, or
+ * -1 on error or early stop. Requires db_init. */
+long db_scan_keys(int (*cb)(const char *key, void *arg), void *arg);
+
+/* Bulk load over COPY, on a connection of its own (no pool slot is held).
+ * db_bulk_add streams a row into a temporary staging table; db_bulk_commit
+ * upserts everything staged since the last commit into kv_store in one
+ * set-based statement (a key staged twice keeps its last value) and
+ * returns the number of rows it took, or -1 on error, after which the
+ * load should be abandoned. db_bulk_end drops whatever is uncommitted.
+ * Requires db_init. */
+typedef struct db_bulk db_bulk_t;
+
+db_bulk_t *db_bulk_begin(void);
+int db_bulk_add(db_bulk_t *b, const char *key, const char *value, long ttl_sec);
+long db_bulk_commit(db_bulk_t *b);
+void db_bulk_end(db_bulk_t *b);
+
+/* Cross-instance cache invalidation, for several servers sharing one
+ * database. db_invalidation_start installs a row trigger on kv_store that
+ * publishes every committed change with NOTIFY (it stays installed, so
+ * servers without a listener still publish), then listens on a connection
+ * of its own and calls cb from that thread for each change made by
+ * anyone else: cb(key, arg) when one key changed, cb(NULL, arg) when
+ * everything must go, which is also what happens after the listener had
+ * to reconnect. Our own writes are skipped. Requires db_init; db_close
+ * stops the listener. */
+typedef void (*db_invalidate_fn)(const char *key, void *arg);
+
+typedef struct {
+    int connected;
+    uint64_t received;     /* notifications, ours included */
+    uint64_t own;          /* from our own writes, skipped */
+    uint64_t applied;      /* single-key invalidations passed to cb */
+    uint64_t flushes;      /* cb(NULL) calls: oversized keys, reconnects */
+    uint64_t reconnects;
+    /* from the row change to its delivery here, for invalidations from
+     * others, measured against our own clock */
+    uint64_t lag_us_total;
+    uint64_t lag_us_last;
+    uint64_t lag_us_max;
+} db_invalidation_stats_t;
+
+int db_invalidation_start(db_invalidate_fn cb, void *arg);
+void db_invalidation_stop(void);
+/* Returns -1 if the listener is not running */
+int db_get_invalidation_stats(db_invalidation_stats_t *st);
+
+/* Read replicas. After db_replicas_start, db_get reads from the n
+ * replicas (conns_each connections apiece) in turn and falls back to the
+ * primary when none is healthy and idle, or for a key written within the
+ * last max_lag_ms plus a second. A replica is healthy while it answers
+ * and its replay lag is at most max_lag_ms; unreachable replicas are
+ * retried in the background, so start succeeds without them. Writes,
+ * scans, bulk loads and the async calls always use the primary.
+ * Requires db_init; db_close stops them. */
+#define DB_MAX_REPLICAS 8
+
+typedef struct {
+    size_t n;
+    unsigned max_lag_ms;
+    uint64_t primary_reads;      /* db_get calls a replica didn't serve */
+    uint64_t recent_write_reads; /* ...of which for a key written just before */
+    struct {
+        char label[64];          /* host:port */
+        int healthy;
+        int64_t lag_ms;          /* -1 = unknown */
+        uint64_t reads;
+        uint64_t errors;
+        size_t broken;           /* connections waiting to be reset */
+    } replicas[DB_MAX_REPLICAS];
+} db_replica_stats_t;
+
+int db_replicas_start(const char *const *conninfos, size_t n, int conns_each, unsigned max_lag_ms);
+void db_replicas_stop(void);
+/* Returns -1 if there are no replicas */
+int db_get_replica_stats(db_replica_stats_t *st);
+
 #endif /* DB_H */
@@ -0,0 +1,46 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* Epoch-based reclamation for lock-free readers.
+ *
+ * Readers bracket every access to shared nodes with epoch_enter/epoch_exit.
+ * Writers unlink a node, tag it with epoch_now() and keep it on a private
+ * retire list; once epoch_safe() has moved past that tag no reader can still
+ * hold a pointer to it and it may be freed.
+ */
+
+#define EPOCH_MAX_THREADS 1024
+
+typedef struct {
+    _Atomic uint64_t active; /* announced epoch, 0 = quiescent */
+    unsigned depth;          /* nesting depth, owner thread only */
+} __attribute__((aligned(64))) epoch_slot_t;
+
+typedef struct {
+    _Atomic uint64_t global;
+    _Atomic size_t overflow; /* readers beyond EPOCH_MAX_THREADS */
+    epoch_slot_t *slots;
+} epoch_domain_t;
+
+int epoch_domain_init(epoch_domain_t *d);
+void epoch_domain_destroy(epoch_domain_t *d);
+
+void epoch_enter(epoch_domain_t *d);
+void epoch_exit(epoch_domain_t *d);
+
+/* Process-wide index of the calling thread; values at or above
+ * EPOCH_MAX_THREADS are not tracked per slot */
+int epoch_thread_id(void);
+
+/* Tag for a node that has just been unlinked */
+uint64_t epoch_now(epoch_domain_t *d);
+
+/* Advance the global epoch and return the oldest epoch a reader may still be
+ * in. Nodes tagged strictly below the returned value can be freed. */
+uint64_t epoch_safe(epoch_domain_t *d);
+
+#endif /* EPOCH_H */
@@ -0,0 +1,54 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Write combiner in front of the storage backend.
+ *
+ * POST and DELETE handlers hand their write to group_commit_put/_delete
+ * and block. Flusher threads take whatever is pending, up to max_batch
+ * writes, waiting at most window_us for a batch to fill, and apply it as a
+ * single transaction (storage_write_batch). Every waiter then gets its own
+ * result, and only after the commit, so a 200 means as much as it did
+ * with one transaction per write; Postgres just flushes its WAL once per
+ * batch instead of once per write.
+ *
+ * A batch never holds two writes to the same key: a repeat closes the
+ * batch and goes first in the next one. Nor does it take a key another
+ * flusher is still committing; the batch stops there and the write waits
+ * for that commit. Together these keep per-key order. If a
+ * batch fails as a whole (e.g. a deadlock between two flushers), its
+ * writes are retried one by one so each waiter sees its own outcome. If
+ * it may have committed anyway (connection lost after sending), every
+ * waiter gets an error instead.
+ *
+ * When the combiner is not running both calls go straight to storage_put
+ * and storage_delete. It stays off for backends without a batch write.
+ */
+
+typedef struct {
+    size_t max_batch;
+    unsigned window_us;
+    size_t batches;
+    size_t ops;
+    size_t largest;        /* most writes in one batch so far */
+    uint64_t flush_ns;     /* time spent in storage_write_batch, all batches */
+    size_t fallbacks;      /* batches retried one write at a time */
+    size_t lost;           /* batches failed with an unknown outcome */
+    size_t pending;        /* queued right now */
+} group_commit_stats_t;
+
+/* Call after storage_open. max_batch 0 leaves the combiner off. */
+int group_commit_start(size_t max_batch, unsigned window_us, int flushers);
+/* Flushes what is queued, then returns; later writes go straight to storage */
+void group_commit_stop(void);
+
+/* Same contracts as storage_put and storage_delete */
+int group_commit_put(const char *key, const char *value, long ttl_sec);
+int group_commit_delete(const char *key);
+
+/* Returns -1 if the combiner is not running */
+int group_commit_get_stats(group_commit_stats_t *st);
+
+#endif /* GROUP_COMMIT_H */
@@ -0,0 +1,77 @@
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "epoch.h"
+
+/* Open-addressing hash index (Swiss-table layout).
+ *
+ * Slots are grouped 16 at a time; every slot has one control byte holding
+ * either EMPTY, DELETED or the low 7 bits of the entry hash. The 16 control
+ * bytes sit right in front of the 16 entry pointers of their group, so a
+ * probe touches one or two cache lines. A lookup compares a whole group of
+ * control bytes in one SSE2 instruction, then hands candidates to eq(),
+ * which compares the full 64-bit hash the entry carries before touching the
+ * key. Entries keep their own hash (hash_of), so removing or migrating them
+ * never rehashes a key.
+ *
+ * Writers must be serialized by the caller. Lookups may run concurrently
+ * inside epoch_enter/epoch_exit on the domain passed to hidx_init: entries
+ * are published with release stores and replaced tables are retired through
+ * the epoch domain. Growing is incremental: a new table is installed and
+ * each later write moves a few groups over, so no single put pays for a
+ * full rehash. A lookup racing with a resize may miss but never returns an
+ * entry that was not in the index.
+ */
+
+#define HIDX_GROUP 16
+
+typedef int (*hidx_eq_fn)(const void *entry, uint64_t hash, const void *key);
+typedef uint64_t (*hidx_hash_fn)(const void *entry);
+
+typedef struct {
+    _Atomic uint8_t ctrl[HIDX_GROUP];
+    _Atomic(void *) slots[HIDX_GROUP];
+} hidx_group_t;
+
+typedef struct hidx_table {
+    size_t n_groups; /* power of two */
+    size_t live;     /* full slots */
+    size_t used;     /* full + deleted slots */
+    hidx_group_t *groups;
+    struct hidx_table *rnext; /* retire list */
+    uint64_t retired_at;
+} hidx_table_t;
+
+typedef struct {
+    _Atomic(hidx_table_t *) cur;
+    _Atomic(hidx_table_t *) old; /* non-NULL while a resize drains it */
+    size_t migrate_pos;          /* next group of old to move */
+    hidx_table_t *retired;
+    hidx_eq_fn eq;
+    hidx_hash_fn hash_of;
+    epoch_domain_t *epoch;
+} hash_index_t;
+
+int hidx_init(hash_index_t *idx, size_t capacity_hint, hidx_eq_fn eq, hidx_hash_fn hash_of,
+              epoch_domain_t *epoch);
+void hidx_destroy(hash_index_t *idx);
+
+/* Safe for concurrent readers (inside an epoch) */
+void *hidx_find(hash_index_t *idx, uint64_t hash, const void *key);
+
+/* Writers only. insert assumes the key is absent; replace and remove find the
+ * slot by entry identity, so the entry's hash is all they need. */
+int hidx_insert(hash_index_t *idx, uint64_t hash, void *entry);
+int hidx_replace(hash_index_t *idx, uint64_t hash, void *old_entry, void *new_entry);
+int hidx_remove(hash_index_t *idx, uint64_t hash, void *entry);
+
+/* Number of live entries */
+size_t hidx_size(hash_index_t *idx);
+
+/* Bytes of group arrays currently allocated */
+size_t hidx_memory(hash_index_t *idx);
+
+#endif /* HASH_INDEX_H */
@@ -0,0 +1,50 @@
+#ifndef HOTKEYS_H
+#define HOTKEYS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Online top-K of the busiest keys (Space-Saving).
+ *
+ * Request paths call hotkeys_record. About one request in `sample`,
+ * picked at random per thread, reaches the tracker, and a sample that
+ * finds the tracker busy is dropped rather than waited for, so the request
+ * path never blocks. The tracker keeps k counters; an untracked key takes
+ * over the counter with the lowest count and inherits it as its error
+ * bound.
+ *
+ * A background thread closes a window every second: each key's rate is a
+ * moving average of its per-window hits and counts decay, so keys that
+ * cool down leave the top. Keys whose rate reaches hot_rps are handed to
+ * on_hot once per window, outside the tracker lock.
+ */
+
+#define HOTKEYS_KEY_MAX 256 /* longer keys are not tracked */
+
+typedef enum { HOTKEY_GET = 0, HOTKEY_PUT, HOTKEY_DELETE, HOTKEY_OPS } hotkey_op_t;
+
+typedef struct {
+    char key[HOTKEYS_KEY_MAX];
+    double rate;              /* requests/sec, all ops */
+    double op_rate[HOTKEY_OPS];
+    uint64_t count;           /* estimated requests (decayed), sampling undone */
+    uint64_t error;           /* count may overstate by up to this much */
+    int hot;                  /* rate >= hot_rps */
+} hotkey_t;
+
+typedef void (*hotkeys_hot_fn)(const char *key, void *arg);
+
+/* k counters, one sample per `sample` requests (rounded up to a power of
+ * two). hot_rps 0 = never call on_hot. */
+int hotkeys_start(size_t k, unsigned sample, double hot_rps, hotkeys_hot_fn on_hot, void *arg);
+void hotkeys_stop(void);
+
+void hotkeys_record(const char *key, hotkey_op_t op);
+
+/* Copies up to n keys, hottest first; returns how many. 0 if not running. */
+size_t hotkeys_top(hotkey_t *out, size_t n);
+
+/* Returns -1 if the tracker is not running */
+int hotkeys_get_config(size_t *k, unsigned *sample, double *hot_rps);
+
+#endif /* HOTKEYS_H */
@@ -2,11 +2,21 @@
 #define HTTP_SERVER_H
 
 #include "cache.h"
+#include "storage.h"
 
-/* initialize http server, returns 0 on success */
-int http_server_start(int port, lru_cache_t *cache, const char *db_conninfo, int threads);
+/* initialize http server on top of the given storage backend, in
+ * write-back mode with its WAL in wal_dir unless that is NULL, and with
+ * coherence set dropping cache entries that other servers write to;
+ * returns 0 on success */
+int http_server_start(int port, lru_cache_t *cache, int threads,
+                      const storage_backend_t *backend, const storage_config_t *cfg,
+                      const char *wal_dir, size_t wal_batch, int coherence);
 
-/* stop server (not implemented fully) */
+/* stop serving: the workers and the invalidation listener are gone
+ * once it returns, storage stays open */
 void http_server_stop(void);
+/* after http_server_stop: apply what write-back still holds, then close
+ * storage */
+void http_server_close(void);
 
 #endif /* HTTP_SERVER_H */
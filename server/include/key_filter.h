@@ -0,0 +1,51 @@
+#ifndef KEY_FILTER_H
+#define KEY_FILTER_H
+
+#include <stddef.h>
+
+/* Membership filter of the keys in storage, so a GET for a key that was
+ * never written can 404 without a storage read.
+ *
+ * A background thread builds the filter by streaming keys out of the
+ * backend (storage_scan_keys) and rebuilds it from scratch once enough deletes have
+ * piled up or more keys arrived than it was sized for; Bloom filters can't
+ * forget. Until the first build finishes every key is reported as maybe
+ * present. Writes that land during a build go into both the live and the
+ * new filter, so no key is ever lost across the swap.
+ *
+ * The filter only knows about writes made through this server and those
+ * it is told about with key_filter_add.
+ */
+
+typedef struct {
+    int ready;              /* first build finished */
+    size_t keys;            /* adds since the current filter was built */
+    size_t capacity;        /* keys the current filter was sized for */
+    size_t memory_bytes;
+    unsigned hashes;
+    double target_fpr;
+    double estimated_fpr;   /* from the current bit density */
+    size_t rebuilds;
+    size_t db_reads_skipped;
+} key_filter_stats_t;
+
+/* Starts the build thread; call after storage_open. expected_keys is a floor,
+ * rebuilds size for what the table actually holds. */
+int key_filter_start(size_t expected_keys, double fpr);
+void key_filter_stop(void);
+
+/* Call after the DB write has committed */
+void key_filter_add(const char *key);
+void key_filter_note_delete(void);
+/* Writes may have gone unseen: report every key as maybe present until a
+ * build started after this call has finished */
+void key_filter_reset(void);
+
+/* 0 = definitely not in the DB (counted as a skipped read), 1 = maybe.
+ * Always 1 when the filter is not running or not built yet. */
+int key_filter_may_contain(const char *key);
+
+/* Returns -1 if the filter is not running */
+int key_filter_get_stats(key_filter_stats_t *st);
+
+#endif /* KEY_FILTER_H */
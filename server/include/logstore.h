@@ -0,0 +1,57 @@
+#ifndef LOGSTORE_H
+#define LOGSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Embedded log-structured store: the "log" storage backend.
+ *
+ * Every put and delete is appended, as one CRC-checked record, to the
+ * active segment file in dir; a segment that reaches segment_bytes is
+ * sealed and a new one started. An in-memory hash index maps each key to
+ * its newest record, and reads are a single pread. On open the index is
+ * rebuilt by mmap-scanning the segments oldest first; a torn record at
+ * the tail of the newest one (a crash mid-append) is cut off.
+ *
+ * A background thread compacts sealed segments that are mostly dead
+ * (overwritten, deleted or expired data): live records are appended again
+ * and the old file is removed.
+ *
+ * fsync_ms 0 makes every write durable before it returns; writers that
+ * arrive while an fdatasync is running share the next one. fsync_ms > 0
+ * acknowledges writes right away and syncs every fsync_ms milliseconds,
+ * so a crash can lose that much.
+ */
+
+typedef struct {
+    size_t keys;
+    size_t segments;
+    uint64_t disk_bytes;      /* all segment files */
+    uint64_t live_bytes;      /* records the index still points at */
+    size_t compactions;       /* segments rewritten and removed */
+    uint64_t reclaimed_bytes;
+    uint64_t appends;
+    uint64_t fsyncs;
+    unsigned fsync_ms;
+} logstore_stats_t;
+
+int logstore_open(const char *dir, size_t segment_bytes, unsigned fsync_ms);
+void logstore_close(void);
+
+/* Same contracts as db_get, db_put and db_delete */
+int logstore_get(const char *key, char **out_value, long *ttl_left);
+int logstore_put(const char *key, const char *value, long ttl_sec);
+int logstore_delete(const char *key);
+
+/* Drops up to batch expired keys from the index; their space goes on the
+ * next compaction. Returns how many. */
+long logstore_purge_expired(int batch);
+
+/* Calls cb for every key, from a copy taken up front so writers aren't
+ * held up; cb returns non-zero to stop (-1 returned). */
+long logstore_scan_keys(int (*cb)(const char *key, void *arg), void *arg);
+
+/* Returns -1 if the store is not open */
+int logstore_get_stats(logstore_stats_t *st);
+
+#endif /* LOGSTORE_H */
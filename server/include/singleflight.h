@@ -0,0 +1,40 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <stddef.h>
+
+/* Per-key request coalescing.
+ *
+ * sf_do runs fetch for a key unless a call for the same key is already in
+ * flight, in which case it waits for that call and shares its result. The
+ * first caller (the leader) does the work, e.g. the DB read plus the cache
+ * fill; everyone who piles up behind it gets a private copy of the value.
+ */
+
+typedef struct singleflight singleflight_t;
+
+/* Returns 0 and sets *out_value (caller frees) on success, non-zero if not
+ * found or on error */
+typedef int (*sf_fetch_fn)(const char *key, char **out_value, void *arg);
+
+typedef struct {
+    size_t leaders;   /* calls that ran fetch */
+    size_t coalesced; /* calls that waited for a leader instead */
+} sf_stats_t;
+
+singleflight_t *sf_create(size_t n_buckets);
+void sf_destroy(singleflight_t *sf);
+
+/* Returns fetch's result, shared or not. *shared (may be NULL) is set to 1
+ * when the value came from another caller's fetch. */
+int sf_do(singleflight_t *sf, const char *key, sf_fetch_fn fetch, void *arg,
+          char **out_value, int *shared);
+
+/* Callers arriving after this start a new fetch instead of joining one
+ * that is already running. Use after a write so readers that come later
+ * can't be handed a value read before it. */
+void sf_forget(singleflight_t *sf, const char *key);
+
+void sf_get_stats(singleflight_t *sf, sf_stats_t *st);
+
+#endif /* SINGLEFLIGHT_H */
@@ -0,0 +1,38 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Count-min sketch of access frequency (TinyLFU).
+ *
+ * Four rows of 4-bit saturating counters, sixteen to a 64-bit word. An
+ * estimate is the minimum over the rows, so collisions only ever inflate it.
+ * After sample_size increments every counter is halved, so old popularity
+ * fades and the sketch follows a shifting working set.
+ *
+ * increment and estimate are lock-free and may race with each other and
+ * with the halving; a lost update only nudges an estimate by one.
+ */
+
+#define SKETCH_ROWS 4
+
+typedef struct {
+    _Atomic uint64_t *table; /* SKETCH_ROWS rows of words_per_row words */
+    size_t words_per_row;    /* power of two */
+    size_t sample_size;      /* increments between halvings */
+    _Atomic size_t additions;
+} sketch_t;
+
+/* Sized for roughly `capacity` distinct hot keys */
+int sketch_init(sketch_t *sk, size_t capacity);
+void sketch_destroy(sketch_t *sk);
+
+void sketch_increment(sketch_t *sk, uint64_t hash);
+unsigned sketch_estimate(const sketch_t *sk, uint64_t hash);
+
+/* Bytes of counter table */
+size_t sketch_memory(const sketch_t *sk);
+
+#endif /* SKETCH_H */
@@ -0,0 +1,52 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size-classed slab allocator for cache nodes.
+ *
+ * Memory is taken from the OS in pages (1 MiB, or 2 MiB huge pages when
+ * enabled), each page is dedicated to one size class and carved lazily.
+ * Freed items go on the class free list. Not thread-safe: every cache shard
+ * owns one slab and only touches it under the shard lock.
+ */
+
+#define SLAB_N_CLASSES 16
+#define SLAB_LARGE 0xff /* class id of items that bypassed the slab (malloc) */
+
+typedef struct slab_page {
+    struct slab_page *next;
+    size_t size; /* mapped bytes */
+} slab_page_t;
+
+typedef struct {
+    void *free_list;
+    char *carve;      /* next never-used item in the current page */
+    char *carve_end;
+    size_t in_use;    /* items handed out */
+} slab_class_t;
+
+typedef struct {
+    slab_class_t classes[SLAB_N_CLASSES];
+    slab_page_t *pages;
+    size_t page_size;
+    int hugepages;
+    size_t reserved_bytes; /* mapped from the OS */
+    size_t large_bytes;    /* outstanding malloc'd items */
+} slab_t;
+
+void slab_init(slab_t *s, int hugepages);
+void slab_destroy(slab_t *s);
+
+/* Returns an item of at least size bytes and its class id in *cls */
+void *slab_alloc(slab_t *s, size_t size, uint8_t *cls);
+void slab_free(slab_t *s, void *p, uint8_t cls, size_t size);
+
+/* Bytes actually consumed by an item of the given request size */
+size_t slab_item_size(size_t size);
+
+/* Sum of item sizes currently handed out (excluding free list slack) */
+size_t slab_used_bytes(const slab_t *s);
+
+#endif /* SLAB_H */
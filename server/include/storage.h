@@ -0,0 +1,93 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include "db.h"
+
+/* Storage backend, picked at startup.
+ *
+ * Everything above this layer (HTTP handlers, group commit, the key
+ * filter, the TTL purge) goes through the storage_* calls below, which
+ * forward to the backend that storage_open was given. The contracts are
+ * those of the matching db_* calls in db.h.
+ *
+ *   postgres  kv_store in Postgres via the db.c pool (the default)
+ *   log       embedded append-only log on local disk (logstore.h)
+ */
+
+typedef struct {
+    /* postgres */
+    const char *conninfo;
+    int db_conns;
+    db_mode_t db_mode;
+    /* reads go to these when they can, see db_replicas_start */
+    const char *const *db_replicas;
+    size_t n_db_replicas;
+    unsigned replica_max_lag_ms;
+    /* non-NULL: follow other servers' writes, see db_invalidation_start */
+    db_invalidate_fn on_invalidate;
+    void *invalidate_arg;
+    /* log */
+    const char *log_dir;
+    size_t log_segment_bytes;
+    unsigned log_fsync_ms;
+} storage_config_t;
+
+typedef struct {
+    const char *name;
+    int (*open)(const storage_config_t *cfg);
+    void (*close)(void);
+    int (*get)(const char *key, char **out_value, long *ttl_left);
+    int (*put)(const char *key, const char *value, long ttl_sec);
+    int (*del)(const char *key);
+    /* optional, NULL if the backend has no use for them */
+    int (*write_batch)(size_t n_put, const char *const *put_keys, const char *const *put_values,
+                       const long *put_ttls, size_t n_del, const char *const *del_keys, int *deleted);
+    long (*purge_expired)(int batch);
+    long (*scan_keys)(int (*cb)(const char *key, void *arg), void *arg);
+    long (*get_many)(size_t n, const char *const *keys, char **values, long *ttls);
+    /* bulk load, see storage_bulk_begin */
+    void *(*bulk_begin)(void);
+    int (*bulk_add)(void *bulk, const char *key, const char *value, long ttl_sec);
+    long (*bulk_commit)(void *bulk);
+    void (*bulk_end)(void *bulk);
+} storage_backend_t;
+
+extern const storage_backend_t storage_postgres;
+extern const storage_backend_t storage_log;
+
+/* Backend by name, NULL if there is none */
+const storage_backend_t *storage_find(const char *name);
+
+/* Returns 0 on success; the backend stays active until storage_close */
+int storage_open(const storage_backend_t *backend, const storage_config_t *cfg);
+void storage_close(void);
+/* Active backend, NULL before storage_open */
+const storage_backend_t *storage_backend(void);
+
+int storage_get(const char *key, char **out_value, long *ttl_left);
+int storage_put(const char *key, const char *value, long ttl_sec);
+int storage_delete(const char *key);
+/* One storage_get per key if the backend has no multi-key read */
+long storage_get_many(size_t n, const char *const *keys, char **values, long *ttls);
+/* -1 without touching anything if the backend has no batch write; -2 if
+ * the batch may or may not have been applied (see db_write_batch) */
+int storage_write_batch(size_t n_put, const char *const *put_keys, const char *const *put_values,
+                        const long *put_ttls, size_t n_del, const char *const *del_keys, int *deleted);
+/* 0 if the backend doesn't keep expired entries around */
+long storage_purge_expired(int batch);
+/* -1 if the backend can't list its keys */
+long storage_scan_keys(int (*cb)(const char *key, void *arg), void *arg);
+
+/* Bulk load. Rows given to storage_bulk_add become visible at the next
+ * storage_bulk_commit, which returns how many rows it committed or -1 on
+ * error; storage_bulk_end drops anything uncommitted. Backends without a
+ * bulk path get one storage_put per row, visible right away. */
+typedef struct storage_bulk storage_bulk_t;
+
+storage_bulk_t *storage_bulk_begin(void);
+int storage_bulk_add(storage_bulk_t *b, const char *key, const char *value, long ttl_sec);
+long storage_bulk_commit(storage_bulk_t *b);
+void storage_bulk_end(storage_bulk_t *b);
+
+#endif /* STORAGE_H */
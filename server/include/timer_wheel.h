@@ -0,0 +1,50 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Hierarchical timing wheel with one-tick resolution.
+ *
+ * Four levels of 64 slots cover 64, 4096, 262144 and 16777216 ticks; a
+ * timer sits in the lowest level whose span still contains both "now" and
+ * its deadline, and moves down a level each time the wheel enters the
+ * block it belongs to. Add and delete are O(1) and a tick touches one slot
+ * per level it crosses, so advancing costs O(1) plus the timers that fire.
+ * Deadlines beyond the top level wait on an overflow list.
+ *
+ * Links are intrusive; the wheel reads a timer's deadline through
+ * expires_of. Not thread-safe: the owner serializes every call.
+ */
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+
+typedef struct tw_link {
+    struct tw_link *next;
+    struct tw_link **pprev; /* NULL when not on the wheel */
+} tw_link_t;
+
+typedef uint32_t (*tw_expires_fn)(const tw_link_t *link);
+typedef void (*tw_expire_fn)(tw_link_t *link, void *arg);
+
+typedef struct {
+    tw_link_t *slots[TW_LEVELS][TW_SLOTS];
+    tw_link_t *overflow;
+    uint32_t now;
+    size_t count;
+    tw_expires_fn expires_of;
+} timer_wheel_t;
+
+void tw_init(timer_wheel_t *tw, uint32_t now, tw_expires_fn expires_of);
+
+/* Deadlines at or before now fire on the next tick */
+void tw_add(timer_wheel_t *tw, tw_link_t *link);
+void tw_del(timer_wheel_t *tw, tw_link_t *link);
+
+/* Tick up to now, calling expire for each timer that comes due. The link
+ * is already off the wheel when expire runs, so expire may free it. */
+void tw_advance(timer_wheel_t *tw, uint32_t now, tw_expire_fn expire, void *arg);
+
+#endif /* TIMER_WHEEL_H */
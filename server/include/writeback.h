@@ -0,0 +1,71 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Write-back mode: writes are acknowledged once they are in a local WAL.
+ *
+ * writeback_put/_delete append the write to a segment file in dir and
+ * return as soon as it is fdatasync'ed; writers that arrive during a sync
+ * share the next one. An applier thread then streams the log into storage
+ * in batches of up to apply_batch writes (later writes to the same key
+ * win within a batch) and, once a batch has committed, records its
+ * position in dir/checkpoint and drops segments that are fully applied.
+ *
+ * Until a write has been applied it is kept in memory, and writeback_get
+ * answers from there, so a read never sees storage lag behind a reply
+ * that was already sent. On start every write past the checkpoint is
+ * reloaded, handed to the replay callback (value NULL for a delete) so the
+ * cache can be brought up to date, and applied again; applying is
+ * idempotent, so a crash between commit and checkpoint is harmless.
+ *
+ * A DELETE still has to know whether the key exists, which may cost a
+ * storage read, but never a commit. If storage is down writes keep being
+ * accepted until a million are waiting, then block.
+ *
+ * When write-back is off, the calls go to group commit (writes) and
+ * storage (reads) as before.
+ */
+
+typedef struct {
+    uint64_t appended;      /* writes logged since start */
+    uint64_t replayed;      /* writes found unapplied at start */
+    uint64_t applied;
+    size_t pending;         /* logged, not yet in storage */
+    uint64_t batches;
+    uint64_t apply_ns;      /* time spent applying, all batches */
+    uint64_t retries;       /* batches that failed and were tried again */
+    uint64_t fsyncs;
+    uint64_t checkpoint;    /* sequence number of the last applied write */
+    uint64_t wal_bytes;     /* segment files on disk */
+} writeback_stats_t;
+
+typedef void (*writeback_replay_fn)(const char *key, const char *value, long ttl_left, void *arg);
+
+/* Call after storage_open. Replays the WAL in dir (created if missing)
+ * through replay before returning. */
+int writeback_start(const char *dir, size_t apply_batch, writeback_replay_fn replay, void *arg);
+/* Applies what it can of the backlog, then closes the WAL */
+void writeback_stop(void);
+
+/* Same contracts as group_commit_put/_delete and storage_get */
+int writeback_put(const char *key, const char *value, long ttl_sec);
+int writeback_delete(const char *key);
+int writeback_get(const char *key, char **out_value, long *ttl_left);
+
+/* Batch forms. writeback_write_many logs n writes (values[i] NULL deletes
+ * keys[i]; keys distinct) with one sync, or with write-back off sends them
+ * to storage as one batch; 0 on success. writeback_get_many is
+ * storage_get_many behind the unapplied writes. */
+int writeback_write_many(size_t n, const char *const *keys, const char *const *values, const long *ttls);
+long writeback_get_many(size_t n, const char *const *keys, char **values, long *ttls);
+
+/* Keys with an unapplied put, for filters built from a storage scan; 0
+ * when write-back is off */
+long writeback_scan_pending(int (*cb)(const char *key, void *arg), void *arg);
+
+/* Returns -1 if write-back is off */
+int writeback_get_stats(writeback_stats_t *st);
+
+#endif /* WRITEBACK_H */
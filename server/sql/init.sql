@@ -15,9 +15,14 @@ CREATE DATABASE kvdb OWNER kvuser;
 
 CREATE TABLE IF NOT EXISTS kv_store (
     key TEXT PRIMARY KEY,
-    value TEXT
+    value TEXT,
+    expires_at TIMESTAMPTZ
 );
 
+-- only rows with a TTL are indexed; the purge scans just those
+CREATE INDEX IF NOT EXISTS kv_store_expires_at ON kv_store (expires_at)
+    WHERE expires_at IS NOT NULL;
+
 ALTER TABLE kv_store OWNER TO kvuser;
 GRANT ALL PRIVILEGES ON TABLE kv_store TO kvuser;
 GRANT CONNECT ON DATABASE kvdb TO kvuser;
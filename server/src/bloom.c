@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include "bloom.h"
+#include <stdlib.h>
+#include <math.h>
+
+/* FNV-1a then a 64-bit finalizer; the two probe hashes come from one pass
+ * over the key (Kirsch-Mitzenmacher double hashing). */
+static void hash_key(const char *s, uint64_t *h1, uint64_t *h2) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    *h1 = h;
+    *h2 = (h >> 32 | h << 32) | 1;
+}
+
+bloom_t *bloom_create(size_t expected_keys, double fpr) {
+    if (expected_keys == 0) expected_keys = 1;
+    if (fpr <= 0.0 || fpr >= 1.0) return NULL;
+    /* m = -n ln p / (ln 2)^2, k = m/n ln 2 */
+    double m = -(double)expected_keys * log(fpr) / (M_LN2 * M_LN2);
+    size_t n_bits = ((size_t)m + 63) & ~(size_t)63;
+    if (n_bits < 64) n_bits = 64;
+    unsigned k = (unsigned)lround((double)n_bits / (double)expected_keys * M_LN2);
+    if (k < 1) k = 1;
+    if (k > 16) k = 16;
+
+    bloom_t *b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    b->words = calloc(n_bits / 64, sizeof(*b->words));
+    if (!b->words) {
+        free(b);
+        return NULL;
+    }
+    b->n_bits = n_bits;
+    b->n_hashes = k;
+    b->capacity = expected_keys;
+    atomic_init(&b->added, 0);
+    return b;
+}
+
+void bloom_destroy(bloom_t *b) {
+    if (!b) return;
+    free((void *)b->words);
+    free(b);
+}
+
+void bloom_add(bloom_t *b, const char *key) {
+    uint64_t h1, h2;
+    hash_key(key, &h1, &h2);
+    for (unsigned i = 0; i < b->n_hashes; ++i) {
+        uint64_t bit = (h1 + i * h2) % b->n_bits;
+        uint64_t mask = 1ULL << (bit & 63);
+        /* skip the write when already set, keeps hot lines shared */
+        if (!(atomic_load_explicit(&b->words[bit >> 6], memory_order_relaxed) & mask))
+            atomic_fetch_or_explicit(&b->words[bit >> 6], mask, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&b->added, 1, memory_order_relaxed);
+}
+
+int bloom_may_contain(const bloom_t *b, const char *key) {
+    uint64_t h1, h2;
+    hash_key(key, &h1, &h2);
+    for (unsigned i = 0; i < b->n_hashes; ++i) {
+        uint64_t bit = (h1 + i * h2) % b->n_bits;
+        if (!(atomic_load_explicit(&b->words[bit >> 6], memory_order_relaxed) & (1ULL << (bit & 63))))
+            return 0;
+    }
+    return 1;
+}
+
+size_t bloom_memory(const bloom_t *b) {
+    return b->n_bits / 8;
+}
+
+double bloom_estimated_fpr(const bloom_t *b) {
+    size_t set = 0;
+    for (size_t i = 0; i < b->n_bits / 64; ++i)
+        set += (size_t)__builtin_popcountll(atomic_load_explicit(&b->words[i], memory_order_relaxed));
+    return pow((double)set / (double)b->n_bits, (double)b->n_hashes);
+}
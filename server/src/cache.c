@@ -1,186 +1,1238 @@
 #define _GNU_SOURCE
 #include "cache.h"
+#include "epoch.h"
+#include "slab.h"
+#include "hash_index.h"
+#include "sketch.h"
+#include "crc32.h"
+#include "timer_wheel.h"
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lz4.h>
 
-/* Implementation: a hashmap (separate chaining) + doubly-linked list for LRU.
- * Thread-safe via a mutex.
+/* Implementation: the cache is split into N independent shards, each one an
+ * open-addressing hash index + doubly-linked list guarded by its own mutex.
+ * The key hash picks the shard, so threads working on different keys rarely
+ * contend on the same lock.
+ *
+ * Reads take no lock at all. Nodes are immutable once published (an update
+ * swaps in a fresh node), readers probe the index with acquire loads and,
+ * instead of relinking the node, just set its reference bit. Eviction
+ * runs CLOCK (second chance) over the shard list under the shard lock, and
+ * unlinked nodes are freed through epoch-based reclamation once no reader
+ * can still see them.
+ *
+ * Each node is a single allocation from the shard's slab: header, key and
+ * value stored back to back, so an insert costs one allocation and an
+ * eviction one free onto the shard's free list.
+ *
+ * A shard is bounded by entry count and, optionally, by bytes. An entry is
+ * charged its slab item size plus its index slot, so the budget tracks what
+ * the cache really holds rather than just key and value lengths.
+ *
+ * With LRU_POLICY_TINYLFU a shard runs W-TinyLFU instead of plain CLOCK:
+ * new entries land in a small window (1% of the shard) and, once pushed out
+ * of it, only enter the CLOCK main region if a count-min sketch of recent
+ * accesses rates them hotter than the entry they would evict. A scan of
+ * one-off keys then churns the window instead of the hot set. The window is
+ * FIFO rather than true LRU, since readers never relink nodes.
+ *
+ * lru_cache_acquire hands out the node itself as a value handle. A handle
+ * bumps the node's pin count inside the read epoch, and reclaim() skips
+ * pinned nodes, so a value being written to a socket outlives an update or
+ * eviction of its key. Release is a single atomic decrement; the node goes
+ * back to the slab on a later reclaim pass under the shard lock.
+ *
+ * The optional near cache (L1) is a small direct-mapped table per reader
+ * thread. A slot keeps a pin on the node it points at plus the version its
+ * shard had when the slot was filled. Every update, delete or eviction in
+ * the shard bumps the version after the index change is published, so a
+ * hit is a hash compare, a key compare and one load of a read-mostly
+ * counter, with no writes to shared memory.
+ *
+ * Entries with a TTL sit on their shard's timing wheel. A background thread
+ * ticks every wheel once a second and drops what came due, so expired
+ * entries give their memory back without waiting to reach the CLOCK hand.
+ * Readers also check the deadline themselves and treat an expired entry as
+ * a miss, so nothing is served stale between ticks.
+ *
+ * With compress_min set, values at least that long are stored LZ4
+ * compressed when that saves an eighth or more. Compression runs before
+ * the shard lock is taken and the budget is charged the stored size.
+ * Readers decompress on every hit: lru_cache_get into its copy,
+ * lru_cache_acquire into a private heap buffer that the handle owns.
+ *
+ * A handle's pin is the one write a hit makes to the node, and for a key
+ * every thread wants, that cache line bounces between cores. lru_cache_
+ * replicate gives such a node hot_replicas private copies on their own
+ * lines; acquire pins the copy picked by its thread id instead. The copies
+ * are immutable like the node and are freed with it once none is pinned.
  */
 
+/* retired nodes per shard before attempting to reclaim */
+#define RECLAIM_BATCH 64
+
+/* near cache hits per sketch increment under TinyLFU (power of two) */
+#define L1_SKETCH_SAMPLE 16
+
 typedef struct node {
-    char *key;
-    char *value;
-    struct node *prev, *next; /* for LRU list */
-    struct node *hnext; /* for hash bucket chain */
+    struct node *prev, *next; /* for CLOCK list, writers only */
+    union {
+        tw_link_t expiry; /* timer wheel, while in the index with a TTL */
+        struct {
+            struct node *rnext; /* retire list, once unlinked */
+            uint64_t retired_at;
+        };
+    };
+    uint64_t hash; /* kept so eviction never rehashes the key */
+    uint32_t klen, vlen;
+    uint32_t expires; /* cache clock second it dies at, 0 = never */
+    atomic_uchar ref; /* CLOCK reference bit, set by readers */
+    uint8_t slab_class;
+    uint8_t in_window; /* TinyLFU: on the window list, not main */
+    uint8_t compressed; /* value is LZ4, vlen bytes inflating to raw_len */
+    atomic_uint pins; /* outstanding lru_value_t handles */
+    uint32_t raw_len;
+    _Atomic(struct node *) replicas; /* hot key copies, set once */
+    char data[]; /* key '\0' value '\0' */
 } node_t;
 
-struct lru_cache {
+#define node_key(n) ((n)->data)
+#define node_value(n) ((n)->data + (n)->klen + 1)
+#define node_size(klen, vlen) (sizeof(node_t) + (klen) + (vlen) + 2)
+
+/* pointer + control byte in the hash index */
+#define INDEX_SLOT_BYTES (sizeof(void *) + 1)
+#define node_charge(klen, vlen) (slab_item_size(node_size(klen, vlen)) + INDEX_SLOT_BYTES)
+
+/* replicas sit back to back, each on its own cache lines */
+#define replica_stride(n) ((node_size((n)->klen, (n)->vlen) + 63) & ~(size_t)63)
+#define replica_at(r, n, i) ((node_t *)((char *)(r) + (i) * replica_stride(n)))
+
+typedef struct {
+    node_t *head; /* most recently inserted */
+    node_t *tail; /* clock hand */
+} node_list_t;
+
+/* Aligned to a cache line so neighbouring shard locks don't false-share */
+typedef struct shard {
     size_t capacity;
     size_t size;
-    node_t **buckets;
-    size_t n_buckets;
-    node_t *head; /* most recently used */
-    node_t *tail; /* least recently used */
+    size_t max_bytes; /* 0 = entries only */
+    size_t bytes;
+    hash_index_t index;
+    node_list_t main;
+    timer_wheel_t wheel; /* entries with a TTL */
+    size_t expired;
+    /* TinyLFU admission window and frequency sketch */
+    node_list_t window;
+    size_t win_size, win_bytes;
+    size_t win_cap, win_max_bytes;
+    sketch_t sketch;
+    size_t admitted, rejected;
+    size_t n_compressed, compressed_bytes, compressed_raw_bytes;
+    size_t n_replicated;  /* indexed nodes with replicas */
+    size_t replica_bytes; /* all replicas, retired ones until freed */
+    node_t *retired; /* unlinked, waiting for readers to drain */
+    size_t n_retired;
+    slab_t slab;
     pthread_mutex_t lock;
+    /* bumped whenever a node leaves the index; own line, near-cache hits read it */
+    _Atomic uint64_t version __attribute__((aligned(64)));
+} __attribute__((aligned(64))) shard_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t version; /* shard version when filled */
+    node_t *node;     /* pinned while in the slot */
+    unsigned lent;    /* handles borrowing this slot's pin */
+} l1_slot_t;
+
+/* Decompression counters, one line per reader thread */
+typedef struct {
+    _Atomic uint64_t count, ns;
+} __attribute__((aligned(64))) zstat_t;
+
+/* One per reader thread; only the owner touches the slots */
+typedef struct {
+    _Atomic size_t hits; /* read by lru_cache_get_stats */
+    unsigned tick;
+    l1_slot_t slots[];
+} l1_table_t;
+
+struct lru_cache {
+    size_t capacity;
+    size_t max_bytes;
+    size_t max_entry_bytes; /* larger entries bypass the cache */
+    shard_t *shards;
+    size_t n_shards; /* power of two */
+    unsigned shard_bits;
+    int hugepages;
+    lru_cache_policy_t policy;
+    size_t l1_size; /* slots per thread, power of two; 0 = no near cache */
+    _Atomic(l1_table_t *) *l1; /* indexed by epoch_thread_id() */
+    size_t compress_min; /* 0 = store values as given */
+    unsigned hot_replicas; /* copies per replicated key; 0 = off */
+    zstat_t *zstats;     /* indexed by epoch_thread_id(), with compress_min */
+    epoch_domain_t epoch;
+    /* TTL clock and the thread that ticks the shard wheels */
+    time_t clock_base;
+    pthread_t expiry_thread;
+    pthread_mutex_t expiry_lock;
+    pthread_cond_t expiry_cond;
+    int expiry_stop;
 };
 
-static unsigned long hash_str(const char *s) {
-    unsigned long h = 5381;
+/* djb2 followed by a 64-bit finalizer: the index uses the low bits for its
+ * control bytes and probe start, the shard comes from the top bits. */
+static uint64_t hash_str(const char *s) {
+    uint64_t h = 5381;
     int c;
     while ((c = *s++)) h = ((h << 5) + h) + c;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
     return h;
 }
 
+/* Seconds since the cache was created, plus one so 0 can mean "never" */
+static uint32_t cache_clock(const lru_cache_t *c) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec - c->clock_base) + 1;
+}
+
+static int node_expired(const lru_cache_t *c, const node_t *n) {
+    return n->expires && n->expires <= cache_clock(c);
+}
+
+static uint32_t node_expires(const tw_link_t *link) {
+    return ((const node_t *)((const char *)link - offsetof(node_t, expiry)))->expires;
+}
+
+static void *expiry_main(void *arg);
+
+static shard_t *shard_for(lru_cache_t *c, uint64_t h) {
+    if (c->shard_bits == 0) return &c->shards[0];
+    return &c->shards[h >> (64 - c->shard_bits)];
+}
+
+static int node_key_eq(const void *entry, uint64_t hash, const void *key) {
+    const node_t *n = entry;
+    return n->hash == hash && strcmp(n->data, (const char *)key) == 0;
+}
+
+static uint64_t node_hash(const void *entry) {
+    return ((const node_t *)entry)->hash;
+}
+
+/* Value bytes as stored in a node, compressed or not */
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t raw_len; /* 0 = data is the plain value */
+    char *buf;      /* compressed copy to free, if any */
+} stored_value_t;
+
+/* LZ4 the value when it is long enough and it pays; never fails, a value
+ * that can't be compressed is just stored as is */
+static void store_value(const lru_cache_t *c, const char *value, size_t vlen, stored_value_t *sv) {
+    sv->data = value;
+    sv->len = vlen;
+    sv->raw_len = 0;
+    sv->buf = NULL;
+    if (!c->compress_min || vlen < c->compress_min || vlen > LZ4_MAX_INPUT_SIZE) return;
+    int bound = LZ4_compressBound((int)vlen);
+    char *buf = malloc((size_t)bound);
+    if (!buf) return;
+    int n = LZ4_compress_default(value, buf, (int)vlen, bound);
+    if (n <= 0 || (size_t)n > vlen - vlen / 8) {
+        free(buf);
+        return;
+    }
+    sv->data = buf;
+    sv->len = (size_t)n;
+    sv->raw_len = vlen;
+    sv->buf = buf;
+}
+
+/* Raw value of n into dst (raw_len + 1 bytes), NUL-terminated */
+static int node_inflate(const node_t *n, char *dst) {
+    int got = LZ4_decompress_safe(node_value(n), dst, (int)n->vlen, (int)n->raw_len);
+    if (got != (int)n->raw_len) return -1;
+    dst[n->raw_len] = '\0';
+    return 0;
+}
+
+/* node_inflate for the read path, timed into the calling thread's counters */
+static int node_inflate_timed(lru_cache_t *c, const node_t *n, char *dst) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int rc = node_inflate(n, dst);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    int tid = epoch_thread_id();
+    if (tid < EPOCH_MAX_THREADS) {
+        zstat_t *z = &c->zstats[tid];
+        uint64_t ns = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000ULL + (uint64_t)t1.tv_nsec -
+                      (uint64_t)t0.tv_nsec;
+        atomic_store_explicit(&z->count, atomic_load_explicit(&z->count, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        atomic_store_explicit(&z->ns, atomic_load_explicit(&z->ns, memory_order_relaxed) + ns,
+                              memory_order_relaxed);
+    }
+    return rc;
+}
+
+/* Caller holds the shard lock */
+static node_t *node_new(shard_t *s, uint64_t hash, const char *key, size_t klen,
+                        const stored_value_t *sv, uint32_t expires) {
+    size_t vlen = sv->len;
+    uint8_t cls;
+    node_t *n = slab_alloc(&s->slab, node_size(klen, vlen), &cls);
+    if (!n) return NULL;
+    memset(n, 0, sizeof(*n));
+    n->klen = (uint32_t)klen;
+    n->vlen = (uint32_t)vlen;
+    n->slab_class = cls;
+    n->hash = hash;
+    n->expires = expires;
+    n->compressed = sv->raw_len != 0;
+    n->raw_len = (uint32_t)(sv->raw_len ? sv->raw_len : vlen);
+    memcpy(node_key(n), key, klen + 1);
+    memcpy(node_value(n), sv->data, vlen);
+    node_value(n)[vlen] = '\0';
+    return n;
+}
+
+static void node_free(shard_t *s, node_t *n) {
+    free(atomic_load_explicit(&n->replicas, memory_order_relaxed));
+    slab_free(&s->slab, n, n->slab_class, node_size(n->klen, n->vlen));
+}
+
+/* Outstanding handles on the node and on any of its replicas */
+static unsigned node_pins(const lru_cache_t *c, node_t *n) {
+    unsigned pins = atomic_load_explicit(&n->pins, memory_order_acquire);
+    node_t *r = atomic_load_explicit(&n->replicas, memory_order_relaxed);
+    for (unsigned i = 0; r && i < c->hot_replicas; ++i)
+        pins += atomic_load_explicit(&replica_at(r, n, i)->pins, memory_order_acquire);
+    return pins;
+}
+
+static void reclaim(lru_cache_t *c, shard_t *s) {
+    uint64_t safe = epoch_safe(&c->epoch);
+    node_t **pp = &s->retired;
+    while (*pp) {
+        node_t *n = *pp;
+        /* pins are only taken inside an epoch, so once the epoch is safe the
+         * count can only go down */
+        if (n->retired_at < safe && node_pins(c, n) == 0) {
+            *pp = n->rnext;
+            if (atomic_load_explicit(&n->replicas, memory_order_relaxed))
+                s->replica_bytes -= c->hot_replicas * replica_stride(n);
+            node_free(s, n);
+            s->n_retired--;
+        } else {
+            pp = &n->rnext;
+        }
+    }
+}
+
+/* n must already be unreachable from the index */
+static void retire_node(lru_cache_t *c, shard_t *s, node_t *n) {
+    n->retired_at = epoch_now(&c->epoch);
+    n->rnext = s->retired;
+    s->retired = n;
+    if (++s->n_retired >= RECLAIM_BATCH) reclaim(c, s);
+}
+
+static int shard_init(shard_t *s, size_t capacity, size_t max_bytes, int hugepages,
+                      lru_cache_policy_t policy, epoch_domain_t *epoch, uint32_t now) {
+    s->capacity = capacity;
+    s->max_bytes = max_bytes;
+    s->bytes = 0;
+    /* start small; the index grows incrementally as entries arrive */
+    size_t hint = capacity < 1024 ? capacity : 1024;
+    if (hidx_init(&s->index, hint, node_key_eq, node_hash, epoch) != 0) return -1;
+    if (policy == LRU_POLICY_TINYLFU) {
+        s->win_cap = capacity / 100 ? capacity / 100 : 1;
+        s->win_max_bytes = max_bytes / 100;
+        /* byte-bounded only: guess the entry count from a small entry size */
+        if (sketch_init(&s->sketch, capacity != SIZE_MAX ? capacity : max_bytes / 128) != 0) {
+            hidx_destroy(&s->index);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    slab_init(&s->slab, hugepages);
+    tw_init(&s->wheel, now, node_expires);
+    s->main.head = s->main.tail = NULL;
+    s->window.head = s->window.tail = NULL;
+    s->retired = NULL;
+    s->size = s->n_retired = 0;
+    return 0;
+}
+
+/* What a node holds outside the slab pages: oversized nodes, replicas */
+static void free_extra(shard_t *s, node_t *n) {
+    if (n->slab_class == SLAB_LARGE) node_free(s, n);
+    else free(atomic_load_explicit(&n->replicas, memory_order_relaxed));
+}
+
+static void free_large(shard_t *s, node_t *cur) {
+    while (cur) {
+        node_t *nx = cur->next;
+        free_extra(s, cur);
+        cur = nx;
+    }
+}
+
+/* Only called once no reader can be inside the cache */
+static void shard_free(shard_t *s) {
+    pthread_mutex_lock(&s->lock);
+    /* slab pages go in one sweep, only oversized nodes need freeing */
+    free_large(s, s->main.head);
+    free_large(s, s->window.head);
+    node_t *cur = s->retired;
+    while (cur) {
+        node_t *nx = cur->rnext;
+        free_extra(s, cur);
+        cur = nx;
+    }
+    slab_destroy(&s->slab);
+    hidx_destroy(&s->index);
+    sketch_destroy(&s->sketch);
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_destroy(&s->lock);
+}
+
 lru_cache_t *lru_cache_create(size_t capacity) {
+    lru_cache_config_t cfg = { .capacity = capacity, .n_shards = LRU_CACHE_DEFAULT_SHARDS };
+    return lru_cache_create_with(&cfg);
+}
+
+lru_cache_t *lru_cache_create_with(const lru_cache_config_t *cfg) {
+    if (!cfg || (cfg->capacity == 0 && cfg->max_bytes == 0)) return NULL;
+    size_t want = cfg->n_shards ? cfg->n_shards : LRU_CACHE_DEFAULT_SHARDS;
+    size_t capacity = cfg->capacity ? cfg->capacity : SIZE_MAX;
+
+    /* round down to a power of two, never more shards than entries */
+    size_t n = 1;
+    unsigned bits = 0;
+    while (n * 2 <= want && n * 2 <= capacity) { n *= 2; bits++; }
+
     lru_cache_t *c = calloc(1, sizeof(*c));
     if (!c) return NULL;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    c->clock_base = ts.tv_sec;
     c->capacity = capacity;
-    c->n_buckets = capacity * 2 + 1;
-    c->buckets = calloc(c->n_buckets, sizeof(node_t*));
-    if (!c->buckets) { free(c); return NULL; }
-    pthread_mutex_init(&c->lock, NULL);
-    c->head = c->tail = NULL;
-    c->size = 0;
+    c->max_bytes = cfg->max_bytes;
+    /* an entry can never be bigger than its shard's whole budget */
+    c->max_entry_bytes = cfg->max_entry_bytes ? cfg->max_entry_bytes : SIZE_MAX;
+    if (cfg->max_bytes && c->max_entry_bytes > cfg->max_bytes / n)
+        c->max_entry_bytes = cfg->max_bytes / n;
+    c->n_shards = n;
+    c->shard_bits = bits;
+    c->hugepages = cfg->hugepages;
+    c->policy = cfg->policy;
+    c->compress_min = cfg->compress_min;
+    c->hot_replicas = cfg->hot_replicas;
+    if (cfg->l1_size) {
+        c->l1_size = 1;
+        while (c->l1_size < cfg->l1_size) c->l1_size *= 2;
+        c->l1 = calloc(EPOCH_MAX_THREADS, sizeof(*c->l1));
+        if (!c->l1) goto fail_alloc;
+    }
+    if (c->compress_min) {
+        if (posix_memalign((void **)&c->zstats, 64, EPOCH_MAX_THREADS * sizeof(zstat_t)) != 0) {
+            c->zstats = NULL;
+            goto fail_alloc;
+        }
+        memset(c->zstats, 0, EPOCH_MAX_THREADS * sizeof(zstat_t));
+    }
+    if (epoch_domain_init(&c->epoch) != 0) goto fail_alloc;
+    if (posix_memalign((void **)&c->shards, 64, n * sizeof(shard_t)) != 0) {
+        epoch_domain_destroy(&c->epoch);
+        goto fail_alloc;
+    }
+    memset(c->shards, 0, n * sizeof(shard_t));
+
+    /* split capacity, spreading the remainder over the first shards; with
+     * no count limit every shard stays unbounded (SIZE_MAX), which is what
+     * shard_init keys the byte-based sketch size on */
+    size_t base = capacity / n, extra = capacity % n;
+    for (size_t i = 0; i < n; ++i) {
+        size_t shard_cap = cfg->capacity ? base + (i < extra ? 1 : 0) : SIZE_MAX;
+        if (shard_init(&c->shards[i], shard_cap, cfg->max_bytes / n,
+                       c->hugepages, c->policy, &c->epoch, cache_clock(c)) != 0) {
+            for (size_t j = 0; j < i; ++j) shard_free(&c->shards[j]);
+            goto fail_shards;
+        }
+    }
+    pthread_mutex_init(&c->expiry_lock, NULL);
+    pthread_cond_init(&c->expiry_cond, NULL);
+    if (pthread_create(&c->expiry_thread, NULL, expiry_main, c) != 0) {
+        for (size_t i = 0; i < n; ++i) shard_free(&c->shards[i]);
+        goto fail_shards;
+    }
     return c;
+
+fail_shards:
+    free(c->shards);
+    epoch_domain_destroy(&c->epoch);
+fail_alloc:
+    free(c->zstats);
+    free(c->l1);
+    free(c);
+    return NULL;
 }
 
-static void detach_node(lru_cache_t *c, node_t *n) {
+static void detach_node(node_list_t *l, node_t *n) {
     if (!n) return;
     if (n->prev) n->prev->next = n->next;
-    else c->head = n->next;
+    else l->head = n->next;
     if (n->next) n->next->prev = n->prev;
-    else c->tail = n->prev;
+    else l->tail = n->prev;
     n->prev = n->next = NULL;
 }
 
-static void attach_head(lru_cache_t *c, node_t *n) {
+static void attach_head(node_list_t *l, node_t *n) {
     n->prev = NULL;
-    n->next = c->head;
-    if (c->head) c->head->prev = n;
-    c->head = n;
-    if (!c->tail) c->tail = n;
-}
-
-static void evict_if_needed(lru_cache_t *c) {
-    if (c->size <= c->capacity) return;
-    /* remove tail */
-    node_t *to = c->tail;
-    if (!to) return;
-    /* remove from LRU list */
-    detach_node(c, to);
-    /* remove from hash */
-    unsigned long h = hash_str(to->key) % c->n_buckets;
-    node_t *cur = c->buckets[h], *prev = NULL;
-    while (cur) {
-        if (cur == to) {
-            if (prev) prev->hnext = cur->hnext;
-            else c->buckets[h] = cur->hnext;
-            break;
+    n->next = l->head;
+    if (l->head) l->head->prev = n;
+    l->head = n;
+    if (!l->tail) l->tail = n;
+}
+
+static void attach_tail(node_list_t *l, node_t *n) {
+    n->next = NULL;
+    n->prev = l->tail;
+    if (l->tail) l->tail->next = n;
+    l->tail = n;
+    if (!l->head) l->head = n;
+}
+
+/* Link a node that is already in the index and account for it */
+static void link_node(shard_t *s, node_t *n) {
+    size_t charge = node_charge(n->klen, n->vlen);
+    if (n->expires) tw_add(&s->wheel, &n->expiry);
+    if (n->compressed) {
+        s->n_compressed++;
+        s->compressed_bytes += n->vlen;
+        s->compressed_raw_bytes += n->raw_len;
+    }
+    if (atomic_load_explicit(&n->replicas, memory_order_relaxed)) s->n_replicated++;
+    if (n->in_window) {
+        attach_head(&s->window, n);
+        s->win_size++;
+        s->win_bytes += charge;
+    } else {
+        attach_head(&s->main, n);
+    }
+    s->size++;
+    s->bytes += charge;
+}
+
+static void unlink_node(shard_t *s, node_t *n) {
+    size_t charge = node_charge(n->klen, n->vlen);
+    /* before retire_node reuses the link for the retire list */
+    if (n->expires) tw_del(&s->wheel, &n->expiry);
+    if (n->compressed) {
+        s->n_compressed--;
+        s->compressed_bytes -= n->vlen;
+        s->compressed_raw_bytes -= n->raw_len;
+    }
+    if (atomic_load_explicit(&n->replicas, memory_order_relaxed)) s->n_replicated--;
+    if (n->in_window) {
+        detach_node(&s->window, n);
+        s->win_size--;
+        s->win_bytes -= charge;
+    } else {
+        detach_node(&s->main, n);
+    }
+    s->size--;
+    s->bytes -= charge;
+}
+
+/* Remove from the index, then from its list, and hand to reclamation */
+static void drop_node(lru_cache_t *c, shard_t *s, node_t *n) {
+    hidx_remove(&s->index, n->hash, n);
+    /* near caches may still point at n */
+    atomic_fetch_add_explicit(&s->version, 1, memory_order_release);
+    unlink_node(s, n);
+    retire_node(c, s, n);
+}
+
+static int over_budget(const shard_t *s) {
+    return s->size > s->capacity || (s->max_bytes && s->bytes > s->max_bytes);
+}
+
+static int window_over(const shard_t *s) {
+    return s->win_size > s->win_cap || (s->max_bytes && s->win_bytes > s->win_max_bytes);
+}
+
+/* CLOCK: the hand sits at the tail of main; a referenced node gets its bit
+ * cleared and a second chance at the head. chances bounds the sweep so
+ * readers re-setting bits can't keep us spinning. NULL if main is empty. */
+static node_t *clock_victim(shard_t *s, size_t *chances) {
+    node_t *to;
+    while ((to = s->main.tail)) {
+        if (*chances > 0 && atomic_load_explicit(&to->ref, memory_order_relaxed)) {
+            atomic_store_explicit(&to->ref, 0, memory_order_relaxed);
+            detach_node(&s->main, to);
+            attach_head(&s->main, to);
+            (*chances)--;
+            continue;
+        }
+        return to;
+    }
+    return NULL;
+}
+
+static void evict_if_needed(lru_cache_t *c, shard_t *s) {
+    size_t chances = s->size;
+    if (c->policy == LRU_POLICY_TINYLFU) {
+        /* the window's oldest entry competes with main's CLOCK victim */
+        while (window_over(s)) {
+            node_t *cand = s->window.tail;
+            unlink_node(s, cand);
+            cand->in_window = 0;
+            link_node(s, cand);
+            if (!over_budget(s)) continue;
+            node_t *victim = clock_victim(s, &chances);
+            if (victim != cand && sketch_estimate(&s->sketch, cand->hash) >
+                                  sketch_estimate(&s->sketch, victim->hash)) {
+                s->admitted++;
+            } else {
+                victim = cand;
+                s->rejected++;
+            }
+            drop_node(c, s, victim);
         }
-        prev = cur;
-        cur = cur->hnext;
     }
-    free(to->key);
-    free(to->value);
-    free(to);
-    c->size--;
+    /* keep going until both the entry and the byte budget hold */
+    while (over_budget(s)) {
+        node_t *to = clock_victim(s, &chances);
+        if (!to) to = s->window.tail;
+        if (!to) return;
+        drop_node(c, s, to);
+    }
+}
+
+/* Caller holds the shard lock */
+static int remove_locked(lru_cache_t *c, shard_t *s, uint64_t hv, const char *key) {
+    node_t *cur = hidx_find(&s->index, hv, key);
+    if (!cur) return -1;
+    drop_node(c, s, cur);
+    return 0;
+}
+
+/* ---- expiry ---- */
+
+typedef struct {
+    lru_cache_t *c;
+    shard_t *s;
+} expire_ctx_t;
+
+static void expire_node(tw_link_t *link, void *arg) {
+    expire_ctx_t *x = arg;
+    node_t *n = (node_t *)((char *)link - offsetof(node_t, expiry));
+    drop_node(x->c, x->s, n);
+    x->s->expired++;
+}
+
+static void *expiry_main(void *arg) {
+    lru_cache_t *c = arg;
+    pthread_mutex_lock(&c->expiry_lock);
+    while (!c->expiry_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&c->expiry_cond, &c->expiry_lock, &ts);
+        if (c->expiry_stop) break;
+        uint32_t now = cache_clock(c);
+        for (size_t i = 0; i < c->n_shards; ++i) {
+            shard_t *s = &c->shards[i];
+            /* an empty wheel only needs its clock moved */
+            pthread_mutex_lock(&s->lock);
+            expire_ctx_t x = { c, s };
+            if (s->wheel.count == 0) s->wheel.now = now;
+            else tw_advance(&s->wheel, now, expire_node, &x);
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+    pthread_mutex_unlock(&c->expiry_lock);
+    return NULL;
 }
 
 int lru_cache_put(lru_cache_t *c, const char *key, const char *value) {
+    return lru_cache_put_ttl(c, key, value, 0);
+}
+
+int lru_cache_put_ttl(lru_cache_t *c, const char *key, const char *value, unsigned ttl_sec) {
     if (!c || !key || !value) return -1;
-    pthread_mutex_lock(&c->lock);
-    unsigned long h = hash_str(key) % c->n_buckets;
-    node_t *cur = c->buckets[h];
-    while (cur) {
-        if (strcmp(cur->key, key) == 0) {
-            /* update value and move to head */
-            free(cur->value);
-            cur->value = strdup(value);
-            detach_node(c, cur);
-            attach_head(c, cur);
-            pthread_mutex_unlock(&c->lock);
-            return 0;
+    uint64_t hv = hash_str(key);
+    shard_t *s = shard_for(c, hv);
+    size_t klen = strlen(key);
+    stored_value_t sv;
+    store_value(c, value, strlen(value), &sv);
+    if (node_charge(klen, sv.len) > c->max_entry_bytes) {
+        /* too big to cache: don't leave an older value behind */
+        free(sv.buf);
+        pthread_mutex_lock(&s->lock);
+        remove_locked(c, s, hv, key);
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    uint32_t expires = ttl_sec ? cache_clock(c) + ttl_sec : 0;
+    pthread_mutex_lock(&s->lock);
+    node_t *n = node_new(s, hv, key, klen, &sv, expires);
+    free(sv.buf);
+    if (!n) { pthread_mutex_unlock(&s->lock); return -1; }
+    if (c->policy == LRU_POLICY_TINYLFU) sketch_increment(&s->sketch, hv);
+    node_t *cur = hidx_find(&s->index, hv, key);
+    if (cur) {
+        /* replace the published node and move to the head of its list */
+        hidx_replace(&s->index, hv, cur, n);
+        n->in_window = cur->in_window;
+        unlink_node(s, cur);
+        link_node(s, n);
+        retire_node(c, s, cur);
+        /* after publishing: a reader that loads the new version before its
+         * index lookup is guaranteed to find the new node */
+        atomic_fetch_add_explicit(&s->version, 1, memory_order_release);
+        evict_if_needed(c, s);
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    /* new node; under TinyLFU it has to earn its place in main */
+    if (hidx_insert(&s->index, hv, n) != 0) {
+        node_free(s, n);
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    n->in_window = c->policy == LRU_POLICY_TINYLFU;
+    link_node(s, n);
+    evict_if_needed(c, s);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static void pin_node(node_t *n) {
+    atomic_fetch_add_explicit(&n->pins, 1, memory_order_relaxed);
+}
+
+static void unpin_node(node_t *n) {
+    /* release: our reads of the value happen before reclaim frees it */
+    atomic_fetch_sub_explicit(&n->pins, 1, memory_order_release);
+}
+
+/* mark referenced; skip the store if already set to keep the line shared
+ * between readers */
+static void mark_ref(node_t *n) {
+    if (!atomic_load_explicit(&n->ref, memory_order_relaxed))
+        atomic_store_explicit(&n->ref, 1, memory_order_relaxed);
+}
+
+/* The calling thread's near cache, created on first use */
+static l1_table_t *l1_table(lru_cache_t *c) {
+    if (!c->l1) return NULL;
+    int tid = epoch_thread_id();
+    if (tid >= EPOCH_MAX_THREADS) return NULL;
+    l1_table_t *t = atomic_load_explicit(&c->l1[tid], memory_order_relaxed);
+    if (!t) {
+        t = calloc(1, sizeof(*t) + c->l1_size * sizeof(l1_slot_t));
+        if (!t) return NULL;
+        atomic_store_explicit(&c->l1[tid], t, memory_order_release);
+    }
+    return t;
+}
+
+/* Slot holding key if its shard hasn't been written since it was filled */
+static l1_slot_t *l1_find(lru_cache_t *c, l1_table_t *t, shard_t *s, uint64_t hv, const char *key) {
+    l1_slot_t *sl = &t->slots[hv & (c->l1_size - 1)];
+    if (!sl->node || sl->hash != hv) return NULL;
+    if (sl->version != atomic_load_explicit(&s->version, memory_order_acquire)) {
+        /* stale: let the node go unless a handle still borrows it */
+        if (sl->lent == 0) {
+            unpin_node(sl->node);
+            sl->node = NULL;
         }
-        cur = cur->hnext;
-    }
-    /* new node */
-    node_t *n = calloc(1, sizeof(*n));
-    if (!n) { pthread_mutex_unlock(&c->lock); return -1; }
-    n->key = strdup(key);
-    n->value = strdup(value);
-    n->hnext = c->buckets[h];
-    c->buckets[h] = n;
-    attach_head(c, n);
-    c->size++;
-    evict_if_needed(c);
-    pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+    if (!node_key_eq(sl->node, hv, key) || node_expired(c, sl->node)) return NULL;
+    mark_ref(sl->node);
+    atomic_store_explicit(&t->hits, atomic_load_explicit(&t->hits, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    /* keep the sketch roughly informed without a shared write per hit */
+    if (c->policy == LRU_POLICY_TINYLFU && (++t->tick & (L1_SKETCH_SAMPLE - 1)) == 0)
+        sketch_increment(&s->sketch, hv);
+    return sl;
+}
+
+/* Inside the read epoch; version was loaded before the index lookup */
+static void l1_fill(lru_cache_t *c, l1_table_t *t, uint64_t hv, uint64_t version, node_t *n) {
+    l1_slot_t *sl = &t->slots[hv & (c->l1_size - 1)];
+    if (sl->lent) return;
+    if (sl->node) unpin_node(sl->node);
+    pin_node(n);
+    sl->node = n;
+    sl->hash = hv;
+    sl->version = version;
+}
+
+/* Plain value of a node the caller keeps alive, in a fresh buffer */
+static int copy_value(lru_cache_t *c, const node_t *n, char **out_value) {
+    char *v = malloc(n->raw_len + 1);
+    if (!v) return -1;
+    if (n->compressed) {
+        if (node_inflate_timed(c, n, v) != 0) { free(v); return -1; }
+    } else {
+        memcpy(v, node_value(n), n->vlen + 1);
+    }
+    *out_value = v;
     return 0;
 }
 
 int lru_cache_get(lru_cache_t *c, const char *key, char **out_value) {
     if (!c || !key || !out_value) return -1;
-    pthread_mutex_lock(&c->lock);
-    unsigned long h = hash_str(key) % c->n_buckets;
-    node_t *cur = c->buckets[h];
-    while (cur) {
-        if (strcmp(cur->key, key) == 0) {
-            /* move to head */
-            detach_node(c, cur);
-            attach_head(c, cur);
-            *out_value = strdup(cur->value);
-            pthread_mutex_unlock(&c->lock);
-            return 0;
+    uint64_t hv = hash_str(key);
+    shard_t *s = shard_for(c, hv);
+    l1_table_t *t = l1_table(c);
+    l1_slot_t *sl = t ? l1_find(c, t, s, hv, key) : NULL;
+    if (sl) return copy_value(c, sl->node, out_value);
+    int rc = -1;
+    /* misses count too: a key that keeps missing is worth admitting */
+    if (c->policy == LRU_POLICY_TINYLFU) sketch_increment(&s->sketch, hv);
+    epoch_enter(&c->epoch);
+    uint64_t version = atomic_load_explicit(&s->version, memory_order_acquire);
+    node_t *cur = hidx_find(&s->index, hv, key);
+    /* due but not yet reaped by the expiry thread */
+    if (cur && node_expired(c, cur)) cur = NULL;
+    if (cur) {
+        mark_ref(cur);
+        if (t) l1_fill(c, t, hv, version, cur);
+        rc = copy_value(c, cur, out_value);
+    }
+    epoch_exit(&c->epoch);
+    return rc;
+}
+
+/* A handle is either a pinned node or, tagged with the low bit, a near
+ * cache slot that lends out its own pin. A compressed value is inflated
+ * into a heap copy instead, tagged with the second bit, which the handle
+ * owns outright. */
+#define HANDLE_SLOT 1UL
+#define HANDLE_HEAP 2UL
+#define handle_is_slot(v) (((uintptr_t)(v)) & HANDLE_SLOT)
+#define handle_is_heap(v) (((uintptr_t)(v)) & HANDLE_HEAP)
+#define handle_heap(v) ((heap_value_t *)((uintptr_t)(v) & ~HANDLE_HEAP))
+#define handle_node(v) (handle_is_slot(v) \
+    ? ((const l1_slot_t *)((uintptr_t)(v) & ~HANDLE_SLOT))->node : (const node_t *)(v))
+
+typedef struct {
+    size_t len;
+    char data[];
+} heap_value_t;
+
+static lru_value_t *inflate_handle(lru_cache_t *c, const node_t *n) {
+    heap_value_t *h = malloc(sizeof(*h) + n->raw_len + 1);
+    if (!h) return NULL;
+    if (node_inflate_timed(c, n, h->data) != 0) { free(h); return NULL; }
+    h->len = n->raw_len;
+    return (lru_value_t *)((uintptr_t)h | HANDLE_HEAP);
+}
+
+int lru_cache_acquire(lru_cache_t *c, const char *key, lru_value_t **out) {
+    if (!c || !key || !out) return -1;
+    uint64_t hv = hash_str(key);
+    shard_t *s = shard_for(c, hv);
+    l1_table_t *t = l1_table(c);
+    l1_slot_t *sl = t ? l1_find(c, t, s, hv, key) : NULL;
+    if (sl && sl->node->compressed) {
+        *out = inflate_handle(c, sl->node);
+        return *out ? 0 : -1;
+    }
+    if (sl) {
+        /* no shared write at all: the slot already holds a pin */
+        sl->lent++;
+        *out = (lru_value_t *)((uintptr_t)sl | HANDLE_SLOT);
+        return 0;
+    }
+    int rc = -1;
+    if (c->policy == LRU_POLICY_TINYLFU) sketch_increment(&s->sketch, hv);
+    epoch_enter(&c->epoch);
+    uint64_t version = atomic_load_explicit(&s->version, memory_order_acquire);
+    node_t *cur = hidx_find(&s->index, hv, key);
+    if (cur && node_expired(c, cur)) cur = NULL;
+    if (cur) {
+        mark_ref(cur);
+        if (t) l1_fill(c, t, hv, version, cur);
+        if (cur->compressed) {
+            /* the copy outlives the node without a pin */
+            *out = inflate_handle(c, cur);
+            rc = *out ? 0 : -1;
+        } else {
+            /* hot key: pin this thread's copy, not the shared node */
+            node_t *r = atomic_load_explicit(&cur->replicas, memory_order_acquire);
+            node_t *target = r ? replica_at(r, cur, (unsigned)epoch_thread_id() % c->hot_replicas) : cur;
+            pin_node(target);
+            *out = (lru_value_t *)target;
+            rc = 0;
         }
-        cur = cur->hnext;
     }
-    pthread_mutex_unlock(&c->lock);
-    return -1;
+    epoch_exit(&c->epoch);
+    return rc;
+}
+
+const char *lru_value_data(const lru_value_t *v) {
+    if (handle_is_heap(v)) return handle_heap(v)->data;
+    return node_value(handle_node(v));
+}
+
+size_t lru_value_len(const lru_value_t *v) {
+    if (handle_is_heap(v)) return handle_heap(v)->len;
+    return handle_node(v)->vlen;
+}
+
+void lru_value_release(lru_value_t *v) {
+    if (!v) return;
+    if (handle_is_heap(v)) free(handle_heap(v));
+    else if (handle_is_slot(v)) ((l1_slot_t *)((uintptr_t)v & ~HANDLE_SLOT))->lent--;
+    else unpin_node((node_t *)v);
+}
+
+int lru_cache_replicate(lru_cache_t *c, const char *key) {
+    if (!c || !key || !c->hot_replicas) return -1;
+    uint64_t hv = hash_str(key);
+    shard_t *s = shard_for(c, hv);
+    pthread_mutex_lock(&s->lock);
+    node_t *cur = hidx_find(&s->index, hv, key);
+    /* compressed hits already go to a private copy */
+    if (!cur || cur->compressed) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    if (atomic_load_explicit(&cur->replicas, memory_order_relaxed)) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    size_t stride = replica_stride(cur), size = node_size(cur->klen, cur->vlen);
+    node_t *r = NULL;
+    if (posix_memalign((void **)&r, 64, c->hot_replicas * stride) != 0) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    for (unsigned i = 0; i < c->hot_replicas; ++i) {
+        /* only what a handle reads; ref and pins are live on the original */
+        node_t *copy = replica_at(r, cur, i);
+        memset(copy, 0, sizeof(*copy));
+        copy->hash = cur->hash;
+        copy->klen = cur->klen;
+        copy->vlen = cur->vlen;
+        copy->raw_len = cur->raw_len;
+        copy->expires = cur->expires;
+        memcpy(copy->data, cur->data, size - sizeof(*copy));
+    }
+    /* copies are complete before a reader can find them */
+    atomic_store_explicit(&cur->replicas, r, memory_order_release);
+    s->n_replicated++;
+    s->replica_bytes += c->hot_replicas * stride;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
 }
 
 int lru_cache_delete(lru_cache_t *c, const char *key) {
     if (!c || !key) return -1;
-    pthread_mutex_lock(&c->lock);
-    unsigned long h = hash_str(key) % c->n_buckets;
-    node_t *cur = c->buckets[h], *prev = NULL;
-    while (cur) {
-        if (strcmp(cur->key, key) == 0) {
-            /* remove from hash chain */
-            if (prev) prev->hnext = cur->hnext;
-            else c->buckets[h] = cur->hnext;
-            /* remove from LRU list */
-            detach_node(c, cur);
-            free(cur->key);
-            free(cur->value);
-            free(cur);
-            c->size--;
-            pthread_mutex_unlock(&c->lock);
-            return 0;
+    uint64_t hv = hash_str(key);
+    shard_t *s = shard_for(c, hv);
+    pthread_mutex_lock(&s->lock);
+    int rc = remove_locked(c, s, hv, key);
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+size_t lru_cache_clear(lru_cache_t *c) {
+    if (!c) return 0;
+    size_t n = 0;
+    for (size_t i = 0; i < c->n_shards; ++i) {
+        shard_t *s = &c->shards[i];
+        pthread_mutex_lock(&s->lock);
+        node_t *cur;
+        while ((cur = s->window.head ? s->window.head : s->main.head)) {
+            drop_node(c, s, cur);
+            n++;
         }
-        prev = cur;
-        cur = cur->hnext;
+        pthread_mutex_unlock(&s->lock);
     }
-    pthread_mutex_unlock(&c->lock);
-    return -1;
+    return n;
 }
 
 void lru_cache_destroy(lru_cache_t *c) {
     if (!c) return;
-    pthread_mutex_lock(&c->lock);
-    for (size_t i = 0; i < c->n_buckets; ++i) {
-        node_t *cur = c->buckets[i];
-        while (cur) {
-            node_t *nx = cur->hnext;
-            free(cur->key);
-            free(cur->value);
-            free(cur);
-            cur = nx;
-        }
+    pthread_mutex_lock(&c->expiry_lock);
+    c->expiry_stop = 1;
+    pthread_cond_signal(&c->expiry_cond);
+    pthread_mutex_unlock(&c->expiry_lock);
+    pthread_join(c->expiry_thread, NULL);
+    pthread_mutex_destroy(&c->expiry_lock);
+    pthread_cond_destroy(&c->expiry_cond);
+    for (size_t i = 0; i < c->n_shards; ++i) shard_free(&c->shards[i]);
+    free(c->shards);
+    free(c->zstats);
+    /* near cache pins die with the slabs */
+    if (c->l1) {
+        for (int i = 0; i < EPOCH_MAX_THREADS; ++i) free(atomic_load(&c->l1[i]));
+        free(c->l1);
     }
-    free(c->buckets);
-    pthread_mutex_unlock(&c->lock);
-    pthread_mutex_destroy(&c->lock);
+    epoch_domain_destroy(&c->epoch);
     free(c);
 }
+
+void lru_cache_get_stats(lru_cache_t *c, lru_cache_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    if (!c) return;
+    for (size_t i = 0; i < c->n_shards; ++i) {
+        shard_t *s = &c->shards[i];
+        pthread_mutex_lock(&s->lock);
+        st->entries += s->size;
+        st->bytes += s->bytes;
+        st->retired += s->n_retired;
+        st->slab_used_bytes += slab_used_bytes(&s->slab);
+        st->slab_reserved_bytes += s->slab.reserved_bytes + s->slab.large_bytes;
+        st->index_bytes += hidx_memory(&s->index);
+        if (c->policy == LRU_POLICY_TINYLFU) st->sketch_bytes += sketch_memory(&s->sketch);
+        st->admitted += s->admitted;
+        st->rejected += s->rejected;
+        st->expired += s->expired;
+        st->compressed_entries += s->n_compressed;
+        st->compressed_bytes += s->compressed_bytes;
+        st->compressed_raw_bytes += s->compressed_raw_bytes;
+        st->replicated += s->n_replicated;
+        st->replica_bytes += s->replica_bytes;
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (c->l1) {
+        for (int i = 0; i < EPOCH_MAX_THREADS; ++i) {
+            l1_table_t *t = atomic_load_explicit(&c->l1[i], memory_order_acquire);
+            if (t) st->l1_hits += atomic_load_explicit(&t->hits, memory_order_relaxed);
+        }
+    }
+    if (c->zstats) {
+        for (int i = 0; i < EPOCH_MAX_THREADS; ++i) {
+            st->decompressions += atomic_load_explicit(&c->zstats[i].count, memory_order_relaxed);
+            st->decompress_ns += atomic_load_explicit(&c->zstats[i].ns, memory_order_relaxed);
+        }
+    }
+}
+
+/* ---- snapshot ----
+ *
+ * File layout (host byte order, the file never leaves the machine):
+ *   header   snap_header_t, crc over the fields before it
+ *   records  count x { snap_record_t, key '\0', value '\0' }, crc over the
+ *            record header fields before it plus both strings; ttl is the
+ *            seconds the entry had left when the file was written, 0 = none
+ * Records run from most to least recently used, taking shards round-robin so
+ * the order still holds if the next run uses a different shard count.
+ */
+
+#define SNAP_MAGIC "KVSNAP02"
+
+typedef struct {
+    char magic[8];
+    uint64_t created;  /* unix seconds */
+    uint64_t count;
+    uint32_t reserved;
+    uint32_t crc;
+} snap_header_t;
+
+typedef struct {
+    uint32_t klen, vlen;
+    uint32_t ttl;
+    uint32_t crc;
+} snap_record_t;
+
+/* Values go out plain, so the file doesn't depend on compress_min; scratch
+ * is a reusable buffer for inflating compressed ones */
+static int write_record(FILE *f, const node_t *n, uint32_t now, char **scratch, size_t *scratch_len) {
+    snap_record_t r = { .klen = n->klen, .vlen = n->raw_len, .ttl = n->expires ? n->expires - now : 0 };
+    const char *value = node_value(n);
+    if (n->compressed) {
+        if (*scratch_len < n->raw_len + 1) {
+            char *b = realloc(*scratch, n->raw_len + 1);
+            if (!b) return -1;
+            *scratch = b;
+            *scratch_len = n->raw_len + 1;
+        }
+        if (node_inflate(n, *scratch) != 0) return -1;
+        value = *scratch;
+    }
+    r.crc = crc32_update(0, &r, offsetof(snap_record_t, crc));
+    r.crc = crc32_update(r.crc, node_key(n), n->klen + 1);
+    r.crc = crc32_update(r.crc, value, r.vlen + 1);
+    if (fwrite(&r, sizeof(r), 1, f) != 1 || fwrite(node_key(n), 1, n->klen + 1, f) != n->klen + 1)
+        return -1;
+    return fwrite(value, 1, r.vlen + 1, f) == r.vlen + 1 ? 0 : -1;
+}
+
+/* Next node in MRU order: the window holds the newest entries */
+static node_t *snap_next(shard_t *s, node_t *n) {
+    if (n && n->next) return n->next;
+    if (n && n->in_window) return s->main.head;
+    return NULL;
+}
+
+int lru_cache_save(lru_cache_t *c, const char *path) {
+    if (!c || !path) return -1;
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return -1;
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    /* writers are stopped at shutdown, so holding every shard is cheap */
+    node_t **cursor = calloc(c->n_shards, sizeof(node_t *));
+    if (!cursor) { fclose(f); unlink(tmp); return -1; }
+    snap_header_t h = { .created = (uint64_t)time(NULL) };
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    for (size_t i = 0; i < c->n_shards; ++i) {
+        shard_t *s = &c->shards[i];
+        pthread_mutex_lock(&s->lock);
+        h.count += s->size;
+        cursor[i] = s->window.head ? s->window.head : s->main.head;
+    }
+    /* expired entries are skipped, so the count is rewritten at the end */
+    uint32_t now = cache_clock(c);
+    char *scratch = NULL;
+    size_t scratch_len = 0;
+    int rc = fwrite(&h, sizeof(h), 1, f) == 1 ? 0 : -1;
+    h.count = 0;
+    for (int live = 1; live && rc == 0; ) {
+        live = 0;
+        for (size_t i = 0; i < c->n_shards && rc == 0; ++i) {
+            node_t *n = cursor[i];
+            if (!n) continue;
+            live = 1;
+            cursor[i] = snap_next(&c->shards[i], n);
+            if (n->expires && n->expires <= now) continue;
+            rc = write_record(f, n, now, &scratch, &scratch_len);
+            h.count++;
+        }
+    }
+    for (size_t i = 0; i < c->n_shards; ++i) pthread_mutex_unlock(&c->shards[i].lock);
+    free(cursor);
+    free(scratch);
+    h.crc = crc32_update(0, &h, offsetof(snap_header_t, crc));
+    if (rc == 0 && (fseek(f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, f) != 1)) rc = -1;
+
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) rc = -1;
+    if (fclose(f) != 0) rc = -1;
+    /* publish atomically: a crash mid-save leaves the previous snapshot */
+    if (rc == 0 && rename(tmp, path) != 0) rc = -1;
+    if (rc != 0) unlink(tmp);
+    return rc;
+}
+
+/* Append behind what is already loaded (the file is MRU first) and never
+ * evict to make room. 1 = added, 0 = skipped, -1 = out of memory. */
+static int load_entry(lru_cache_t *c, const char *key, const char *value, size_t klen, size_t vlen,
+                      unsigned ttl_sec) {
+    uint64_t hv = hash_str(key);
+    shard_t *s = shard_for(c, hv);
+    stored_value_t sv;
+    store_value(c, value, vlen, &sv);
+    size_t charge = node_charge(klen, sv.len);
+    if (charge > c->max_entry_bytes) { free(sv.buf); return 0; }
+    pthread_mutex_lock(&s->lock);
+    int rc = 0;
+    if (s->size + 1 > s->capacity || (s->max_bytes && s->bytes + charge > s->max_bytes) ||
+        hidx_find(&s->index, hv, key)) {
+        pthread_mutex_unlock(&s->lock);
+        free(sv.buf);
+        return 0;
+    }
+    node_t *n = node_new(s, hv, key, klen, &sv, ttl_sec ? cache_clock(c) + ttl_sec : 0);
+    free(sv.buf);
+    if (n && hidx_insert(&s->index, hv, n) == 0) {
+        link_node(s, n);
+        detach_node(&s->main, n);
+        attach_tail(&s->main, n);
+        /* seen at least once, so the first newcomer doesn't evict it */
+        if (c->policy == LRU_POLICY_TINYLFU) sketch_increment(&s->sketch, hv);
+        rc = 1;
+    } else {
+        if (n) node_free(s, n);
+        rc = -1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+long lru_cache_load(lru_cache_t *c, const char *path, unsigned max_age_sec) {
+    if (!c || !path) return -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snap_header_t)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+    madvise((void *)base, size, MADV_SEQUENTIAL);
+
+    long loaded = -1;
+    snap_header_t h;
+    memcpy(&h, base, sizeof(h));
+    uint64_t now = (uint64_t)time(NULL);
+    if (memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) != 0 ||
+        h.crc != crc32_update(0, &h, offsetof(snap_header_t, crc)))
+        goto out; /* not ours, or torn */
+    if (max_age_sec && (h.created > now || now - h.created > max_age_sec))
+        goto out; /* too old to trust against the database */
+
+    loaded = 0;
+    size_t off = sizeof(h);
+    for (uint64_t i = 0; i < h.count; ++i) {
+        snap_record_t r;
+        if (size - off < sizeof(r)) break;
+        memcpy(&r, base + off, sizeof(r));
+        off += sizeof(r);
+        size_t body = (size_t)r.klen + r.vlen + 2;
+        if (size - off < body) break;
+        const char *key = base + off, *value = key + r.klen + 1;
+        uint32_t crc = crc32_update(0, &r, offsetof(snap_record_t, crc));
+        /* a bad record means everything after it is suspect too */
+        if (crc32_update(crc, key, body) != r.crc || key[r.klen] != '\0' || value[r.vlen] != '\0' ||
+            strlen(key) != r.klen || strlen(value) != r.vlen)
+            break;
+        off += body;
+        /* the clock kept running while the server was down */
+        unsigned ttl = 0;
+        if (r.ttl) {
+            uint64_t elapsed = now > h.created ? now - h.created : 0;
+            if (r.ttl <= elapsed) continue;
+            ttl = (unsigned)(r.ttl - elapsed);
+        }
+        int rc = load_entry(c, key, value, r.klen, r.vlen, ttl);
+        if (rc < 0) break;
+        loaded += rc;
+    }
+out:
+    munmap((void *)base, size);
+    return loaded;
+}
@@ -5,20 +5,151 @@
 #include <string.h>
 #include <libpq-fe.h>
 #include <pthread.h>
+#include <time.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <stdatomic.h>
 
-static PGconn *conn = NULL;
-static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Connection pool. A worker checks out a connection for one statement and
+ * hands it back; it tries the connection it used last first, so with at
+ * least as many connections as workers each worker keeps its own and
+ * checkout never contends on a connection. Broken connections are reset
+ * in place and the statement retried once. In pipeline mode workers don't
+ * check connections out at all, see below.
+ *
+ * Every kv_store statement is prepared on each connection when it is
+ * opened (and again after a reset), so requests skip parsing and planning.
+ * Integer parameters go over in binary. */
+typedef struct {
+    PGconn *conn;
+    int busy;
+    uint64_t since; /* checkout time */
+    int broken;     /* replica connection waiting for the monitor to reset it */
+} db_slot_t;
 
-int db_init(const char *conninfo) {
-    pthread_mutex_lock(&db_lock);
-    conn = PQconnectdb(conninfo);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "db_init: connection failed: %s\n", PQerrorMessage(conn));
-        PQfinish(conn);
-        conn = NULL;
-        pthread_mutex_unlock(&db_lock);
+static db_slot_t *pool = NULL;
+static size_t pool_size = 0;
+static size_t pool_in_use = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static __thread size_t my_slot = SIZE_MAX; /* affinity: last slot used */
+static char *db_conninfo = NULL; /* for side connections (key scans) */
+/* application_name of every connection we open; the invalidation trigger
+ * stamps it on each notification so our own writes can be told apart */
+static char db_origin[64];
+
+/* pool counters, guarded by pool_lock */
+static uint64_t checkouts, waits, wait_ns, busy_ns, reconnects;
+static struct timespec pool_started;
+
+/* type OIDs from pg_type.h, which the client headers don't ship */
+#define TEXTOID 25
+#define INT4OID 23
+#define INT8OID 20
+#define TEXTARRAYOID 1009
+#define INT8ARRAYOID 1016
+
+enum { STMT_PUT, STMT_GET, STMT_DELETE, STMT_PURGE, STMT_WRITE_BATCH, STMT_GET_MANY, N_STMTS };
+
+/* rerun: sending it again after it may already have run gives the same
+ * answer. Not so for kv_delete and kv_write_batch, whose second run would
+ * find the rows the first one deleted already gone. */
+static const struct {
+    const char *name;
+    const char *sql;
+    int n_params;
+    Oid types[4];
+    int rerun;
+} stmts[N_STMTS] = {
+    /* upsert using ON CONFLICT; a NULL ttl leaves expires_at NULL */
+    [STMT_PUT] = { "kv_put",
+                   "INSERT INTO kv_store (key, value, expires_at) "
+                   "VALUES ($1, $2, now() + make_interval(secs => $3)) "
+                   "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value, "
+                   "expires_at = EXCLUDED.expires_at",
+                   3, { TEXTOID, TEXTOID, INT8OID }, 1 },
+    /* expired rows stay until db_purge_expired gets to them; hide them here */
+    [STMT_GET] = { "kv_get",
+                   "SELECT value, ceil(extract(epoch FROM expires_at - now()))::bigint "
+                   "FROM kv_store WHERE key = $1 "
+                   "AND (expires_at IS NULL OR expires_at > now())",
+                   1, { TEXTOID }, 1 },
+    [STMT_DELETE] = { "kv_delete", "DELETE FROM kv_store WHERE key = $1", 1, { TEXTOID }, 0 },
+    /* bounded batches keep each statement short, so the connection goes
+     * back to the pool quickly */
+    [STMT_PURGE] = { "kv_purge",
+                     "DELETE FROM kv_store WHERE ctid IN ("
+                     "SELECT ctid FROM kv_store WHERE expires_at <= now() LIMIT $1)",
+                     1, { INT4OID }, 1 },
+    /* one statement, so one transaction and one WAL flush for the batch;
+     * deletes report back which of their keys existed */
+    [STMT_WRITE_BATCH] = { "kv_write_batch",
+                           "WITH up AS ("
+                           "INSERT INTO kv_store (key, value, expires_at) "
+                           "SELECT k, v, now() + make_interval(secs => t) "
+                           "FROM unnest($1, $2, $3) AS u(k, v, t) "
+                           "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value, "
+                           "expires_at = EXCLUDED.expires_at), "
+                           "gone AS ("
+                           "DELETE FROM kv_store s USING unnest($4) WITH ORDINALITY AS d(k, i) "
+                           "WHERE s.key = d.k RETURNING d.i) "
+                           "SELECT i FROM gone",
+                           4, { TEXTARRAYOID, TEXTARRAYOID, INT8ARRAYOID, TEXTARRAYOID }, 0 },
+    /* kv_get for a whole array of keys; rows come back in no particular
+     * order, and none for keys that are missing */
+    [STMT_GET_MANY] = { "kv_get_many",
+                        "SELECT key, value, ceil(extract(epoch FROM expires_at - now()))::bigint "
+                        "FROM kv_store WHERE key = ANY($1) "
+                        "AND (expires_at IS NULL OR expires_at > now())",
+                        1, { TEXTARRAYOID }, 1 },
+};
+
+static int prepare_stmt(PGconn *conn, int i) {
+    PGresult *res = PQprepare(conn, stmts[i].name, stmts[i].sql, stmts[i].n_params, stmts[i].types);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "db: preparing %s failed: %s\n", stmts[i].name, PQerrorMessage(conn));
+        PQclear(res);
         return -1;
     }
+    PQclear(res);
+    return 0;
+}
+
+static int prepare_all(PGconn *conn) {
+    for (int i = 0; i < N_STMTS; ++i)
+        if (prepare_stmt(conn, i) != 0) return -1;
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+/* FNV-1a */
+static uint64_t key_hash(const char *key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *key; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* The conninfo string is expanded as dbname, so anything it sets still
+ * applies; application_name comes after it and wins. PQreset reuses both. */
+static PGconn *db_connect(const char *conninfo) {
+    const char *const keys[] = { "dbname", "application_name", NULL };
+    const char *const vals[] = { conninfo, db_origin, NULL };
+    return PQconnectdbParams(keys, vals, 1);
+}
+
+/* First connection also makes sure the schema is there */
+static int init_schema(PGconn *conn) {
     /* ensure table exists */
     const char *sql = "CREATE TABLE IF NOT EXISTS kv_store ("
                       "key TEXT PRIMARY KEY,"
@@ -27,78 +158,1755 @@ int db_init(const char *conninfo) {
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
         fprintf(stderr, "db_init: failed to create table: %s\n", PQerrorMessage(conn));
         PQclear(res);
-        PQfinish(conn);
-        conn = NULL;
-        pthread_mutex_unlock(&db_lock);
         return -1;
     }
     PQclear(res);
-    pthread_mutex_unlock(&db_lock);
+    /* tables created before TTL support get the column on first start */
+    res = PQexec(conn, "ALTER TABLE kv_store ADD COLUMN IF NOT EXISTS expires_at TIMESTAMPTZ;"
+                       "CREATE INDEX IF NOT EXISTS kv_store_expires_at ON kv_store (expires_at) "
+                       "WHERE expires_at IS NOT NULL;");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "db_init: failed to add expires_at: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        return -1;
+    }
+    PQclear(res);
+    return 0;
+}
+
+static int rx_start(void);
+static void rx_close(void);
+/* read replicas, see the end of the file */
+static PGresult *replica_read(int stmt, const char *const *params, const int *lengths, const int *formats,
+                              const char *const *keys, size_t n_keys);
+static void note_write(const char *key);
+static void note_write_all(void);
+
+static void pool_free(void) {
+    for (size_t i = 0; i < pool_size; ++i)
+        if (pool[i].conn) PQfinish(pool[i].conn);
+    free(pool);
+    pool = NULL;
+    pool_size = 0;
+}
+
+int db_init(const char *conninfo, int n_conns, db_mode_t mode) {
+    if (n_conns < 1) n_conns = 1;
+    pthread_mutex_lock(&pool_lock);
+    free(db_conninfo);
+    db_conninfo = strdup(conninfo);
+    /* the server truncates application_name at 63 bytes; stay well under */
+    char host[32] = "";
+    gethostname(host, sizeof(host) - 1);
+    snprintf(db_origin, sizeof(db_origin), "kv_server:%.31s:%ld", host, (long)getpid());
+    pool = calloc((size_t)n_conns, sizeof(*pool));
+    if (!pool) {
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+    pool_size = (size_t)n_conns;
+    for (size_t i = 0; i < pool_size; ++i) {
+        pool[i].conn = db_connect(conninfo);
+        if (PQstatus(pool[i].conn) != CONNECTION_OK) {
+            fprintf(stderr, "db_init: connection %zu failed: %s\n", i, PQerrorMessage(pool[i].conn));
+            pool_free();
+            pthread_mutex_unlock(&pool_lock);
+            return -1;
+        }
+    }
+    /* the table has to exist before statements on it can be prepared */
+    int rc = init_schema(pool[0].conn);
+    for (size_t i = 0; i < pool_size && rc == 0; ++i) rc = prepare_all(pool[i].conn);
+    if (rc != 0) {
+        pool_free();
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+    pool_in_use = 0;
+    checkouts = waits = wait_ns = busy_ns = reconnects = 0;
+    clock_gettime(CLOCK_MONOTONIC, &pool_started);
+    pthread_mutex_unlock(&pool_lock);
+    if (mode == DB_MODE_PIPELINE && rx_start() != 0) {
+        db_close();
+        return -1;
+    }
     return 0;
 }
 
+/* Statements still running must have finished */
 void db_close(void) {
-    pthread_mutex_lock(&db_lock);
-    if (conn) { PQfinish(conn); conn = NULL; }
-    pthread_mutex_unlock(&db_lock);
-}
-
-int db_put(const char *key, const char *value) {
-    if (!conn) return -1;
-    pthread_mutex_lock(&db_lock);
-    /* upsert using ON CONFLICT */
-    const char *params[2] = { key, value };
-    PGresult *res = PQexecParams(conn,
-                                 "INSERT INTO kv_store (key, value) VALUES ($1, $2) "
-                                 "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value;",
-                                 2, NULL, params, NULL, NULL, 0);
+    db_invalidation_stop();
+    db_replicas_stop();
+    /* the reactor takes pool_lock when it reconnects */
+    rx_close();
+    pthread_mutex_lock(&pool_lock);
+    pool_free();
+    pthread_cond_broadcast(&pool_cond);
+    free(db_conninfo);
+    db_conninfo = NULL;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Check out a connection; NULL if the pool is closed */
+static db_slot_t *db_acquire(void) {
+    pthread_mutex_lock(&pool_lock);
+    if (!pool) {
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+    size_t i = my_slot < pool_size && !pool[my_slot].busy ? my_slot : SIZE_MAX;
+    if (i == SIZE_MAX && pool_in_use == pool_size) {
+        uint64_t t0 = now_ns();
+        waits++;
+        while (pool && pool_in_use == pool_size) pthread_cond_wait(&pool_cond, &pool_lock);
+        wait_ns += now_ns() - t0;
+        if (!pool) {
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+    }
+    if (i == SIZE_MAX) {
+        for (i = 0; pool[i].busy; ++i) {}
+        my_slot = i;
+    }
+    pool[i].busy = 1;
+    pool[i].since = now_ns();
+    pool_in_use++;
+    checkouts++;
+    pthread_mutex_unlock(&pool_lock);
+    return &pool[i];
+}
+
+static void db_release(db_slot_t *slot) {
+    uint64_t held = now_ns() - slot->since;
+    pthread_mutex_lock(&pool_lock);
+    slot->busy = 0;
+    pool_in_use--;
+    busy_ns += held;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* The session lost its prepared statements without losing the connection
+ * (e.g. DISCARD ALL from a pooler in between) */
+static int lost_statement(const PGresult *res) {
+    const char *state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    return state && strcmp(state, "26000") == 0;
+}
+
+/* The connection went away after the statement was sent, so it may or
+ * may not have committed. libpq reports that as an error of its own,
+ * which unlike a server error has no SQLSTATE. */
+static int outcome_unknown(const PGresult *res) {
+    return res && PQresultStatus(res) == PGRES_FATAL_ERROR && !PQresultErrorField(res, PG_DIAG_SQLSTATE);
+}
+
+/* PQexecPrepared that also tells whether the statement left the client:
+ * *sent is 0 if it failed before going out, so it cannot have run */
+static PGresult *exec_once(PGconn *conn, int stmt, const char *const *params, const int *lengths,
+                           const int *formats, int *sent) {
+    *sent = PQsendQueryPrepared(conn, stmts[stmt].name, stmts[stmt].n_params, params, lengths,
+                                formats, 0);
+    if (!*sent) return NULL;
+    /* an error result wins over anything after it, as in PQexec */
+    PGresult *res = NULL, *r;
+    while ((r = PQgetResult(conn)) != NULL) {
+        if (res && PQresultStatus(res) == PGRES_FATAL_ERROR) {
+            PQclear(r);
+            continue;
+        }
+        PQclear(res);
+        res = r;
+    }
+    return res;
+}
+
+/* Run a prepared statement, surviving a dropped connection: reset it,
+ * prepare again and retry once. The retry only happens if the statement
+ * cannot have run (it never went out, or its prepared statement was gone)
+ * or if running it twice is harmless (stmts[].rerun); otherwise the
+ * connection is still reset but the caller gets an outcome_unknown()
+ * error, since a committed DELETE would come back as "not found". */
+static PGresult *exec_stmt(db_slot_t *slot, int stmt, const char *const *params, const int *lengths,
+                           const int *formats) {
+    int sent;
+    PGresult *res = exec_once(slot->conn, stmt, params, lengths, formats, &sent);
+    if (PQstatus(slot->conn) != CONNECTION_BAD && !lost_statement(res)) return res;
+    int ran = sent && !lost_statement(res);
+    PQclear(res);
+    /* what the caller gets unless it runs again: NULL if it never ran,
+     * otherwise an outcome_unknown() result */
+    res = ran ? PQmakeEmptyPGresult(slot->conn, PGRES_FATAL_ERROR) : NULL;
+    if (PQstatus(slot->conn) == CONNECTION_BAD) {
+        PQreset(slot->conn);
+        pthread_mutex_lock(&pool_lock);
+        reconnects++;
+        pthread_mutex_unlock(&pool_lock);
+        if (PQstatus(slot->conn) != CONNECTION_OK) {
+            fprintf(stderr, "db: reconnect failed: %s\n", PQerrorMessage(slot->conn));
+            return res;
+        }
+    }
+    if (prepare_all(slot->conn) != 0) return res;
+    if (ran && !stmts[stmt].rerun) {
+        fprintf(stderr, "db: connection lost during %s, not retrying it\n", stmts[stmt].name);
+        return res;
+    }
+    PQclear(res);
+    return PQexecPrepared(slot->conn, stmts[stmt].name, stmts[stmt].n_params, params, lengths, formats, 0);
+}
+
+/* ---- pipeline mode: the reactor ----
+ *
+ * One reactor thread owns every connection. Each connection is
+ * nonblocking and in libpq pipeline mode, and the reactor waits on all of
+ * their sockets plus a wakeup eventfd with epoll. A statement is handed to
+ * the reactor as a request carrying a completion callback. The reactor
+ * sends it on the connection with the fewest statements in flight (at most
+ * RX_DEPTH each) and calls the callback, on the reactor thread, once the
+ * result is in. Blocking callers wait on a future built from such a
+ * callback, so the number of statements outstanding no longer depends on
+ * how many threads are waiting for them.
+ *
+ * Every statement gets its own sync point, so each is still its own
+ * transaction and a failing one doesn't abort the ones behind it. A
+ * dropped connection is reset and whatever was in flight on it is sent
+ * again, once, if stmts[].rerun allows it (the rest fail), as in sync
+ * mode; the reset blocks the reactor while it runs. Lost prepared
+ * statements stop new sends on that connection until its pipeline
+ * drains, then everything is prepared again. */
+
+#define RX_DEPTH 128
+#define RX_MAX_PARAMS 4
+#define RX_RECONNECT_NS 1000000000ULL /* between failed reset attempts */
+
+/* Takes ownership of res, which is NULL if the statement never ran */
+typedef void (*rx_done_fn)(PGresult *res, void *arg);
+
+typedef struct rx_req {
+    struct rx_req *next;
+    int stmt;
+    int retried;
+    rx_done_fn done;
+    void *arg;
+    PGresult *res;
+    const char *params[RX_MAX_PARAMS];
+    int lengths[RX_MAX_PARAMS];
+    int formats[RX_MAX_PARAMS];
+    char data[]; /* parameter bytes, when the caller's can't be borrowed */
+} rx_req_t;
+
+typedef struct {
+    db_slot_t *slot;
+    int fd;                    /* socket registered with epoll, -1 if none */
+    int want_out;              /* EPOLLOUT registered */
+    rx_req_t *sent, *sent_tail; /* in flight, oldest first */
+    int broken, reprepare;
+    uint64_t retry_at;         /* broken: no reset attempt before this */
+    /* guarded by rx_lock, for stats */
+    size_t in_flight;
+    uint64_t requests, busy_ns, busy_since, max_depth;
+} rx_conn_t;
+
+static rx_conn_t *rx_conns = NULL; /* non-NULL in pipeline mode */
+static pthread_t rx_thread;
+static int rx_epfd = -1, rx_wake_fd = -1;
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+/* guarded by rx_lock */
+static rx_req_t *rx_queue, *rx_queue_tail; /* submitted, not picked up */
+static int rx_stop;
+/* reactor thread only: picked up, waiting for room on a connection */
+static rx_req_t *rx_pending, *rx_pending_tail;
+
+static int rx_enter(PGconn *conn) {
+    return PQsetnonblocking(conn, 1) == 0 && PQenterPipelineMode(conn) == 1 ? 0 : -1;
+}
+
+/* (Re)register a connection's socket; it changes across resets */
+static void rx_watch(rx_conn_t *c) {
+    int fd = PQsocket(c->slot->conn);
+    struct epoll_event ev = { .events = EPOLLIN | (c->want_out ? EPOLLOUT : 0),
+                              .data.ptr = c };
+    if (fd == c->fd) {
+        epoll_ctl(rx_epfd, EPOLL_CTL_MOD, fd, &ev);
+        return;
+    }
+    if (c->fd >= 0) epoll_ctl(rx_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->fd = fd;
+    if (fd >= 0) epoll_ctl(rx_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void rx_pending_push_front(rx_req_t *first, rx_req_t *last) {
+    last->next = rx_pending;
+    if (!rx_pending) rx_pending_tail = last;
+    rx_pending = first;
+}
+
+/* A statement left connection c */
+static void rx_landed(rx_conn_t *c) {
+    pthread_mutex_lock(&rx_lock);
+    if (--c->in_flight == 0) c->busy_ns += now_ns() - c->busy_since;
+    pthread_mutex_unlock(&rx_lock);
+}
+
+static void rx_finish(rx_req_t *r, PGresult *res) {
+    r->done(res, r->arg);
+    free(r);
+}
+
+/* Connection dropped: what was in flight goes back to the front of the
+ * pending list (or fails, if it was already a retry or may not run twice)
+ * and the connection is reset. */
+static void rx_recover(rx_conn_t *c) {
+    rx_req_t *retry = NULL, *last = NULL;
+    for (rx_req_t *r = c->sent, *next; r; r = next) {
+        next = r->next;
+        PQclear(r->res);
+        r->res = NULL;
+        rx_landed(c);
+        if (r->retried || !stmts[r->stmt].rerun) {
+            /* it went out, so it may have run: outcome_unknown() */
+            rx_finish(r, PQmakeEmptyPGresult(c->slot->conn, PGRES_FATAL_ERROR));
+            continue;
+        }
+        r->retried = 1;
+        r->next = NULL;
+        if (last) last->next = r;
+        else retry = r;
+        last = r;
+    }
+    if (last) rx_pending_push_front(retry, last);
+    c->sent = c->sent_tail = NULL;
+
+    PGconn *conn = c->slot->conn;
+    /* the reset closes the socket, and its number may come straight back */
+    if (c->fd >= 0) epoll_ctl(rx_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->fd = -1;
+    PQreset(conn);
+    pthread_mutex_lock(&pool_lock);
+    reconnects++;
+    pthread_mutex_unlock(&pool_lock);
+    c->want_out = 0;
+    if (PQstatus(conn) == CONNECTION_OK && prepare_all(conn) == 0 && rx_enter(conn) == 0) {
+        c->broken = 0;
+        c->reprepare = 0;
+        rx_watch(c);
+    } else {
+        fprintf(stderr, "db: pipeline reconnect failed: %s\n", PQerrorMessage(conn));
+        c->retry_at = now_ns() + RX_RECONNECT_NS;
+    }
+}
+
+/* Nothing in flight: leave pipeline mode just long enough to prepare */
+static void rx_reprepare(rx_conn_t *c) {
+    PGconn *conn = c->slot->conn;
+    c->reprepare = 0;
+    if (PQexitPipelineMode(conn) != 1 || PQsetnonblocking(conn, 0) != 0 ||
+        prepare_all(conn) != 0 || rx_enter(conn) != 0)
+        c->broken = 1;
+}
+
+/* One result off the wire for the oldest statement on c */
+static void rx_result(rx_conn_t *c, PGresult *res) {
+    rx_req_t *r = c->sent;
+    if (PQresultStatus(res) != PGRES_PIPELINE_SYNC) {
+        /* the statement's own result; the sync that ends it comes next */
+        if (!r->res) r->res = res;
+        else PQclear(res);
+        return;
+    }
+    PQclear(res);
+    c->sent = r->next;
+    if (!c->sent) c->sent_tail = NULL;
+    rx_landed(c);
+    if (r->res && lost_statement(r->res) && !r->retried) {
+        PQclear(r->res);
+        r->res = NULL;
+        r->retried = 1;
+        c->reprepare = 1;
+        rx_pending_push_front(r, r);
+        return;
+    }
+    rx_finish(r, r->res);
+}
+
+/* Send pending statements, least loaded connection first. Returns
+ * non-zero if some connection could take more. */
+static int rx_dispatch(void) {
+    while (rx_pending) {
+        rx_conn_t *best = NULL;
+        for (size_t i = 0; i < pool_size; ++i) {
+            rx_conn_t *c = &rx_conns[i];
+            if (c->broken || c->reprepare || c->in_flight >= RX_DEPTH) continue;
+            if (!best || c->in_flight < best->in_flight) best = c;
+        }
+        if (!best) return 0;
+        rx_req_t *r = rx_pending;
+        PGconn *conn = best->slot->conn;
+        if (!PQsendQueryPrepared(conn, stmts[r->stmt].name, stmts[r->stmt].n_params, r->params,
+                                 r->lengths, r->formats, 0)) {
+            best->broken = 1; /* r stays pending for another connection */
+            continue;
+        }
+        rx_pending = r->next;
+        if (!rx_pending) rx_pending_tail = NULL;
+        r->next = NULL;
+        if (best->sent_tail) best->sent_tail->next = r;
+        else best->sent = r;
+        best->sent_tail = r;
+        pthread_mutex_lock(&rx_lock);
+        if (best->in_flight++ == 0) best->busy_since = now_ns();
+        if (best->in_flight > best->max_depth) best->max_depth = best->in_flight;
+        best->requests++;
+        pthread_mutex_unlock(&rx_lock);
+        if (!PQpipelineSync(conn)) best->broken = 1;
+    }
+    return 1;
+}
+
+static void rx_read(rx_conn_t *c) {
+    PGconn *conn = c->slot->conn;
+    if (!PQconsumeInput(conn)) {
+        c->broken = 1;
+        return;
+    }
+    while (c->sent && !PQisBusy(conn)) {
+        PGresult *res = PQgetResult(conn);
+        if (res) rx_result(c, res);
+        else if (PQstatus(conn) == CONNECTION_BAD) break;
+    }
+    if (PQstatus(conn) == CONNECTION_BAD) c->broken = 1;
+}
+
+static void *rx_main(void *arg) {
+    (void)arg;
+    struct epoll_event events[64];
+    for (;;) {
+        pthread_mutex_lock(&rx_lock);
+        if (rx_queue) {
+            if (rx_pending_tail) rx_pending_tail->next = rx_queue;
+            else rx_pending = rx_queue;
+            rx_pending_tail = rx_queue_tail;
+            rx_queue = rx_queue_tail = NULL;
+        }
+        int stopping = rx_stop;
+        pthread_mutex_unlock(&rx_lock);
+
+        int in_flight = 0, usable = 0;
+        uint64_t now = now_ns(), wake_at = UINT64_MAX;
+        for (size_t i = 0; i < pool_size; ++i) {
+            rx_conn_t *c = &rx_conns[i];
+            /* a connection that is down is only reset once there is
+             * work for it, and not more than once per RX_RECONNECT_NS */
+            if (c->broken && (c->sent || rx_pending)) {
+                if (c->retry_at <= now) rx_recover(c);
+                if (c->broken && c->retry_at < wake_at) wake_at = c->retry_at;
+            } else if (c->reprepare && !c->sent) {
+                rx_reprepare(c);
+            }
+            in_flight |= c->sent != NULL;
+            usable |= !c->broken;
+        }
+        if (!usable) {
+            /* every connection is down and won't come back: fail what
+             * is waiting instead of holding it */
+            while (rx_pending) {
+                rx_req_t *r = rx_pending;
+                rx_pending = r->next;
+                rx_finish(r, NULL);
+            }
+            rx_pending_tail = NULL;
+        }
+        if (stopping && !rx_pending && !in_flight) break;
+
+        rx_dispatch();
+        for (size_t i = 0; i < pool_size; ++i) {
+            rx_conn_t *c = &rx_conns[i];
+            if (c->broken) continue;
+            int flush = PQflush(c->slot->conn);
+            if (flush < 0) {
+                c->broken = 1;
+                continue;
+            }
+            if (flush != c->want_out) {
+                c->want_out = flush;
+                rx_watch(c);
+            }
+        }
+
+        /* don't sleep through a repair that is due */
+        int timeout = -1;
+        for (size_t i = 0; i < pool_size; ++i) {
+            rx_conn_t *c = &rx_conns[i];
+            if ((c->broken && (c->sent || rx_pending) && c->retry_at <= now) ||
+                (c->reprepare && !c->sent))
+                timeout = 0;
+        }
+        if (timeout && wake_at != UINT64_MAX) {
+            uint64_t t = now_ns();
+            timeout = wake_at > t ? (int)((wake_at - t) / 1000000 + 1) : 0;
+        }
+        int n = epoll_wait(rx_epfd, events, 64, timeout);
+        for (int i = 0; i < n; ++i) {
+            rx_conn_t *c = events[i].data.ptr;
+            if (!c) {
+                uint64_t v;
+                if (read(rx_wake_fd, &v, sizeof(v)) < 0) {}
+                continue;
+            }
+            if (c->broken) continue;
+            if ((events[i].events & EPOLLOUT) && PQflush(c->slot->conn) < 0) c->broken = 1;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) rx_read(c);
+        }
+    }
+    return NULL;
+}
+
+/* Hand a statement to the reactor; done runs on the reactor thread. With
+ * borrow the parameters must stay valid until then, otherwise they are
+ * copied. Returns -1 (done not called) if the reactor is stopping. */
+static int rx_submit(int stmt, const char *const *params, const int *lengths, const int *formats,
+                     int borrow, rx_done_fn done, void *arg) {
+    int n = stmts[stmt].n_params;
+    size_t sizes[RX_MAX_PARAMS], total = 0;
+    for (int i = 0; i < n; ++i) {
+        int binary = formats && formats[i];
+        sizes[i] = !params[i] ? 0 : binary ? (size_t)lengths[i] : strlen(params[i]) + 1;
+        if (!borrow) total += sizes[i];
+    }
+    rx_req_t *r = malloc(sizeof(*r) + total);
+    if (!r) return -1;
+    memset(r, 0, sizeof(*r));
+    r->stmt = stmt;
+    r->done = done;
+    r->arg = arg;
+    char *p = r->data;
+    for (int i = 0; i < n; ++i) {
+        r->lengths[i] = lengths ? lengths[i] : 0;
+        r->formats[i] = formats ? formats[i] : 0;
+        if (borrow || !params[i]) {
+            r->params[i] = params[i];
+            continue;
+        }
+        memcpy(p, params[i], sizes[i]);
+        r->params[i] = p;
+        p += sizes[i];
+    }
+    pthread_mutex_lock(&rx_lock);
+    if (rx_stop) {
+        pthread_mutex_unlock(&rx_lock);
+        free(r);
+        return -1;
+    }
+    /* a non-empty queue means the reactor has already been woken */
+    int was_empty = !rx_queue;
+    if (rx_queue_tail) rx_queue_tail->next = r;
+    else rx_queue = r;
+    rx_queue_tail = r;
+    pthread_mutex_unlock(&rx_lock);
+    if (was_empty) {
+        uint64_t one = 1;
+        if (write(rx_wake_fd, &one, sizeof(one)) < 0) {}
+    }
+    return 0;
+}
+
+/* A blocking caller's side of a request */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    PGresult *res;
+} rx_future_t;
+
+static void rx_resolve(PGresult *res, void *arg) {
+    rx_future_t *f = arg;
+    pthread_mutex_lock(&f->lock);
+    f->res = res;
+    f->done = 1;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+static PGresult *rx_exec(int stmt, const char *const *params, const int *lengths, const int *formats) {
+    rx_future_t f = { .done = 0, .res = NULL };
+    pthread_mutex_init(&f.lock, NULL);
+    pthread_cond_init(&f.cond, NULL);
+    if (rx_submit(stmt, params, lengths, formats, 1, rx_resolve, &f) == 0) {
+        pthread_mutex_lock(&f.lock);
+        while (!f.done) pthread_cond_wait(&f.cond, &f.lock);
+        pthread_mutex_unlock(&f.lock);
+    }
+    pthread_cond_destroy(&f.cond);
+    pthread_mutex_destroy(&f.lock);
+    return f.res;
+}
+
+static void rx_close(void) {
+    if (!rx_conns) return;
+    pthread_mutex_lock(&rx_lock);
+    rx_stop = 1;
+    pthread_mutex_unlock(&rx_lock);
+    uint64_t one = 1;
+    if (write(rx_wake_fd, &one, sizeof(one)) < 0) {}
+    pthread_join(rx_thread, NULL);
+    close(rx_epfd);
+    close(rx_wake_fd);
+    rx_epfd = rx_wake_fd = -1;
+    free(rx_conns);
+    rx_conns = NULL;
+}
+
+static int rx_start(void) {
+    rx_conns = calloc(pool_size, sizeof(*rx_conns));
+    rx_epfd = epoll_create1(EPOLL_CLOEXEC);
+    rx_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (!rx_conns || rx_epfd < 0 || rx_wake_fd < 0 ||
+        epoll_ctl(rx_epfd, EPOLL_CTL_ADD, rx_wake_fd, &ev) != 0)
+        goto fail;
+    for (size_t i = 0; i < pool_size; ++i) {
+        rx_conn_t *c = &rx_conns[i];
+        c->slot = &pool[i];
+        c->fd = -1;
+        if (rx_enter(pool[i].conn) != 0) {
+            fprintf(stderr, "db_init: pipeline mode failed: %s\n", PQerrorMessage(pool[i].conn));
+            goto fail;
+        }
+        rx_watch(c);
+    }
+    rx_stop = 0;
+    rx_queue = rx_queue_tail = rx_pending = rx_pending_tail = NULL;
+    if (pthread_create(&rx_thread, NULL, rx_main, NULL) != 0) goto fail;
+    return 0;
+fail:
+    if (rx_epfd >= 0) close(rx_epfd);
+    if (rx_wake_fd >= 0) close(rx_wake_fd);
+    rx_epfd = rx_wake_fd = -1;
+    free(rx_conns);
+    rx_conns = NULL;
+    return -1;
+}
+
+/* One statement on whatever connection the pool mode hands out. The
+ * result outlives the checkout; NULL if the pool is closed. */
+static PGresult *run_stmt(int stmt, const char *const *params, const int *lengths, const int *formats) {
+    if (rx_conns) return rx_exec(stmt, params, lengths, formats);
+    db_slot_t *slot = db_acquire();
+    if (!slot) return NULL;
+    PGresult *res = exec_stmt(slot, stmt, params, lengths, formats);
+    db_release(slot);
+    return res;
+}
+
+/* kv_put's parameters; params point into the struct */
+typedef struct {
+    uint64_t ttl_be;
+    const char *params[3];
+    int lengths[3];
+    int formats[3];
+} put_args_t;
+
+static void put_args(put_args_t *a, const char *key, const char *value, long ttl_sec) {
+    /* int8 in network order; text keeps the text format, whose wire bytes
+     * are the same either way */
+    a->ttl_be = htobe64((uint64_t)ttl_sec);
+    a->params[0] = key;
+    a->params[1] = value;
+    a->params[2] = ttl_sec > 0 ? (const char *)&a->ttl_be : NULL;
+    a->lengths[0] = a->lengths[1] = 0;
+    a->lengths[2] = sizeof(a->ttl_be);
+    a->formats[0] = a->formats[1] = 0;
+    a->formats[2] = 1;
+}
+
+/* Outcomes of the kv statements; both take ownership of res */
+static int put_outcome(PGresult *res) {
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "db_put error: %s\n", PQerrorMessage(conn));
+        fprintf(stderr, "db_put error: %s\n", res ? PQresultErrorMessage(res) : "no connection");
         PQclear(res);
-        pthread_mutex_unlock(&db_lock);
         return -1;
     }
     PQclear(res);
-    pthread_mutex_unlock(&db_lock);
     return 0;
 }
 
-int db_get(const char *key, char **out_value) {
-    if (!conn) return -1;
-    pthread_mutex_lock(&db_lock);
-    const char *paramValues[1] = { key };
-    PGresult *res = PQexecParams(conn,
-                                 "SELECT value FROM kv_store WHERE key = $1;",
-                                 1, NULL, paramValues, NULL, NULL, 0);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+static int delete_outcome(PGresult *res) {
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
         PQclear(res);
-        pthread_mutex_unlock(&db_lock);
         return -1;
     }
-    if (PQntuples(res) == 0) {
+    int affected = atoi(PQcmdTuples(res));
+    PQclear(res);
+    return (affected > 0) ? 0 : -1;
+}
+
+/* kv_get's value, pointing into res; NULL if missing or failed */
+static const char *get_value(const PGresult *res, long *ttl_left) {
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) return NULL;
+    if (ttl_left) {
+        long left = PQgetisnull(res, 0, 1) ? 0 : atol(PQgetvalue(res, 0, 1));
+        *ttl_left = PQgetisnull(res, 0, 1) ? 0 : (left > 0 ? left : 1);
+    }
+    return PQgetvalue(res, 0, 0);
+}
+
+int db_put(const char *key, const char *value, long ttl_sec) {
+    put_args_t a;
+    put_args(&a, key, value, ttl_sec);
+    /* marked before, so a read racing the commit stays off the replicas,
+     * and after, so the window runs from when the row changed */
+    note_write(key);
+    int rc = put_outcome(run_stmt(STMT_PUT, a.params, a.lengths, a.formats));
+    note_write(key);
+    return rc;
+}
+
+int db_get(const char *key, char **out_value, long *ttl_left) {
+    const char *paramValues[1] = { key };
+    PGresult *res = replica_read(STMT_GET, paramValues, NULL, NULL, paramValues, 1);
+    if (!res) res = run_stmt(STMT_GET, paramValues, NULL, NULL);
+    const char *val = get_value(res, ttl_left);
+    if (!val) {
         PQclear(res);
-        pthread_mutex_unlock(&db_lock);
         return -1;
     }
-    char *val = strdup(PQgetvalue(res, 0, 0));
+    *out_value = strdup(val);
     PQclear(res);
-    *out_value = val;
-    pthread_mutex_unlock(&db_lock);
     return 0;
 }
 
 int db_delete(const char *key) {
-    if (!conn) return -1;
-    pthread_mutex_lock(&db_lock);
     const char *params[1] = { key };
-    PGresult *res = PQexecParams(conn, "DELETE FROM kv_store WHERE key = $1;", 1, NULL, params, NULL, NULL, 0);
+    note_write(key); /* before and after, as in db_put */
+    int rc = delete_outcome(run_stmt(STMT_DELETE, params, NULL, NULL));
+    note_write(key);
+    return rc;
+}
+
+/* ---- completion-callback API ---- */
+
+typedef struct {
+    union {
+        db_get_cb get;
+        db_write_cb write;
+    } cb;
+    void *arg;
+} async_ctx_t;
+
+static void get_done(PGresult *res, void *p) {
+    async_ctx_t *a = p;
+    long ttl_left = 0;
+    const char *val = get_value(res, &ttl_left);
+    a->cb.get(val ? 0 : -1, val, ttl_left, a->arg);
+    PQclear(res);
+    free(a);
+}
+
+static void put_done(PGresult *res, void *p) {
+    async_ctx_t *a = p;
+    a->cb.write(put_outcome(res), a->arg);
+    free(a);
+}
+
+static void delete_done(PGresult *res, void *p) {
+    async_ctx_t *a = p;
+    a->cb.write(delete_outcome(res), a->arg);
+    free(a);
+}
+
+/* Queues stmt with copied parameters; ctx is freed on failure */
+static int submit_async(int stmt, const char *const *params, const int *lengths, const int *formats,
+                        rx_done_fn done, async_ctx_t *ctx) {
+    if (!ctx) return -1;
+    if (rx_submit(stmt, params, lengths, formats, 0, done, ctx) != 0) {
+        free(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+int db_get_async(const char *key, db_get_cb cb, void *arg) {
+    if (!rx_conns) {
+        char *val = NULL;
+        long ttl_left = 0;
+        int rc = db_get(key, &val, &ttl_left);
+        cb(rc, val, ttl_left, arg);
+        free(val);
+        return 0;
+    }
+    async_ctx_t *a = malloc(sizeof(*a));
+    if (a) {
+        a->cb.get = cb;
+        a->arg = arg;
+    }
+    const char *params[1] = { key };
+    return submit_async(STMT_GET, params, NULL, NULL, get_done, a);
+}
+
+int db_put_async(const char *key, const char *value, long ttl_sec, db_write_cb cb, void *arg) {
+    if (!rx_conns) {
+        cb(db_put(key, value, ttl_sec), arg);
+        return 0;
+    }
+    async_ctx_t *a = malloc(sizeof(*a));
+    if (a) {
+        a->cb.write = cb;
+        a->arg = arg;
+    }
+    put_args_t p;
+    put_args(&p, key, value, ttl_sec);
+    /* marked on the way in; the replica window is longer than the trip */
+    note_write(key);
+    return submit_async(STMT_PUT, p.params, p.lengths, p.formats, put_done, a);
+}
+
+int db_delete_async(const char *key, db_write_cb cb, void *arg) {
+    if (!rx_conns) {
+        cb(db_delete(key), arg);
+        return 0;
+    }
+    async_ctx_t *a = malloc(sizeof(*a));
+    if (a) {
+        a->cb.write = cb;
+        a->arg = arg;
+    }
+    const char *params[1] = { key };
+    note_write(key);
+    return submit_async(STMT_DELETE, params, NULL, NULL, delete_done, a);
+}
+
+long db_purge_expired(int batch) {
+    uint32_t batch_be = htobe32((uint32_t)batch);
+    const char *params[1] = { (const char *)&batch_be };
+    const int lengths[1] = { sizeof(batch_be) };
+    const int formats[1] = { 1 };
+    PGresult *res = run_stmt(STMT_PURGE, params, lengths, formats);
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "db_purge_expired error: %s\n", res ? PQresultErrorMessage(res) : "no connection");
         PQclear(res);
-        pthread_mutex_unlock(&db_lock);
         return -1;
     }
-    int affected = atoi(PQcmdTuples(res));
+    long affected = atol(PQcmdTuples(res));
     PQclear(res);
-    pthread_mutex_unlock(&db_lock);
-    return (affected > 0) ? 0 : -1;
+    return affected;
+}
+
+/* Binary one-dimensional array for a bind parameter; lens[i] < 0 is NULL.
+ * Returns a malloc'd buffer and its length in *out_len. */
+static char *array_bin(Oid elem, size_t n, const char *const *vals, const int *lens, int *out_len) {
+    size_t size = 20;
+    for (size_t i = 0; i < n; ++i) size += 4 + (lens[i] > 0 ? (size_t)lens[i] : 0);
+    char *buf = malloc(size), *p = buf;
+    if (!buf) return NULL;
+    uint32_t hdr[5] = { htobe32(n ? 1 : 0), 0, htobe32(elem), htobe32((uint32_t)n), htobe32(1) };
+    for (size_t i = 0; i < n; ++i)
+        if (lens[i] < 0) hdr[1] = htobe32(1);
+    /* an empty array has no dimensions at all */
+    size_t hlen = n ? sizeof(hdr) : 3 * sizeof(uint32_t);
+    memcpy(p, hdr, hlen);
+    p += hlen;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t len = htobe32((uint32_t)lens[i]);
+        memcpy(p, &len, 4);
+        p += 4;
+        if (lens[i] > 0) {
+            memcpy(p, vals[i], (size_t)lens[i]);
+            p += lens[i];
+        }
+    }
+    *out_len = (int)(p - buf);
+    return buf;
+}
+
+int db_write_batch(size_t n_put, const char *const *put_keys, const char *const *put_values,
+                   const long *put_ttls, size_t n_del, const char *const *del_keys, int *deleted) {
+    size_t n_lens = n_put > n_del ? n_put : n_del;
+    int *lens = calloc(n_lens ? n_lens : 1, sizeof(int));
+    uint64_t *ttls = malloc((n_put ? n_put : 1) * sizeof(uint64_t));
+    const char **ttl_vals = malloc((n_put ? n_put : 1) * sizeof(char *));
+    char *arr[4] = { NULL, NULL, NULL, NULL };
+    int arr_len[4];
+    int rc = -1;
+    if (!lens || !ttls || !ttl_vals) goto out;
+
+    for (size_t i = 0; i < n_put; ++i) lens[i] = (int)strlen(put_keys[i]);
+    arr[0] = array_bin(TEXTOID, n_put, put_keys, lens, &arr_len[0]);
+    for (size_t i = 0; i < n_put; ++i) lens[i] = (int)strlen(put_values[i]);
+    arr[1] = array_bin(TEXTOID, n_put, put_values, lens, &arr_len[1]);
+    for (size_t i = 0; i < n_put; ++i) {
+        ttls[i] = htobe64((uint64_t)put_ttls[i]);
+        ttl_vals[i] = (const char *)&ttls[i];
+        lens[i] = put_ttls[i] > 0 ? (int)sizeof(uint64_t) : -1;
+    }
+    arr[2] = array_bin(INT8OID, n_put, ttl_vals, lens, &arr_len[2]);
+    for (size_t i = 0; i < n_del; ++i) lens[i] = (int)strlen(del_keys[i]);
+    arr[3] = array_bin(TEXTOID, n_del, del_keys, lens, &arr_len[3]);
+    if (!arr[0] || !arr[1] || !arr[2] || !arr[3]) goto out;
+
+    const int formats[4] = { 1, 1, 1, 1 };
+    /* before and after, as in db_put */
+    for (size_t i = 0; i < n_put; ++i) note_write(put_keys[i]);
+    for (size_t i = 0; i < n_del; ++i) note_write(del_keys[i]);
+    PGresult *res = run_stmt(STMT_WRITE_BATCH, (const char *const *)arr, arr_len, formats);
+    for (size_t i = 0; i < n_put; ++i) note_write(put_keys[i]);
+    for (size_t i = 0; i < n_del; ++i) note_write(del_keys[i]);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "db_write_batch error: %s\n", res ? PQresultErrorMessage(res) : "no connection");
+        if (outcome_unknown(res)) rc = -2;
+    } else {
+        memset(deleted, 0, n_del * sizeof(int));
+        for (int r = 0; r < PQntuples(res); ++r) {
+            long i = atol(PQgetvalue(res, r, 0)); /* ordinality counts from 1 */
+            if (i >= 1 && (size_t)i <= n_del) deleted[i - 1] = 1;
+        }
+        rc = 0;
+    }
+    PQclear(res);
+out:
+    for (int i = 0; i < 4; ++i) free(arr[i]);
+    free(lens);
+    free(ttls);
+    free(ttl_vals);
+    return rc;
+}
+
+long db_get_many(size_t n, const char *const *keys, char **values, long *ttls) {
+    for (size_t i = 0; i < n; ++i) {
+        values[i] = NULL;
+        if (ttls) ttls[i] = 0;
+    }
+    if (n == 0) return 0;
+    int *lens = malloc(n * sizeof(int));
+    /* request positions by key hash, to match rows back up; 0 = empty */
+    size_t cap = 1;
+    while (cap < 2 * n) cap <<= 1;
+    size_t mask = cap - 1, *pos = calloc(cap, sizeof(size_t));
+    char *arr = NULL;
+    int arr_len = 0;
+    long found = -1;
+    if (!lens || !pos) goto out;
+    for (size_t i = 0; i < n; ++i) lens[i] = (int)strlen(keys[i]);
+    if (!(arr = array_bin(TEXTOID, n, keys, lens, &arr_len))) goto out;
+    for (size_t i = 0; i < n; ++i) {
+        size_t h = (size_t)key_hash(keys[i]) & mask;
+        while (pos[h]) h = (h + 1) & mask;
+        pos[h] = i + 1;
+    }
+
+    const char *params[1] = { arr };
+    const int formats[1] = { 1 };
+    PGresult *res = replica_read(STMT_GET_MANY, params, &arr_len, formats, keys, n);
+    if (!res) res = run_stmt(STMT_GET_MANY, params, &arr_len, formats);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "db_get_many error: %s\n", res ? PQresultErrorMessage(res) : "no connection");
+        PQclear(res);
+        goto out;
+    }
+    found = 0;
+    for (int r = 0; r < PQntuples(res) && found >= 0; ++r) {
+        const char *key = PQgetvalue(res, r, 0);
+        long left = PQgetisnull(res, r, 2) ? 0 : atol(PQgetvalue(res, r, 2));
+        /* every position that asked for this key */
+        for (size_t h = (size_t)key_hash(key) & mask; pos[h]; h = (h + 1) & mask) {
+            size_t i = pos[h] - 1;
+            if (values[i] || strcmp(keys[i], key) != 0) continue;
+            if (!(values[i] = strdup(PQgetvalue(res, r, 1)))) {
+                found = -1;
+                break;
+            }
+            if (ttls) ttls[i] = PQgetisnull(res, r, 2) ? 0 : (left > 0 ? left : 1);
+            found++;
+        }
+    }
+    PQclear(res);
+    if (found < 0) {
+        for (size_t i = 0; i < n; ++i) {
+            free(values[i]);
+            values[i] = NULL;
+        }
+    }
+out:
+    free(arr);
+    free(pos);
+    free(lens);
+    return found;
+}
+
+int db_get_pool_stats(db_pool_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&pool_lock);
+    if (!pool) {
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+    st->size = pool_size;
+    st->in_use = pool_in_use;
+    st->checkouts = checkouts;
+    st->waits = waits;
+    st->wait_ns = wait_ns;
+    st->busy_ns = busy_ns;
+    st->reconnects = reconnects;
+    if (rx_conns) {
+        /* no checkouts to wait for; a connection is in use while it has
+         * anything in flight */
+        st->pipeline = 1;
+        uint64_t now = now_ns();
+        pthread_mutex_lock(&rx_lock);
+        for (size_t i = 0; i < pool_size; ++i) {
+            rx_conn_t *c = &rx_conns[i];
+            st->in_use += c->in_flight > 0;
+            st->in_flight += c->in_flight;
+            st->checkouts += c->requests;
+            st->busy_ns += c->busy_ns + (c->in_flight ? now - c->busy_since : 0);
+            if (c->max_depth > st->max_in_flight) st->max_in_flight = c->max_depth;
+        }
+        pthread_mutex_unlock(&rx_lock);
+    }
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    st->uptime_ns = (uint64_t)(t.tv_sec - pool_started.tv_sec) * 1000000000ULL +
+                    (uint64_t)t.tv_nsec - (uint64_t)pool_started.tv_nsec;
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+long db_scan_keys(int (*cb)(const char *key, void *arg), void *arg) {
+    pthread_mutex_lock(&pool_lock);
+    char *info = db_conninfo ? strdup(db_conninfo) : NULL;
+    pthread_mutex_unlock(&pool_lock);
+    if (!info) return -1;
+
+    /* own connection: a full-table scan must not tie up a pool slot */
+    PGconn *sc = db_connect(info);
+    free(info);
+    if (PQstatus(sc) != CONNECTION_OK) {
+        fprintf(stderr, "db_scan_keys: connection failed: %s\n", PQerrorMessage(sc));
+        PQfinish(sc);
+        return -1;
+    }
+    if (!PQsendQuery(sc, "SELECT key FROM kv_store;") || !PQsetSingleRowMode(sc)) {
+        fprintf(stderr, "db_scan_keys: %s\n", PQerrorMessage(sc));
+        PQfinish(sc);
+        return -1;
+    }
+    /* single-row mode streams the result instead of buffering every key */
+    long n = 0;
+    int failed = 0, stopped = 0;
+    PGresult *res;
+    while ((res = PQgetResult(sc)) != NULL) {
+        ExecStatusType st = PQresultStatus(res);
+        if (st == PGRES_SINGLE_TUPLE && !stopped) {
+            if (cb(PQgetvalue(res, 0, 0), arg) != 0) {
+                stopped = 1;
+                /* drop the rest of the stream on the server side */
+                PGcancel *cancel = PQgetCancel(sc);
+                char err[256];
+                if (cancel) { PQcancel(cancel, err, sizeof(err)); PQfreeCancel(cancel); }
+            } else {
+                n++;
+            }
+        } else if (st != PGRES_SINGLE_TUPLE && st != PGRES_TUPLES_OK && !stopped) {
+            fprintf(stderr, "db_scan_keys: %s\n", PQerrorMessage(sc));
+            failed = 1;
+        }
+        PQclear(res);
+    }
+    PQfinish(sc);
+    return (failed || stopped) ? -1 : n;
+}
+
+/* ---- bulk load ---- */
+
+/* COPY data is buffered and sent in pieces this big */
+#define BULK_SEND_BYTES (256u << 10)
+
+struct db_bulk {
+    PGconn *conn;
+    int copying;     /* a COPY is open on conn */
+    char *buf;
+    size_t len, cap;
+    long staged;     /* rows since the last commit */
+};
+
+/* later rows win over earlier ones for the same key, as they would have
+ * one INSERT at a time */
+static const char bulk_upsert_sql[] =
+    "INSERT INTO kv_store (key, value, expires_at) "
+    "SELECT DISTINCT ON (key) key, value, now() + make_interval(secs => ttl) "
+    "FROM kv_bulk ORDER BY key, ord DESC "
+    "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value, "
+    "expires_at = EXCLUDED.expires_at;"
+    "TRUNCATE kv_bulk;";
+
+db_bulk_t *db_bulk_begin(void) {
+    pthread_mutex_lock(&pool_lock);
+    char *info = db_conninfo ? strdup(db_conninfo) : NULL;
+    pthread_mutex_unlock(&pool_lock);
+    if (!info) return NULL;
+
+    PGconn *conn = db_connect(info);
+    free(info);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        fprintf(stderr, "db_bulk: connection failed: %s\n", PQerrorMessage(conn));
+        PQfinish(conn);
+        return NULL;
+    }
+    /* temp tables skip the WAL and vanish with the connection */
+    PGresult *res = PQexec(conn, "CREATE TEMP TABLE kv_bulk "
+                                 "(ord bigserial, key text, value text, ttl bigint)");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "db_bulk: creating the staging table failed: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        PQfinish(conn);
+        return NULL;
+    }
+    PQclear(res);
+    db_bulk_t *b = calloc(1, sizeof(*b));
+    if (!b) {
+        PQfinish(conn);
+        return NULL;
+    }
+    b->conn = conn;
+    return b;
+}
+
+static int bulk_send(db_bulk_t *b) {
+    if (!b->len) return 0;
+    if (!b->copying) {
+        PGresult *res = PQexec(b->conn, "COPY kv_bulk (key, value, ttl) FROM STDIN");
+        int ok = PQresultStatus(res) == PGRES_COPY_IN;
+        PQclear(res);
+        if (!ok) {
+            fprintf(stderr, "db_bulk: COPY failed: %s\n", PQerrorMessage(b->conn));
+            return -1;
+        }
+        b->copying = 1;
+    }
+    if (PQputCopyData(b->conn, b->buf, (int)b->len) != 1) {
+        fprintf(stderr, "db_bulk: sending rows failed: %s\n", PQerrorMessage(b->conn));
+        return -1;
+    }
+    b->len = 0;
+    return 0;
+}
+
+/* COPY text format: backslash escapes for the delimiter, line breaks and
+ * the backslash itself */
+static char *bulk_escape(char *out, const char *s) {
+    for (; *s; ++s) {
+        switch (*s) {
+            case '\\': *out++ = '\\'; *out++ = '\\'; break;
+            case '\t': *out++ = '\\'; *out++ = 't'; break;
+            case '\n': *out++ = '\\'; *out++ = 'n'; break;
+            case '\r': *out++ = '\\'; *out++ = 'r'; break;
+            default: *out++ = *s; break;
+        }
+    }
+    return out;
+}
+
+int db_bulk_add(db_bulk_t *b, const char *key, const char *value, long ttl_sec) {
+    size_t need = 2 * (strlen(key) + strlen(value)) + 32;
+    if (b->len + need > b->cap) {
+        size_t cap = b->cap ? b->cap : BULK_SEND_BYTES;
+        while (cap < b->len + need) cap *= 2;
+        char *n = realloc(b->buf, cap);
+        if (!n) return -1;
+        b->buf = n;
+        b->cap = cap;
+    }
+    char *p = b->buf + b->len;
+    p = bulk_escape(p, key);
+    *p++ = '\t';
+    p = bulk_escape(p, value);
+    /* \N is NULL: no expiry */
+    p += ttl_sec > 0 ? sprintf(p, "\t%ld\n", ttl_sec) : sprintf(p, "\t\\N\n");
+    b->len = (size_t)(p - b->buf);
+    b->staged++;
+    return b->len >= BULK_SEND_BYTES ? bulk_send(b) : 0;
+}
+
+long db_bulk_commit(db_bulk_t *b) {
+    if (bulk_send(b) != 0) return -1;
+    if (b->copying) {
+        b->copying = 0;
+        int ok = PQputCopyEnd(b->conn, NULL) == 1;
+        PGresult *res;
+        while ((res = PQgetResult(b->conn)) != NULL) {
+            if (PQresultStatus(res) != PGRES_COMMAND_OK) ok = 0;
+            PQclear(res);
+        }
+        if (!ok) {
+            fprintf(stderr, "db_bulk: COPY failed: %s\n", PQerrorMessage(b->conn));
+            return -1;
+        }
+    }
+    if (!b->staged) return 0;
+    /* both statements in one PQexec run as one transaction; every key
+     * counts as written from before it starts until after it ends */
+    note_write_all();
+    PGresult *res = PQexec(b->conn, bulk_upsert_sql);
+    int ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+    PQclear(res);
+    note_write_all();
+    if (!ok) {
+        fprintf(stderr, "db_bulk: upsert failed: %s\n", PQerrorMessage(b->conn));
+        return -1;
+    }
+    long n = b->staged;
+    b->staged = 0;
+    return n;
+}
+
+void db_bulk_end(db_bulk_t *b) {
+    if (!b) return;
+    if (b->copying) {
+        PQputCopyEnd(b->conn, "load abandoned");
+        PGresult *res;
+        while ((res = PQgetResult(b->conn)) != NULL) PQclear(res);
+    }
+    PQfinish(b->conn);
+    free(b->buf);
+    free(b);
+}
+
+/* ---- cross-instance invalidation ---- */
+
+/* Every committed change to a kv_store row sends one notification on
+ * kv_invalidate, "origin|microseconds|k<key>", so writes that don't come
+ * through db_put (batches, bulk loads, psql) are covered too. The
+ * triggers are per statement and read the changed rows from transition
+ * tables: a statement that changes more than 1000 rows, like a bulk load
+ * chunk, sends a single "*" (drop everything) instead of one notification
+ * per row. So does a key too long for the 8000-byte payload limit.
+ * Deleting a row that had already expired changes nothing anyone can
+ * read, so the purge stays quiet. Transition tables allow one event per
+ * trigger, hence three; the per-row trigger of older versions is
+ * replaced. The advisory lock keeps two servers starting at once from
+ * tripping over each other. */
+static const char invalidate_trigger_sql[] =
+    "SELECT pg_advisory_xact_lock(hashtext('kv_store_invalidate'));"
+    "CREATE OR REPLACE FUNCTION kv_notify_invalidate() RETURNS trigger "
+    "LANGUAGE plpgsql AS $$ "
+    "DECLARE pre text; n bigint; "
+    "BEGIN "
+    "pre := current_setting('application_name') || '|' || "
+    "(extract(epoch FROM clock_timestamp()) * 1000000)::bigint || '|'; "
+    "IF TG_OP = 'DELETE' THEN "
+    "SELECT count(*) INTO n FROM (SELECT 1 FROM old_rows "
+    "WHERE expires_at IS NULL OR expires_at > now() LIMIT 1001) c; "
+    "IF n > 1000 THEN PERFORM pg_notify('kv_invalidate', pre || '*'); "
+    "ELSE PERFORM pg_notify('kv_invalidate', pre || "
+    "CASE WHEN octet_length(key) > 7000 THEN '*' ELSE 'k' || key END) "
+    "FROM old_rows WHERE expires_at IS NULL OR expires_at > now(); "
+    "END IF; "
+    "ELSE "
+    "SELECT count(*) INTO n FROM (SELECT 1 FROM new_rows LIMIT 1001) c; "
+    "IF n > 1000 THEN PERFORM pg_notify('kv_invalidate', pre || '*'); "
+    "ELSE PERFORM pg_notify('kv_invalidate', pre || "
+    "CASE WHEN octet_length(key) > 7000 THEN '*' ELSE 'k' || key END) FROM new_rows; "
+    "END IF; "
+    "END IF; "
+    "RETURN NULL; "
+    "END $$;"
+    "DO $$ BEGIN "
+    "IF EXISTS (SELECT 1 FROM pg_trigger WHERE tgname = 'kv_store_invalidate' "
+    "AND tgrelid = 'kv_store'::regclass) THEN "
+    "DROP TRIGGER kv_store_invalidate ON kv_store; "
+    "END IF; "
+    "IF NOT EXISTS (SELECT 1 FROM pg_trigger WHERE tgname = 'kv_store_invalidate_ins' "
+    "AND tgrelid = 'kv_store'::regclass) THEN "
+    "CREATE TRIGGER kv_store_invalidate_ins AFTER INSERT ON kv_store "
+    "REFERENCING NEW TABLE AS new_rows "
+    "FOR EACH STATEMENT EXECUTE PROCEDURE kv_notify_invalidate(); "
+    "CREATE TRIGGER kv_store_invalidate_upd AFTER UPDATE ON kv_store "
+    "REFERENCING NEW TABLE AS new_rows "
+    "FOR EACH STATEMENT EXECUTE PROCEDURE kv_notify_invalidate(); "
+    "CREATE TRIGGER kv_store_invalidate_del AFTER DELETE ON kv_store "
+    "REFERENCING OLD TABLE AS old_rows "
+    "FOR EACH STATEMENT EXECUTE PROCEDURE kv_notify_invalidate(); "
+    "END IF; "
+    "END $$;";
+
+/* how long to wait before reconnecting, and how often an idle listener
+ * checks that its connection is still alive */
+#define INV_RETRY_MS 1000
+#define INV_PING_MS 5000
+
+static pthread_t inv_thread;
+static int inv_running = 0;
+static int inv_stop_fd = -1;
+static PGconn *inv_conn = NULL; /* owned by the listener thread once started */
+static db_invalidate_fn inv_cb;
+static void *inv_arg;
+static pthread_mutex_t inv_lock = PTHREAD_MUTEX_INITIALIZER;
+static db_invalidation_stats_t inv_stats; /* guarded by inv_lock */
+
+static PGconn *inv_connect(int install) {
+    pthread_mutex_lock(&pool_lock);
+    char *info = db_conninfo ? strdup(db_conninfo) : NULL;
+    pthread_mutex_unlock(&pool_lock);
+    if (!info) return NULL;
+    PGconn *conn = db_connect(info);
+    free(info);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        fprintf(stderr, "db_invalidation: connection failed: %s\n", PQerrorMessage(conn));
+        PQfinish(conn);
+        return NULL;
+    }
+    PGresult *res;
+    if (install) {
+        /* all statements in one PQexec run as one transaction */
+        res = PQexec(conn, invalidate_trigger_sql);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            fprintf(stderr, "db_invalidation: installing the trigger failed: %s\n", PQerrorMessage(conn));
+            PQclear(res);
+            PQfinish(conn);
+            return NULL;
+        }
+        PQclear(res);
+    }
+    res = PQexec(conn, "LISTEN kv_invalidate");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "db_invalidation: LISTEN failed: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        PQfinish(conn);
+        return NULL;
+    }
+    PQclear(res);
+    return conn;
+}
+
+static uint64_t wall_us(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return (uint64_t)t.tv_sec * 1000000ULL + (uint64_t)t.tv_nsec / 1000;
+}
+
+static void inv_apply(const char *payload) {
+    const char *bar = strchr(payload, '|');
+    char *end;
+    long long sent = bar ? strtoll(bar + 1, &end, 10) : 0;
+    if (!bar || *end != '|' || (end[1] != 'k' && end[1] != '*')) {
+        fprintf(stderr, "db_invalidation: ignoring malformed notification\n");
+        return;
+    }
+    const char *what = end + 1;
+    int own = (size_t)(bar - payload) == strlen(db_origin) &&
+              memcmp(payload, db_origin, (size_t)(bar - payload)) == 0;
+    /* our own writes already updated the cache on the way through; the
+     * others' must not come back into it from a replica that is behind */
+    if (!own) {
+        if (*what == 'k') note_write(what + 1);
+        else note_write_all();
+        inv_cb(*what == 'k' ? what + 1 : NULL, inv_arg);
+    }
+
+    /* lag as seen on our clock, so it assumes the hosts agree on time */
+    uint64_t now = wall_us();
+    uint64_t lag = sent > 0 && now > (uint64_t)sent ? now - (uint64_t)sent : 0;
+    pthread_mutex_lock(&inv_lock);
+    inv_stats.received++;
+    if (own) {
+        inv_stats.own++;
+    } else {
+        if (*what == 'k') inv_stats.applied++;
+        else inv_stats.flushes++;
+        inv_stats.lag_us_total += lag;
+        inv_stats.lag_us_last = lag;
+        if (lag > inv_stats.lag_us_max) inv_stats.lag_us_max = lag;
+    }
+    pthread_mutex_unlock(&inv_lock);
+}
+
+/* 1 if db_invalidation_stop was called while waiting */
+static int inv_wait(int fd, int timeout_ms, int *readable) {
+    struct pollfd p[2] = { { .fd = inv_stop_fd, .events = POLLIN }, { .fd = fd, .events = POLLIN } };
+    int n = poll(p, fd >= 0 ? 2 : 1, timeout_ms);
+    if (readable) *readable = n > 0 && (p[1].revents & (POLLIN | POLLERR | POLLHUP));
+    return n > 0 && (p[0].revents & POLLIN);
+}
+
+static void inv_reconnected(void) {
+    pthread_mutex_lock(&inv_lock);
+    inv_stats.connected = 1;
+    inv_stats.reconnects++;
+    inv_stats.flushes++;
+    pthread_mutex_unlock(&inv_lock);
+}
+
+static void *inv_main(void *arg) {
+    (void)arg;
+    PGconn *conn = inv_conn;
+    for (;;) {
+        if (!conn) {
+            if (inv_wait(-1, INV_RETRY_MS, NULL)) break;
+            if (!(conn = inv_connect(0))) continue;
+            note_write_all();
+            /* anything committed while we weren't listening went unseen;
+             * listening again first means nothing slips in after this */
+            inv_cb(NULL, inv_arg);
+            inv_reconnected();
+        }
+        int readable;
+        if (inv_wait(PQsocket(conn), INV_PING_MS, &readable)) break;
+        int ok;
+        if (readable) {
+            ok = PQconsumeInput(conn);
+        } else {
+            /* a quiet connection may be a dead one */
+            PGresult *res = PQexec(conn, "SELECT 1");
+            ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+            PQclear(res);
+        }
+        PGnotify *n;
+        while ((n = PQnotifies(conn)) != NULL) {
+            inv_apply(n->extra);
+            PQfreemem(n);
+        }
+        if (!ok) {
+            fprintf(stderr, "db_invalidation: connection lost: %s", PQerrorMessage(conn));
+            PQfinish(conn);
+            conn = NULL;
+            pthread_mutex_lock(&inv_lock);
+            inv_stats.connected = 0;
+            pthread_mutex_unlock(&inv_lock);
+        }
+    }
+    if (conn) PQfinish(conn);
+    return NULL;
+}
+
+int db_invalidation_start(db_invalidate_fn cb, void *arg) {
+    if (inv_running || !cb) return -1;
+    inv_cb = cb;
+    inv_arg = arg;
+    memset(&inv_stats, 0, sizeof(inv_stats));
+    /* connect here, so a failure to set up shows at startup */
+    inv_conn = inv_connect(1);
+    if (!inv_conn) return -1;
+    inv_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (inv_stop_fd < 0) {
+        PQfinish(inv_conn);
+        inv_conn = NULL;
+        return -1;
+    }
+    inv_stats.connected = 1;
+    if (pthread_create(&inv_thread, NULL, inv_main, NULL) != 0) {
+        close(inv_stop_fd);
+        inv_stop_fd = -1;
+        PQfinish(inv_conn);
+        inv_conn = NULL;
+        return -1;
+    }
+    inv_running = 1;
+    return 0;
+}
+
+void db_invalidation_stop(void) {
+    if (!inv_running) return;
+    uint64_t one = 1;
+    if (write(inv_stop_fd, &one, sizeof(one)) != sizeof(one)) perror("db_invalidation: wake");
+    pthread_join(inv_thread, NULL);
+    close(inv_stop_fd);
+    inv_stop_fd = -1;
+    inv_conn = NULL;
+    inv_running = 0;
+}
+
+int db_get_invalidation_stats(db_invalidation_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    if (!inv_running) return -1;
+    pthread_mutex_lock(&inv_lock);
+    *st = inv_stats;
+    pthread_mutex_unlock(&inv_lock);
+    return 0;
+}
+
+/* ---- read replicas ----
+ *
+ * Each replica gets a few connections of its own, used the sync way
+ * whatever the primary's mode. db_get tries the replicas round robin and
+ * runs on the first idle connection of a healthy one; when every replica
+ * is down, lagging or busy, or the read fails, it goes to the primary as
+ * before. A monitor thread measures each replica's replay lag every
+ * REPLICA_CHECK_MS, keeps replicas past the limit (or that it can't
+ * reach) out of rotation, and resets broken connections itself, so no
+ * request ever waits on a dead host.
+ *
+ * A replica may be up to the limit behind, so a key written within the
+ * last limit + one check interval, here or (with invalidation on) by
+ * another server, is read from the primary; otherwise a miss right after
+ * a write could bring the old value back into the cache. Writes stamp a
+ * small table of hashed timestamps; a collision only costs a primary
+ * read. */
+
+#define REPLICA_CHECK_MS 1000
+#define RECENT_SLOTS 65536
+
+/* 0 when fully replayed, -1 when the lag can't be told (e.g. not
+ * streaming). An idle primary sends nothing to replay, so a replica that
+ * has replayed everything it received is current; a server that isn't in
+ * recovery at all counts as current too. */
+static const char replica_lag_sql[] =
+    "SELECT CASE "
+    "WHEN NOT pg_is_in_recovery() THEN 0 "
+    "WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() "
+    "AND EXISTS (SELECT 1 FROM pg_stat_wal_receiver WHERE status = 'streaming') THEN 0 "
+    "ELSE COALESCE(ceil(extract(epoch FROM now() - pg_last_xact_replay_timestamp()) * 1000), -1) "
+    "END::bigint";
+
+typedef struct {
+    char *conninfo;
+    char label[64];        /* host:port, for stats */
+    db_slot_t *slots;
+    size_t n_slots;
+    pthread_mutex_t lock;  /* busy and broken of the slots */
+    PGconn *probe;         /* the monitor's */
+    _Atomic int healthy;
+    _Atomic int64_t lag_ms;
+    _Atomic uint64_t reads, errors;
+} replica_t;
+
+static replica_t *replicas = NULL;
+static size_t n_replicas = 0;
+static unsigned replica_max_lag_ms;
+static _Atomic size_t replica_next = 0;
+static _Atomic uint64_t primary_reads = 0, recent_reads = 0;
+static _Atomic uint32_t *recent = NULL;  /* ms stamps of writes, by key hash */
+static _Atomic uint32_t recent_all = 0;  /* when every key last counted as written */
+static pthread_t replica_thread;
+static int replica_stop_fd = -1;
+
+static uint32_t mono_ms(void) {
+    return (uint32_t)(now_ns() / 1000000);
+}
+
+static size_t recent_slot(const char *key) {
+    return (size_t)(key_hash(key) & (RECENT_SLOTS - 1));
+}
+
+static void note_write(const char *key) {
+    if (recent) atomic_store(&recent[recent_slot(key)], mono_ms());
+}
+
+static void note_write_all(void) {
+    if (recent) atomic_store(&recent_all, mono_ms());
+}
+
+static int written_recently(const char *key) {
+    uint32_t now = mono_ms(), window = replica_max_lag_ms + REPLICA_CHECK_MS;
+    return now - atomic_load(&recent_all) < window || now - atomic_load(&recent[recent_slot(key)]) < window;
+}
+
+/* a hot standby only gets the statements it can run */
+static int prepare_reads(PGconn *conn) {
+    return prepare_stmt(conn, STMT_GET) == 0 && prepare_stmt(conn, STMT_GET_MANY) == 0 ? 0 : -1;
+}
+
+/* An idle, working connection or NULL; never waits */
+static db_slot_t *replica_acquire(replica_t *r) {
+    pthread_mutex_lock(&r->lock);
+    for (size_t i = 0; i < r->n_slots; ++i) {
+        db_slot_t *slot = &r->slots[i];
+        if (slot->busy || slot->broken) continue;
+        slot->busy = 1;
+        pthread_mutex_unlock(&r->lock);
+        return slot;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static void replica_release(replica_t *r, db_slot_t *slot, int broken) {
+    pthread_mutex_lock(&r->lock);
+    slot->busy = 0;
+    slot->broken = broken;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* A read statement on a replica; NULL means ask the primary. keys are the
+ * ones it reads. */
+static PGresult *replica_read(int stmt, const char *const *params, const int *lengths, const int *formats,
+                              const char *const *keys, size_t n_keys) {
+    if (!replicas) return NULL;
+    for (size_t i = 0; i < n_keys; ++i) {
+        if (!written_recently(keys[i])) continue;
+        atomic_fetch_add(&recent_reads, 1);
+        atomic_fetch_add(&primary_reads, 1);
+        return NULL;
+    }
+    size_t start = atomic_fetch_add_explicit(&replica_next, 1, memory_order_relaxed);
+    for (size_t k = 0; k < n_replicas; ++k) {
+        replica_t *r = &replicas[(start + k) % n_replicas];
+        if (!atomic_load(&r->healthy)) continue;
+        db_slot_t *slot = replica_acquire(r);
+        if (!slot) continue;
+        PGresult *res = PQexecPrepared(slot->conn, stmts[stmt].name, stmts[stmt].n_params, params, lengths,
+                                       formats, 0);
+        if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+            replica_release(r, slot, 0);
+            atomic_fetch_add(&r->reads, 1);
+            return res;
+        }
+        /* e.g. a query cancelled by replay; a dead connection also takes
+         * the replica out until the monitor has seen it again */
+        int broken = PQstatus(slot->conn) == CONNECTION_BAD || lost_statement(res);
+        fprintf(stderr, "db: read on replica %s failed: %s", r->label, PQerrorMessage(slot->conn));
+        PQclear(res);
+        if (broken) atomic_store(&r->healthy, 0);
+        replica_release(r, slot, broken);
+        atomic_fetch_add(&r->errors, 1);
+    }
+    atomic_fetch_add(&primary_reads, 1);
+    return NULL;
+}
+
+static void replica_check(replica_t *r) {
+    if (!r->probe) r->probe = db_connect(r->conninfo);
+    else if (PQstatus(r->probe) != CONNECTION_OK) PQreset(r->probe);
+    int64_t lag = -1;
+    if (PQstatus(r->probe) == CONNECTION_OK) {
+        PGresult *res = PQexec(r->probe, replica_lag_sql);
+        if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1 && !PQgetisnull(res, 0, 0))
+            lag = atoll(PQgetvalue(res, 0, 0));
+        PQclear(res);
+    }
+    /* one slot at a time, so readers keep the others */
+    for (size_t i = 0; i < r->n_slots && lag >= 0; ++i) {
+        db_slot_t *slot = &r->slots[i];
+        pthread_mutex_lock(&r->lock);
+        int mine = slot->broken && !slot->busy;
+        if (mine) slot->busy = 1;
+        pthread_mutex_unlock(&r->lock);
+        if (!mine) continue;
+        PQreset(slot->conn);
+        int ok = PQstatus(slot->conn) == CONNECTION_OK && prepare_reads(slot->conn) == 0;
+        replica_release(r, slot, !ok);
+    }
+    int was = atomic_load(&r->healthy);
+    int now = lag >= 0 && lag <= (int64_t)replica_max_lag_ms;
+    atomic_store(&r->lag_ms, lag);
+    atomic_store(&r->healthy, now);
+    if (was != now) {
+        if (now) fprintf(stderr, "db: replica %s in rotation (lag %lld ms)\n", r->label, (long long)lag);
+        else if (lag < 0) fprintf(stderr, "db: replica %s out of rotation: lag unknown\n", r->label);
+        else fprintf(stderr, "db: replica %s out of rotation: lag %lld ms\n", r->label, (long long)lag);
+    }
+}
+
+static void *replica_main(void *arg) {
+    (void)arg;
+    struct pollfd p = { .fd = replica_stop_fd, .events = POLLIN };
+    for (;;) {
+        if (poll(&p, 1, REPLICA_CHECK_MS) > 0 && (p.revents & POLLIN)) break;
+        for (size_t i = 0; i < n_replicas; ++i) replica_check(&replicas[i]);
+    }
+    return NULL;
+}
+
+static void replica_label(replica_t *r) {
+    const char *host = NULL, *port = NULL;
+    PQconninfoOption *opts = PQconninfoParse(r->conninfo, NULL);
+    for (PQconninfoOption *o = opts; o && o->keyword; ++o) {
+        if (strcmp(o->keyword, "host") == 0 && o->val) host = o->val;
+        else if (strcmp(o->keyword, "port") == 0 && o->val) port = o->val;
+    }
+    snprintf(r->label, sizeof(r->label), "%s:%s", host ? host : "localhost", port ? port : "5432");
+    PQconninfoFree(opts);
+}
+
+static void replicas_free(void) {
+    for (size_t i = 0; i < n_replicas; ++i) {
+        replica_t *r = &replicas[i];
+        for (size_t j = 0; r->slots && j < r->n_slots; ++j)
+            if (r->slots[j].conn) PQfinish(r->slots[j].conn);
+        if (r->probe) PQfinish(r->probe);
+        pthread_mutex_destroy(&r->lock);
+        free(r->slots);
+        free(r->conninfo);
+    }
+    free(replicas);
+    replicas = NULL;
+    n_replicas = 0;
+    free((void *)recent);
+    recent = NULL;
+}
+
+int db_replicas_start(const char *const *conninfos, size_t n, int conns_each, unsigned max_lag_ms) {
+    if (replicas || n == 0 || n > DB_MAX_REPLICAS || !db_conninfo) return -1;
+    if (conns_each < 1) conns_each = 1;
+    recent = calloc(RECENT_SLOTS, sizeof(*recent));
+    replicas = calloc(n, sizeof(*replicas));
+    if (!recent || !replicas) {
+        free((void *)recent);
+        recent = NULL;
+        free(replicas);
+        replicas = NULL;
+        return -1;
+    }
+    n_replicas = n;
+    replica_max_lag_ms = max_lag_ms;
+    for (size_t i = 0; i < n; ++i) {
+        replica_t *r = &replicas[i];
+        pthread_mutex_init(&r->lock, NULL);
+        atomic_init(&r->lag_ms, -1);
+        r->conninfo = strdup(conninfos[i]);
+        r->slots = calloc((size_t)conns_each, sizeof(*r->slots));
+        if (!r->conninfo || !r->slots) goto fail;
+        r->n_slots = (size_t)conns_each;
+        replica_label(r);
+        /* a replica that is down now is picked up by the monitor later */
+        for (size_t j = 0; j < r->n_slots; ++j) {
+            r->slots[j].conn = db_connect(r->conninfo);
+            r->slots[j].broken = PQstatus(r->slots[j].conn) != CONNECTION_OK ||
+                                 prepare_reads(r->slots[j].conn) != 0;
+        }
+        replica_check(r);
+        if (!atomic_load(&r->healthy))
+            fprintf(stderr, "db: replica %s not usable yet, reading from the primary\n", r->label);
+    }
+    replica_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (replica_stop_fd < 0) goto fail;
+    if (pthread_create(&replica_thread, NULL, replica_main, NULL) != 0) {
+        close(replica_stop_fd);
+        replica_stop_fd = -1;
+        goto fail;
+    }
+    return 0;
+fail:
+    replicas_free();
+    return -1;
+}
+
+void db_replicas_stop(void) {
+    if (replica_stop_fd < 0) return;
+    uint64_t one = 1;
+    if (write(replica_stop_fd, &one, sizeof(one)) != sizeof(one)) perror("db_replicas: wake");
+    pthread_join(replica_thread, NULL);
+    close(replica_stop_fd);
+    replica_stop_fd = -1;
+    replicas_free();
+}
+
+int db_get_replica_stats(db_replica_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    if (!replicas) return -1;
+    st->n = n_replicas;
+    st->max_lag_ms = replica_max_lag_ms;
+    st->primary_reads = atomic_load(&primary_reads);
+    st->recent_write_reads = atomic_load(&recent_reads);
+    for (size_t i = 0; i < n_replicas; ++i) {
+        replica_t *r = &replicas[i];
+        memcpy(st->replicas[i].label, r->label, sizeof(r->label));
+        st->replicas[i].healthy = atomic_load(&r->healthy);
+        st->replicas[i].lag_ms = atomic_load(&r->lag_ms);
+        st->replicas[i].reads = atomic_load(&r->reads);
+        st->replicas[i].errors = atomic_load(&r->errors);
+        pthread_mutex_lock(&r->lock);
+        for (size_t j = 0; j < r->n_slots; ++j) st->replicas[i].broken += r->slots[j].broken;
+        pthread_mutex_unlock(&r->lock);
+    }
+    return 0;
 }
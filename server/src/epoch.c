@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+#include "epoch.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Process-wide thread index, handed out on first use. CivetWeb workers are
+ * long-lived so indices are never recycled. */
+static _Atomic int next_tid = 0;
+static __thread int my_tid = -1;
+
+/* Overflow readers share one counter and are not tracked per epoch */
+static __thread unsigned overflow_depth = 0;
+
+static int thread_index(void) {
+    if (my_tid < 0) my_tid = atomic_fetch_add(&next_tid, 1);
+    return my_tid;
+}
+
+int epoch_thread_id(void) {
+    return thread_index();
+}
+
+int epoch_domain_init(epoch_domain_t *d) {
+    atomic_init(&d->global, 1);
+    atomic_init(&d->overflow, 0);
+    if (posix_memalign((void **)&d->slots, 64, EPOCH_MAX_THREADS * sizeof(epoch_slot_t)) != 0)
+        return -1;
+    memset(d->slots, 0, EPOCH_MAX_THREADS * sizeof(epoch_slot_t));
+    return 0;
+}
+
+void epoch_domain_destroy(epoch_domain_t *d) {
+    free(d->slots);
+    d->slots = NULL;
+}
+
+void epoch_enter(epoch_domain_t *d) {
+    int tid = thread_index();
+    if (tid >= EPOCH_MAX_THREADS) {
+        if (overflow_depth++ == 0) atomic_fetch_add(&d->overflow, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        return;
+    }
+    epoch_slot_t *s = &d->slots[tid];
+    if (s->depth++ == 0) {
+        atomic_store_explicit(&s->active, atomic_load(&d->global), memory_order_relaxed);
+        /* announcement must be visible before we load any shared pointer */
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+void epoch_exit(epoch_domain_t *d) {
+    int tid = thread_index();
+    if (tid >= EPOCH_MAX_THREADS) {
+        if (--overflow_depth == 0) atomic_fetch_sub_explicit(&d->overflow, 1, memory_order_release);
+        return;
+    }
+    epoch_slot_t *s = &d->slots[tid];
+    if (--s->depth == 0)
+        atomic_store_explicit(&s->active, 0, memory_order_release);
+}
+
+uint64_t epoch_now(epoch_domain_t *d) {
+    return atomic_load(&d->global);
+}
+
+uint64_t epoch_safe(epoch_domain_t *d) {
+    uint64_t min = atomic_fetch_add(&d->global, 1) + 1;
+    atomic_thread_fence(memory_order_seq_cst);
+    /* untracked readers pin everything */
+    if (atomic_load_explicit(&d->overflow, memory_order_acquire) > 0) return 0;
+    int n = atomic_load_explicit(&next_tid, memory_order_relaxed);
+    if (n > EPOCH_MAX_THREADS) n = EPOCH_MAX_THREADS;
+    for (int i = 0; i < n; ++i) {
+        uint64_t e = atomic_load_explicit(&d->slots[i].active, memory_order_acquire);
+        if (e != 0 && e < min) min = e;
+    }
+    return min;
+}
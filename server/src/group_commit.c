@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include "group_commit.h"
+#include "storage.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_FLUSHERS 16
+
+/* Lives on the waiting handler's stack */
+typedef struct op {
+    struct op *next;
+    const char *key;
+    const char *value;  /* NULL = delete */
+    long ttl;
+    int rc;
+    int done;
+    pthread_cond_t cond;
+} op_t;
+
+/* Per-flusher scratch, sized for max_batch */
+typedef struct {
+    pthread_t thread;
+    op_t **batch;
+    const char **put_keys, **put_values, **del_keys;
+    long *put_ttls;
+    int *deleted;
+    op_t **del_ops;
+    const char **seen;  /* keys in the batch, open addressing */
+    size_t seen_mask;
+    int busy;           /* batch taken and not yet committed; guarded by lock */
+} flusher_t;
+
+/* Everything below is guarded by lock */
+static op_t *head, *tail;
+static size_t n_pending;
+static int running = 0;
+static size_t max_batch;
+static unsigned window_us;
+static size_t n_batches, n_ops, largest, n_fallbacks, n_lost;
+static uint64_t flush_ns;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+static flusher_t flushers[MAX_FLUSHERS];
+static int n_flushers;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* FNV-1a */
+static uint64_t key_hash(const char *key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *key; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Caller holds lock. Whether another flusher is committing a write to key. */
+static int in_flight(const flusher_t *f, const char *key) {
+    /* all slots, not n_flushers: that is still counting up while the
+     * first flushers run; unused ones are never busy */
+    for (int j = 0; j < MAX_FLUSHERS; ++j) {
+        const flusher_t *o = &flushers[j];
+        if (o == f || !o->busy) continue;
+        for (size_t i = key_hash(key) & o->seen_mask; o->seen[i]; i = (i + 1) & o->seen_mask)
+            if (strcmp(o->seen[i], key) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Returns 0 if key was already in the set, 1 if it was added */
+static int seen_add(flusher_t *f, const char *key) {
+    for (size_t i = key_hash(key) & f->seen_mask;; i = (i + 1) & f->seen_mask) {
+        if (!f->seen[i]) {
+            f->seen[i] = key;
+            return 1;
+        }
+        if (strcmp(f->seen[i], key) == 0) return 0;
+    }
+}
+
+/* Caller holds lock. Unlinks up to max_batch ops from the head of the
+ * queue, stopping short of the first key that is repeated or still in
+ * another flusher's batch; 0 if the head itself has to wait. */
+static size_t take_batch(flusher_t *f) {
+    memset(f->seen, 0, (f->seen_mask + 1) * sizeof(*f->seen));
+    size_t n = 0;
+    while (head && n < max_batch && !in_flight(f, head->key) && seen_add(f, head->key)) {
+        f->batch[n++] = head;
+        head = head->next;
+    }
+    if (!head) tail = NULL;
+    n_pending -= n;
+    f->busy = n > 0;
+    return n;
+}
+
+/* Runs without the lock; fills in each op's rc */
+static void flush_batch(flusher_t *f, size_t n) {
+    size_t n_put = 0, n_del = 0;
+    for (size_t i = 0; i < n; ++i) {
+        op_t *op = f->batch[i];
+        if (op->value) {
+            f->put_keys[n_put] = op->key;
+            f->put_values[n_put] = op->value;
+            f->put_ttls[n_put++] = op->ttl;
+        } else {
+            f->del_ops[n_del] = op;
+            f->del_keys[n_del++] = op->key;
+        }
+    }
+    uint64_t t0 = now_ns();
+    int rc = storage_write_batch(n_put, f->put_keys, f->put_values, f->put_ttls,
+                                 n_del, f->del_keys, f->deleted);
+    uint64_t spent = now_ns() - t0;
+    if (rc == 0) {
+        for (size_t i = 0; i < n; ++i)
+            if (f->batch[i]->value) f->batch[i]->rc = 0;
+        for (size_t i = 0; i < n_del; ++i) f->del_ops[i]->rc = f->deleted[i] ? 0 : -1;
+    } else if (rc == -2) {
+        /* it may have committed: running the deletes again would find
+         * their rows gone and report them missing, so fail them all */
+        for (size_t i = 0; i < n; ++i) f->batch[i]->rc = -1;
+    } else {
+        for (size_t i = 0; i < n; ++i) {
+            op_t *op = f->batch[i];
+            op->rc = op->value ? storage_put(op->key, op->value, op->ttl) : storage_delete(op->key);
+        }
+    }
+    pthread_mutex_lock(&lock);
+    n_batches++;
+    n_ops += n;
+    if (n > largest) largest = n;
+    flush_ns += spent;
+    if (rc == -2) n_lost++;
+    else if (rc != 0) n_fallbacks++;
+    /* the keys live on the waiters' stacks: stop looking at them first */
+    f->busy = 0;
+    for (size_t i = 0; i < n; ++i) {
+        f->batch[i]->done = 1;
+        pthread_cond_signal(&f->batch[i]->cond);
+    }
+    /* a flusher may be waiting for one of these keys */
+    if (head) pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static void *flusher_main(void *arg) {
+    flusher_t *f = arg;
+    pthread_mutex_lock(&lock);
+    while (running || head) {
+        if (!head) {
+            pthread_cond_wait(&work_cond, &lock);
+            continue;
+        }
+        if (n_pending < max_batch && window_us && running) {
+            /* give concurrent writers a moment to join the batch */
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += (long)window_us * 1000;
+            ts.tv_sec += ts.tv_nsec / 1000000000;
+            ts.tv_nsec %= 1000000000;
+            while (head && n_pending < max_batch && running)
+                if (pthread_cond_timedwait(&work_cond, &lock, &ts) == ETIMEDOUT) break;
+            if (!head) continue; /* another flusher took it */
+        }
+        size_t n = take_batch(f);
+        if (n == 0) {
+            /* the head's key is being committed elsewhere; its flusher
+             * wakes us when done */
+            pthread_cond_wait(&work_cond, &lock);
+            continue;
+        }
+        /* more than one batch's worth queued: let another flusher start */
+        if (head) pthread_cond_signal(&work_cond);
+        pthread_mutex_unlock(&lock);
+        flush_batch(f, n);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void flusher_free(flusher_t *f) {
+    free(f->batch);
+    free(f->put_keys);
+    free(f->put_values);
+    free(f->del_keys);
+    free(f->put_ttls);
+    free(f->deleted);
+    free(f->del_ops);
+    free(f->seen);
+    memset(f, 0, sizeof(*f));
+}
+
+static int flusher_alloc(flusher_t *f, size_t batch) {
+    size_t slots = 1;
+    while (slots < 2 * batch) slots *= 2;
+    f->batch = malloc(batch * sizeof(*f->batch));
+    f->put_keys = malloc(batch * sizeof(*f->put_keys));
+    f->put_values = malloc(batch * sizeof(*f->put_values));
+    f->del_keys = malloc(batch * sizeof(*f->del_keys));
+    f->put_ttls = malloc(batch * sizeof(*f->put_ttls));
+    f->deleted = malloc(batch * sizeof(*f->deleted));
+    f->del_ops = malloc(batch * sizeof(*f->del_ops));
+    f->seen = malloc(slots * sizeof(*f->seen));
+    f->seen_mask = slots - 1;
+    if (!f->batch || !f->put_keys || !f->put_values || !f->del_keys || !f->put_ttls ||
+        !f->deleted || !f->del_ops || !f->seen) {
+        flusher_free(f);
+        return -1;
+    }
+    return 0;
+}
+
+int group_commit_start(size_t batch, unsigned window, int n) {
+    /* a backend without batch writes has nothing to combine */
+    if (batch == 0 || !storage_backend() || !storage_backend()->write_batch) return 0;
+    if (n < 1) n = 1;
+    if (n > MAX_FLUSHERS) n = MAX_FLUSHERS;
+    max_batch = batch;
+    window_us = window;
+    n_batches = n_ops = largest = n_fallbacks = n_lost = 0;
+    flush_ns = 0;
+    for (int i = 0; i < n; ++i) {
+        if (flusher_alloc(&flushers[i], batch) != 0) {
+            while (i-- > 0) flusher_free(&flushers[i]);
+            return -1;
+        }
+    }
+    running = 1;
+    for (n_flushers = 0; n_flushers < n; ++n_flushers) {
+        if (pthread_create(&flushers[n_flushers].thread, NULL, flusher_main,
+                           &flushers[n_flushers]) != 0) {
+            fprintf(stderr, "group commit: started %d of %d flushers\n", n_flushers, n);
+            if (n_flushers == 0) {
+                running = 0;
+                for (int i = 0; i < n; ++i) flusher_free(&flushers[i]);
+                return -1;
+            }
+            for (int i = n_flushers; i < n; ++i) flusher_free(&flushers[i]);
+            break;
+        }
+    }
+    return 0;
+}
+
+void group_commit_stop(void) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < n_flushers; ++i) {
+        pthread_join(flushers[i].thread, NULL);
+        flusher_free(&flushers[i]);
+    }
+    n_flushers = 0;
+}
+
+/* Queues op and waits for its batch to commit; -2 if not running */
+static int submit(op_t *op) {
+    op->next = NULL;
+    op->done = 0;
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return -2;
+    }
+    pthread_cond_init(&op->cond, NULL);
+    if (tail) tail->next = op;
+    else head = op;
+    tail = op;
+    n_pending++;
+    pthread_cond_signal(&work_cond);
+    while (!op->done) pthread_cond_wait(&op->cond, &lock);
+    pthread_mutex_unlock(&lock);
+    pthread_cond_destroy(&op->cond);
+    return op->rc;
+}
+
+int group_commit_put(const char *key, const char *value, long ttl_sec) {
+    op_t op = { .key = key, .value = value, .ttl = ttl_sec };
+    int rc = submit(&op);
+    return rc == -2 ? storage_put(key, value, ttl_sec) : rc;
+}
+
+int group_commit_delete(const char *key) {
+    op_t op = { .key = key };
+    int rc = submit(&op);
+    return rc == -2 ? storage_delete(key) : rc;
+}
+
+int group_commit_get_stats(group_commit_stats_t *st) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    st->max_batch = max_batch;
+    st->window_us = window_us;
+    st->batches = n_batches;
+    st->ops = n_ops;
+    st->largest = largest;
+    st->flush_ns = flush_ns;
+    st->fallbacks = n_fallbacks;
+    st->lost = n_lost;
+    st->pending = n_pending;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include "hash_index.h"
+#include <stdlib.h>
+#include <string.h>
+/* ThreadSanitizer can't see through the vector load, use the scalar path */
+#if defined(__SSE2__) && !defined(__SANITIZE_THREAD__)
+#define HIDX_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+/* groups moved from the old table per write while a resize is in flight */
+#define MIGRATE_GROUPS 4
+
+#define H1(h) ((h) >> 7)
+#define H2(h) ((uint8_t)((h) & 0x7f))
+
+static inline int ctrl_full(uint8_t c) { return (c & 0x80) == 0; }
+
+/* Bitmask of the slots in a group whose control byte equals b */
+static inline uint32_t match_byte(const hidx_group_t *g, uint8_t b) {
+#ifdef HIDX_SSE2
+    __m128i ctrl = _mm_load_si128((const __m128i *)(const void *)g->ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#else
+    uint32_t m = 0;
+    for (int i = 0; i < HIDX_GROUP; ++i)
+        if (atomic_load_explicit(&g->ctrl[i], memory_order_relaxed) == b) m |= 1u << i;
+    return m;
+#endif
+}
+
+static hidx_table_t *table_new(size_t n_groups) {
+    hidx_table_t *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    t->n_groups = n_groups;
+    if (posix_memalign((void **)&t->groups, 64, n_groups * sizeof(hidx_group_t)) != 0) {
+        free(t);
+        return NULL;
+    }
+    for (size_t i = 0; i < n_groups; ++i) {
+        memset((void *)t->groups[i].ctrl, CTRL_EMPTY, HIDX_GROUP);
+        memset((void *)t->groups[i].slots, 0, sizeof(t->groups[i].slots));
+    }
+    return t;
+}
+
+static void table_free(hidx_table_t *t) {
+    if (!t) return;
+    free(t->groups);
+    free(t);
+}
+
+static size_t table_capacity(const hidx_table_t *t) {
+    return t->n_groups * HIDX_GROUP;
+}
+
+/* Keep the load (including tombstones) at or below 7/8 */
+static int table_has_room(const hidx_table_t *t) {
+    return (t->used + 1) * 8 <= table_capacity(t) * 7;
+}
+
+static void *table_find(const hash_index_t *idx, const hidx_table_t *t, uint64_t hash, const void *key) {
+    size_t mask = t->n_groups - 1, gi = H1(hash) & mask;
+    uint8_t h2 = H2(hash);
+    for (size_t i = 0; i < t->n_groups; ++i) {
+        const hidx_group_t *g = &t->groups[gi];
+        /* pull the slot lines in parallel with the control bytes */
+        __builtin_prefetch((const char *)g + 64);
+        __builtin_prefetch((const char *)g + 128);
+        uint32_t m = match_byte(g, h2);
+        while (m) {
+            int b = __builtin_ctz(m);
+            m &= m - 1;
+            void *e = atomic_load_explicit(&g->slots[b], memory_order_acquire);
+            if (e && idx->eq(e, hash, key)) return e;
+        }
+        if (match_byte(g, CTRL_EMPTY)) return NULL;
+        gi = (gi + i + 1) & mask; /* triangular probing visits every group */
+    }
+    return NULL;
+}
+
+/* Writer side: group/slot holding exactly this entry */
+static hidx_group_t *table_find_entry(const hidx_table_t *t, uint64_t hash, const void *entry, int *slot) {
+    size_t mask = t->n_groups - 1, gi = H1(hash) & mask;
+    uint8_t h2 = H2(hash);
+    for (size_t i = 0; i < t->n_groups; ++i) {
+        hidx_group_t *g = &t->groups[gi];
+        uint32_t m = match_byte(g, h2);
+        while (m) {
+            int b = __builtin_ctz(m);
+            m &= m - 1;
+            if (atomic_load_explicit(&g->slots[b], memory_order_relaxed) == entry) {
+                *slot = b;
+                return g;
+            }
+        }
+        if (match_byte(g, CTRL_EMPTY)) return NULL;
+        gi = (gi + i + 1) & mask;
+    }
+    return NULL;
+}
+
+static int table_insert(hidx_table_t *t, uint64_t hash, void *entry) {
+    size_t mask = t->n_groups - 1, gi = H1(hash) & mask;
+    for (size_t i = 0; i < t->n_groups; ++i) {
+        hidx_group_t *g = &t->groups[gi];
+        uint32_t m = match_byte(g, CTRL_EMPTY) | match_byte(g, CTRL_DELETED);
+        if (m) {
+            int b = __builtin_ctz(m);
+            if (atomic_load_explicit(&g->ctrl[b], memory_order_relaxed) == CTRL_EMPTY) t->used++;
+            t->live++;
+            /* publish: entry before the control byte */
+            atomic_store_explicit(&g->slots[b], entry, memory_order_release);
+            atomic_store_explicit(&g->ctrl[b], H2(hash), memory_order_release);
+            return 0;
+        }
+        gi = (gi + i + 1) & mask;
+    }
+    return -1;
+}
+
+static void table_remove_at(hidx_table_t *t, hidx_group_t *g, int b) {
+    /* A group that still has an EMPTY slot never overflowed, so no probe
+     * sequence runs through it and the slot can go back to EMPTY. */
+    if (match_byte(g, CTRL_EMPTY)) {
+        atomic_store_explicit(&g->ctrl[b], CTRL_EMPTY, memory_order_release);
+        t->used--;
+    } else {
+        atomic_store_explicit(&g->ctrl[b], CTRL_DELETED, memory_order_release);
+    }
+    atomic_store_explicit(&g->slots[b], NULL, memory_order_release);
+    t->live--;
+}
+
+static void reclaim_tables(hash_index_t *idx) {
+    if (!idx->retired) return;
+    uint64_t safe = epoch_safe(idx->epoch);
+    hidx_table_t **pp = &idx->retired;
+    while (*pp) {
+        hidx_table_t *t = *pp;
+        if (t->retired_at < safe) {
+            *pp = t->rnext;
+            table_free(t);
+        } else {
+            pp = &t->rnext;
+        }
+    }
+}
+
+static void migrate_step(hash_index_t *idx, size_t max_groups) {
+    hidx_table_t *old = atomic_load_explicit(&idx->old, memory_order_relaxed);
+    if (!old) return;
+    hidx_table_t *cur = atomic_load_explicit(&idx->cur, memory_order_relaxed);
+    for (size_t k = 0; k < max_groups && idx->migrate_pos < old->n_groups; ++k, ++idx->migrate_pos) {
+        hidx_group_t *g = &old->groups[idx->migrate_pos];
+        for (int b = 0; b < HIDX_GROUP; ++b) {
+            if (!ctrl_full(atomic_load_explicit(&g->ctrl[b], memory_order_relaxed))) continue;
+            void *e = atomic_load_explicit(&g->slots[b], memory_order_relaxed);
+            /* insert into the new table before dropping from the old one, so
+             * a reader checking old then new always sees the entry */
+            table_insert(cur, idx->hash_of(e), e);
+            table_remove_at(old, g, b);
+        }
+    }
+    if (idx->migrate_pos == old->n_groups) {
+        atomic_store_explicit(&idx->old, NULL, memory_order_release);
+        old->retired_at = epoch_now(idx->epoch);
+        old->rnext = idx->retired;
+        idx->retired = old;
+    }
+}
+
+static int start_resize(hash_index_t *idx) {
+    hidx_table_t *cur = atomic_load_explicit(&idx->cur, memory_order_relaxed);
+    /* double when genuinely full, otherwise just rebuild to drop tombstones */
+    size_t groups = cur->n_groups;
+    if (cur->live * 16 >= table_capacity(cur) * 7) groups *= 2;
+    hidx_table_t *t = table_new(groups);
+    if (!t) return -1;
+    idx->migrate_pos = 0;
+    /* readers load cur then old, so old must be visible first */
+    atomic_store_explicit(&idx->old, cur, memory_order_release);
+    atomic_store_explicit(&idx->cur, t, memory_order_release);
+    return 0;
+}
+
+int hidx_init(hash_index_t *idx, size_t capacity_hint, hidx_eq_fn eq, hidx_hash_fn hash_of,
+              epoch_domain_t *epoch) {
+    memset(idx, 0, sizeof(*idx));
+    idx->eq = eq;
+    idx->hash_of = hash_of;
+    idx->epoch = epoch;
+    size_t groups = 1;
+    while (groups * HIDX_GROUP * 7 < capacity_hint * 8) groups *= 2;
+    hidx_table_t *t = table_new(groups);
+    if (!t) return -1;
+    atomic_init(&idx->cur, t);
+    atomic_init(&idx->old, NULL);
+    return 0;
+}
+
+void hidx_destroy(hash_index_t *idx) {
+    table_free(atomic_load(&idx->cur));
+    table_free(atomic_load(&idx->old));
+    hidx_table_t *t = idx->retired;
+    while (t) {
+        hidx_table_t *nx = t->rnext;
+        table_free(t);
+        t = nx;
+    }
+    idx->retired = NULL;
+}
+
+void *hidx_find(hash_index_t *idx, uint64_t hash, const void *key) {
+    hidx_table_t *cur = atomic_load_explicit(&idx->cur, memory_order_acquire);
+    hidx_table_t *old = atomic_load_explicit(&idx->old, memory_order_acquire);
+    if (old && old != cur) {
+        void *e = table_find(idx, old, hash, key);
+        if (e) return e;
+    }
+    return table_find(idx, cur, hash, key);
+}
+
+int hidx_insert(hash_index_t *idx, uint64_t hash, void *entry) {
+    reclaim_tables(idx);
+    migrate_step(idx, MIGRATE_GROUPS);
+    hidx_table_t *cur = atomic_load_explicit(&idx->cur, memory_order_relaxed);
+    if (!table_has_room(cur)) {
+        /* finish any resize still draining before starting the next one */
+        while (atomic_load_explicit(&idx->old, memory_order_relaxed))
+            migrate_step(idx, SIZE_MAX);
+        if (start_resize(idx) != 0) return -1;
+        migrate_step(idx, MIGRATE_GROUPS);
+        cur = atomic_load_explicit(&idx->cur, memory_order_relaxed);
+    }
+    return table_insert(cur, hash, entry);
+}
+
+int hidx_replace(hash_index_t *idx, uint64_t hash, void *old_entry, void *new_entry) {
+    hidx_table_t *tabs[2] = {
+        atomic_load_explicit(&idx->old, memory_order_relaxed),
+        atomic_load_explicit(&idx->cur, memory_order_relaxed)
+    };
+    for (int i = 0; i < 2; ++i) {
+        if (!tabs[i]) continue;
+        int b;
+        hidx_group_t *g = table_find_entry(tabs[i], hash, old_entry, &b);
+        if (g) {
+            atomic_store_explicit(&g->slots[b], new_entry, memory_order_release);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int hidx_remove(hash_index_t *idx, uint64_t hash, void *entry) {
+    hidx_table_t *tabs[2] = {
+        atomic_load_explicit(&idx->old, memory_order_relaxed),
+        atomic_load_explicit(&idx->cur, memory_order_relaxed)
+    };
+    int rc = -1;
+    for (int i = 0; i < 2; ++i) {
+        if (!tabs[i]) continue;
+        int b;
+        hidx_group_t *g = table_find_entry(tabs[i], hash, entry, &b);
+        if (g) {
+            table_remove_at(tabs[i], g, b);
+            rc = 0;
+            break;
+        }
+    }
+    migrate_step(idx, MIGRATE_GROUPS);
+    return rc;
+}
+
+size_t hidx_size(hash_index_t *idx) {
+    hidx_table_t *cur = atomic_load_explicit(&idx->cur, memory_order_relaxed);
+    hidx_table_t *old = atomic_load_explicit(&idx->old, memory_order_relaxed);
+    return cur->live + (old ? old->live : 0);
+}
+
+size_t hidx_memory(hash_index_t *idx) {
+    hidx_table_t *cur = atomic_load_explicit(&idx->cur, memory_order_relaxed);
+    hidx_table_t *old = atomic_load_explicit(&idx->old, memory_order_relaxed);
+    return (cur->n_groups + (old ? old->n_groups : 0)) * sizeof(hidx_group_t);
+}
@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include "hotkeys.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define WINDOW_SEC 1
+/* weight of the newest window in a key's rate */
+#define RATE_ALPHA 0.5
+/* counts lose 1/DECAY_DIV per window (half-life ~5 windows) */
+#define DECAY_DIV 8
+
+typedef struct {
+    char key[HOTKEYS_KEY_MAX];
+    uint64_t hash;
+    uint64_t count, error;       /* in samples */
+    uint32_t win[HOTKEY_OPS];    /* samples this window */
+    double rate[HOTKEY_OPS];     /* requests/sec */
+    size_t heap_pos;
+} counter_t;
+
+/* Everything below is guarded by lock */
+static counter_t *counters;
+static size_t *heap;       /* min-heap of counter indices by count */
+static uint32_t *table;    /* key -> counter index + 1, linear probing */
+static size_t table_mask;
+static size_t n_counters, k_max;
+static struct timespec window_start;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic int running = 0;
+static unsigned sample_mask;
+static double hot_threshold;
+static hotkeys_hot_fn hot_fn;
+static void *hot_arg;
+static __thread uint32_t sample_rng; /* xorshift, per thread */
+
+static pthread_t roller;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static int stop_requested = 0;
+
+/* FNV-1a */
+static uint64_t key_hash(const char *key, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static double total_rate(const counter_t *c) {
+    double r = 0;
+    for (int op = 0; op < HOTKEY_OPS; ++op) r += c->rate[op];
+    return r;
+}
+
+/* ---- min-heap on count ---- */
+
+static void heap_swap(size_t a, size_t b) {
+    size_t t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    counters[heap[a]].heap_pos = a;
+    counters[heap[b]].heap_pos = b;
+}
+
+static void heap_down(size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n_counters && counters[heap[l]].count < counters[heap[m]].count) m = l;
+        if (r < n_counters && counters[heap[r]].count < counters[heap[m]].count) m = r;
+        if (m == i) return;
+        heap_swap(i, m);
+        i = m;
+    }
+}
+
+static void heap_up(size_t i) {
+    while (i > 0) {
+        size_t p = (i - 1) / 2;
+        if (counters[heap[p]].count <= counters[heap[i]].count) return;
+        heap_swap(i, p);
+        i = p;
+    }
+}
+
+/* ---- key table ---- */
+
+static size_t table_find(uint64_t h, const char *key) {
+    for (size_t i = h & table_mask;; i = (i + 1) & table_mask) {
+        uint32_t e = table[i];
+        if (!e) return SIZE_MAX;
+        const counter_t *c = &counters[e - 1];
+        if (c->hash == h && strcmp(c->key, key) == 0) return e - 1;
+    }
+}
+
+static void table_insert(size_t idx) {
+    size_t i = counters[idx].hash & table_mask;
+    while (table[i]) i = (i + 1) & table_mask;
+    table[i] = (uint32_t)idx + 1;
+}
+
+/* Backward-shift delete keeps probe runs intact without tombstones */
+static void table_remove(size_t idx) {
+    size_t i = counters[idx].hash & table_mask;
+    while (table[i] != idx + 1) i = (i + 1) & table_mask;
+    for (size_t j = i;;) {
+        table[i] = 0;
+        for (;;) {
+            j = (j + 1) & table_mask;
+            if (!table[j]) return;
+            size_t home = counters[table[j] - 1].hash & table_mask;
+            /* move j back into the hole unless its home lies in (i, j] */
+            if (((j - home) & table_mask) >= ((j - i) & table_mask)) break;
+        }
+        table[i] = table[j];
+        i = j;
+    }
+}
+
+/* Caller holds lock */
+static void record_locked(const char *key, size_t len, uint64_t h, hotkey_op_t op) {
+    size_t idx = table_find(h, key);
+    if (idx == SIZE_MAX) {
+        if (n_counters < k_max) {
+            idx = n_counters++;
+            counters[idx].heap_pos = idx;
+            heap[idx] = idx;
+            counters[idx].count = 0;
+        } else {
+            /* Space-Saving: take over the smallest counter */
+            idx = heap[0];
+            table_remove(idx);
+        }
+        counter_t *c = &counters[idx];
+        uint64_t inherited = c->count;
+        memset(c->win, 0, sizeof(c->win));
+        memset(c->rate, 0, sizeof(c->rate));
+        memcpy(c->key, key, len + 1);
+        c->hash = h;
+        c->error = inherited;
+        c->count = inherited;
+        table_insert(idx);
+    }
+    counter_t *c = &counters[idx];
+    c->count++;
+    c->win[op]++;
+    /* a newcomer at the bottom may undercut its parent; a grown count
+     * only ever needs to sink */
+    heap_up(c->heap_pos);
+    heap_down(c->heap_pos);
+}
+
+void hotkeys_record(const char *key, hotkey_op_t op) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) return;
+    /* random rather than every n-th request, which would alias with any
+     * request pattern that repeats with the same period */
+    uint32_t x = sample_rng;
+    if (!x) x = (uint32_t)(uintptr_t)&sample_rng | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sample_rng = x;
+    if ((x & sample_mask) != 0) return;
+    size_t len = strlen(key);
+    if (len >= HOTKEYS_KEY_MAX) return;
+    uint64_t h = key_hash(key, len);
+    /* a busy tracker costs us one sample, not a wait */
+    if (pthread_mutex_trylock(&lock) != 0) return;
+    if (counters) record_locked(key, len, h, op);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Close the window: fold hits into rates and decay counts. Returns the
+ * keys at or above the hot threshold (caller frees), count in *n_hot. */
+static char (*roll_window(size_t *n_hot))[HOTKEYS_KEY_MAX] {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char (*hot)[HOTKEYS_KEY_MAX] = NULL;
+    *n_hot = 0;
+    pthread_mutex_lock(&lock);
+    double secs = (double)(now.tv_sec - window_start.tv_sec) +
+                  (double)(now.tv_nsec - window_start.tv_nsec) / 1e9;
+    window_start = now;
+    if (secs <= 0) secs = WINDOW_SEC;
+    double scale = (double)(sample_mask + 1) / secs;
+    for (size_t i = 0; i < n_counters; ++i) {
+        counter_t *c = &counters[i];
+        for (int op = 0; op < HOTKEY_OPS; ++op) {
+            c->rate[op] = (1 - RATE_ALPHA) * c->rate[op] + RATE_ALPHA * c->win[op] * scale;
+            c->win[op] = 0;
+        }
+        /* the same shrink for every count keeps the heap ordered */
+        c->count -= c->count / DECAY_DIV;
+        c->error -= c->error / DECAY_DIV;
+    }
+    if (hot_fn && hot_threshold > 0) {
+        for (size_t i = 0; i < n_counters; ++i) {
+            if (total_rate(&counters[i]) < hot_threshold) continue;
+            if (!hot) hot = malloc(n_counters * sizeof(*hot));
+            if (!hot) break;
+            memcpy(hot[(*n_hot)++], counters[i].key, HOTKEYS_KEY_MAX);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return hot;
+}
+
+static void *roller_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&stop_lock);
+    while (!stop_requested) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += WINDOW_SEC;
+        pthread_cond_timedwait(&stop_cond, &stop_lock, &ts);
+        if (stop_requested) break;
+        pthread_mutex_unlock(&stop_lock);
+        size_t n_hot;
+        char (*hot)[HOTKEYS_KEY_MAX] = roll_window(&n_hot);
+        /* outside the lock: on_hot may take cache locks of its own */
+        for (size_t i = 0; i < n_hot; ++i) hot_fn(hot[i], hot_arg);
+        free(hot);
+        pthread_mutex_lock(&stop_lock);
+    }
+    pthread_mutex_unlock(&stop_lock);
+    return NULL;
+}
+
+int hotkeys_start(size_t k, unsigned sample, double hot_rps, hotkeys_hot_fn on_hot, void *arg) {
+    if (k == 0 || k > UINT32_MAX / 4) return -1;
+    size_t slots = 1;
+    while (slots < 2 * k) slots *= 2;
+    counters = calloc(k, sizeof(*counters));
+    heap = calloc(k, sizeof(*heap));
+    table = calloc(slots, sizeof(*table));
+    if (!counters || !heap || !table) {
+        free(counters);
+        free(heap);
+        free(table);
+        counters = NULL;
+        heap = NULL;
+        table = NULL;
+        return -1;
+    }
+    table_mask = slots - 1;
+    k_max = k;
+    n_counters = 0;
+    unsigned s = 1;
+    while (s < sample) s *= 2;
+    sample_mask = s - 1;
+    hot_threshold = hot_rps;
+    hot_fn = on_hot;
+    hot_arg = arg;
+    clock_gettime(CLOCK_MONOTONIC, &window_start);
+    stop_requested = 0;
+    atomic_store(&running, 1);
+    if (pthread_create(&roller, NULL, roller_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void hotkeys_stop(void) {
+    if (!atomic_load(&running)) return;
+    atomic_store(&running, 0);
+    pthread_mutex_lock(&stop_lock);
+    stop_requested = 1;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&stop_lock);
+    pthread_join(roller, NULL);
+    pthread_mutex_lock(&lock);
+    free(counters);
+    free(heap);
+    free(table);
+    counters = NULL;
+    heap = NULL;
+    table = NULL;
+    n_counters = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+static int by_rate_desc(const void *a, const void *b) {
+    const hotkey_t *x = a, *y = b;
+    if (x->rate != y->rate) return x->rate < y->rate ? 1 : -1;
+    return x->count < y->count ? 1 : (x->count > y->count ? -1 : 0);
+}
+
+size_t hotkeys_top(hotkey_t *out, size_t n) {
+    if (!atomic_load(&running) || n == 0) return 0;
+    pthread_mutex_lock(&lock);
+    size_t have = n_counters;
+    hotkey_t *all = malloc((have ? have : 1) * sizeof(*all));
+    if (!all) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    uint64_t scale = (uint64_t)sample_mask + 1;
+    for (size_t i = 0; i < have; ++i) {
+        const counter_t *c = &counters[i];
+        hotkey_t *h = &all[i];
+        memcpy(h->key, c->key, sizeof(h->key));
+        memcpy(h->op_rate, c->rate, sizeof(h->op_rate));
+        h->rate = total_rate(c);
+        h->count = c->count * scale;
+        h->error = c->error * scale;
+        h->hot = hot_threshold > 0 && h->rate >= hot_threshold;
+    }
+    pthread_mutex_unlock(&lock);
+    qsort(all, have, sizeof(*all), by_rate_desc);
+    if (n > have) n = have;
+    memcpy(out, all, n * sizeof(*out));
+    free(all);
+    return n;
+}
+
+int hotkeys_get_config(size_t *k, unsigned *sample, double *hot_rps) {
+    if (!atomic_load(&running)) return -1;
+    *k = k_max;
+    *sample = sample_mask + 1;
+    *hot_rps = hot_threshold;
+    return 0;
+}
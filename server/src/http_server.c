@@ -1,14 +1,25 @@
 #define _GNU_SOURCE
 #include "http_server.h"
 #include "db.h"
+#include "logstore.h"
+#include "singleflight.h"
+#include "key_filter.h"
+#include "hotkeys.h"
+#include "group_commit.h"
+#include "writeback.h"
 #include <civetweb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <jansson.h>
 #include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
 
 static lru_cache_t *global_cache = NULL;
+/* coalesces concurrent DB reads for the same missing key */
+static singleflight_t *global_flights = NULL;
 
 /* mg = Mongoose Group (CivetWeb is a fork of Mongoose) */
 /* Represents a running server instance */
@@ -25,6 +36,28 @@ static char *read_body(struct mg_connection *conn, size_t len) {
     return buf;
 }
 
+/* Cache hit response straight from the pinned value. Small responses are
+ * assembled on the stack so they still leave in one send; larger values
+ * are written from cache memory without a copy. */
+static void write_cached(struct mg_connection *conn, const lru_value_t *v) {
+    static const char hdr[] =
+        "HTTP/1.1 200 OK\r\n"
+        "X-Source: CACHE\r\n"
+        "Content-Type: text/plain\r\n\r\nCACHE:";
+    size_t hlen = sizeof(hdr) - 1, vlen = lru_value_len(v);
+    char buf[4096];
+    if (hlen + vlen + 1 <= sizeof(buf)) {
+        memcpy(buf, hdr, hlen);
+        memcpy(buf + hlen, lru_value_data(v), vlen);
+        buf[hlen + vlen] = '\n';
+        mg_write(conn, buf, hlen + vlen + 1);
+        return;
+    }
+    mg_write(conn, hdr, hlen);
+    mg_write(conn, lru_value_data(v), vlen);
+    mg_write(conn, "\n", 1);
+}
+
 /* POST /kv  JSON body {"key":"k","value":"v"} */
 static int post_kv_handler(struct mg_connection *conn, void *cbdata) {
     const struct mg_request_info *req_info = mg_get_request_info(conn);
@@ -50,6 +83,7 @@ static int post_kv_handler(struct mg_connection *conn, void *cbdata) {
 
     json_t *jkey = json_object_get(root, "key");
     json_t *jval = json_object_get(root, "value");
+    json_t *jttl = json_object_get(root, "ttl"); /* optional, seconds */
     if (!json_is_string(jkey) || !json_is_string(jval)) {
         json_decref(root);
         mg_printf(conn,
@@ -61,8 +95,22 @@ static int post_kv_handler(struct mg_connection *conn, void *cbdata) {
 
     const char *key = json_string_value(jkey);
     const char *val = json_string_value(jval);
+    if (jttl && (!json_is_integer(jttl) || json_integer_value(jttl) <= 0 ||
+                 json_integer_value(jttl) > UINT32_MAX / 2)) {
+        json_decref(root);
+        mg_printf(conn,
+                  "HTTP/1.1 400 Bad Request\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "ttl must be a positive number of seconds\n");
+        return 1;
+    }
+    long ttl = jttl ? (long)json_integer_value(jttl) : 0;
+    hotkeys_record(key, HOTKEY_PUT);
 
-    if (db_put(key, val) != 0) {
+    /* before the write: it can land and still report failure, and a key
+     * the filter doesn't know is a 404; an extra one only costs a read */
+    key_filter_add(key);
+    if (writeback_put(key, val, ttl) != 0) {
         json_decref(root);
         mg_printf(conn,
                   "HTTP/1.1 500 Internal Server Error\r\n"
@@ -71,7 +119,9 @@ static int post_kv_handler(struct mg_connection *conn, void *cbdata) {
         return 1;
     }
 
-    lru_cache_put(global_cache, key, val);
+    lru_cache_put_ttl(global_cache, key, val, (unsigned)ttl);
+    /* later readers must not join a DB read that started before this write */
+    sf_forget(global_flights, key);
     json_decref(root);
     mg_printf(conn,
               "HTTP/1.1 200 OK\r\n"
@@ -80,6 +130,49 @@ static int post_kv_handler(struct mg_connection *conn, void *cbdata) {
     return 1;
 }
 
+/* Writes the WAL still holds at startup win over a loaded snapshot */
+static void replay_into_cache(const char *key, const char *value, long ttl_left, void *arg) {
+    (void)arg;
+    if (value) lru_cache_put_ttl(global_cache, key, value, (unsigned)ttl_left);
+    else lru_cache_delete(global_cache, key);
+}
+
+/* bumped before each invalidation from another server is applied */
+static _Atomic uint64_t peer_invalidations = 0;
+
+/* Another server changed key (NULL: possibly anything). Runs on the DB
+ * listener thread. */
+static void invalidate_from_peer(const char *key, void *arg) {
+    (void)arg;
+    atomic_fetch_add(&peer_invalidations, 1);
+    if (key) {
+        lru_cache_delete(global_cache, key);
+        sf_forget(global_flights, key);
+        /* it may be a key we have never seen */
+        key_filter_add(key);
+    } else {
+        lru_cache_clear(global_cache);
+        key_filter_reset();
+    }
+}
+
+/* Miss path, run once per key however many workers miss on it together */
+static int fetch_and_fill(const char *key, char **out_value, void *arg) {
+    (void)arg;
+    long ttl_left = 0;
+    /* an invalidation landing while we read may be for the value we got;
+     * serve it, but don't let it outlive the invalidation in the cache */
+    uint64_t seen = atomic_load(&peer_invalidations);
+    if (writeback_get(key, out_value, &ttl_left) != 0) return -1;
+    /* the cached copy dies with the row; an invalidation that ran between
+     * the check and the put found nothing to drop, so take it out again */
+    if (atomic_load(&peer_invalidations) == seen) {
+        lru_cache_put_ttl(global_cache, key, *out_value, (unsigned)ttl_left);
+        if (atomic_load(&peer_invalidations) != seen) lru_cache_delete(global_cache, key);
+    }
+    return 0;
+}
+
 /* GET /kv?key=... */
 static int get_kv_handler(struct mg_connection *conn, void *cbdata) {
     const struct mg_request_info *req_info = mg_get_request_info(conn);
@@ -98,20 +191,26 @@ static int get_kv_handler(struct mg_connection *conn, void *cbdata) {
     strncpy(key_buf, p + 4, sizeof(key_buf) - 1);
     char *amp = strchr(key_buf, '&');
     if (amp) *amp = '\0';
+    hotkeys_record(key_buf, HOTKEY_GET);
+
+    lru_value_t *cached = NULL;
+    if (lru_cache_acquire(global_cache, key_buf, &cached) == 0) {
+        write_cached(conn, cached);
+        lru_value_release(cached);
+        return 1;
+    }
 
-    char *cached = NULL;
-    if (lru_cache_get(global_cache, key_buf, &cached) == 0) {
+    /* never-written keys stop here instead of costing a SELECT */
+    if (!key_filter_may_contain(key_buf)) {
         mg_printf(conn,
-                  "HTTP/1.1 200 OK\r\n"
-                   "X-Source: CACHE\r\n"
-                  "Content-Type: text/plain\r\n\r\nCACHE:%s\n", cached);
-        free(cached);
+                  "HTTP/1.1 404 Not Found\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "Key not found\n");
         return 1;
     }
 
     char *dbval = NULL;
-    if (db_get(key_buf, &dbval) == 0) {
-        lru_cache_put(global_cache, key_buf, dbval);
+    if (sf_do(global_flights, key_buf, fetch_and_fill, NULL, &dbval, NULL) == 0) {
         mg_printf(conn,
                   "HTTP/1.1 200 OK\r\n"
                    "X-Source: DB\r\n"
@@ -145,9 +244,12 @@ static int delete_kv_handler(struct mg_connection *conn, void *cbdata) {
     strncpy(key_buf, p + 4, sizeof(key_buf) - 1);
     char *amp = strchr(key_buf, '&');
     if (amp) *amp = '\0';
+    hotkeys_record(key_buf, HOTKEY_DELETE);
 
-    if (db_delete(key_buf) == 0) {
+    if (writeback_delete(key_buf) == 0) {
         lru_cache_delete(global_cache, key_buf);
+        sf_forget(global_flights, key_buf);
+        key_filter_note_delete();
         mg_printf(conn,
                   "HTTP/1.1 200 OK\r\n"
                   "Content-Type: text/plain\r\n\r\n"
@@ -162,6 +264,668 @@ static int delete_kv_handler(struct mg_connection *conn, void *cbdata) {
     }
 }
 
+/* GET /stats  cache and miss-coalescing counters as JSON */
+static int stats_handler(struct mg_connection *conn, void *cbdata) {
+    lru_cache_stats_t cs;
+    sf_stats_t fs;
+    lru_cache_get_stats(global_cache, &cs);
+    sf_get_stats(global_flights, &fs);
+
+    json_t *cache = json_pack("{s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:I}",
+                              "entries", (json_int_t)cs.entries,
+                              "bytes", (json_int_t)cs.bytes,
+                              "retired", (json_int_t)cs.retired,
+                              "slab_used_bytes", (json_int_t)cs.slab_used_bytes,
+                              "slab_reserved_bytes", (json_int_t)cs.slab_reserved_bytes,
+                              "index_bytes", (json_int_t)cs.index_bytes,
+                              "sketch_bytes", (json_int_t)cs.sketch_bytes,
+                              "admitted", (json_int_t)cs.admitted,
+                              "rejected", (json_int_t)cs.rejected,
+                              "l1_hits", (json_int_t)cs.l1_hits,
+                              "expired", (json_int_t)cs.expired);
+    if (cache && cs.compressed_entries) {
+        /* raw/stored > 1 and a small inflate cost per hit means it pays */
+        json_object_set_new(cache, "compression",
+            json_pack("{s:I, s:I, s:I, s:f, s:I, s:f}",
+                      "entries", (json_int_t)cs.compressed_entries,
+                      "stored_bytes", (json_int_t)cs.compressed_bytes,
+                      "raw_bytes", (json_int_t)cs.compressed_raw_bytes,
+                      "ratio", (double)cs.compressed_raw_bytes / (double)cs.compressed_bytes,
+                      "decompressions", (json_int_t)cs.decompressions,
+                      "decompress_ns_per_hit",
+                      cs.decompressions ? (double)cs.decompress_ns / (double)cs.decompressions : 0.0));
+    }
+    if (cache && cs.replicated) {
+        json_object_set_new(cache, "hot_replicated", json_integer((json_int_t)cs.replicated));
+        json_object_set_new(cache, "hot_replica_bytes", json_integer((json_int_t)cs.replica_bytes));
+    }
+    json_t *flights = json_pack("{s:I, s:I}",
+                                "db_reads", (json_int_t)fs.leaders,
+                                "coalesced_waits", (json_int_t)fs.coalesced);
+    json_t *root = json_pack("{s:o, s:o}", "cache", cache, "singleflight", flights);
+    db_pool_stats_t ps;
+    if (root && db_get_pool_stats(&ps) == 0) {
+        double up = (double)ps.uptime_ns * (double)ps.size;
+        json_t *pool = json_pack("{s:s, s:I, s:I, s:I, s:I, s:f, s:f, s:I}",
+                      "mode", ps.pipeline ? "pipeline" : "sync",
+                      "size", (json_int_t)ps.size,
+                      "in_use", (json_int_t)ps.in_use,
+                      "checkouts", (json_int_t)ps.checkouts,
+                      "waits", (json_int_t)ps.waits,
+                      "avg_wait_us", ps.waits ? (double)ps.wait_ns / (double)ps.waits / 1e3 : 0.0,
+                      "utilization", up > 0 ? (double)ps.busy_ns / up : 0.0,
+                      "reconnects", (json_int_t)ps.reconnects);
+        if (pool && ps.pipeline) {
+            json_object_set_new(pool, "in_flight", json_integer((json_int_t)ps.in_flight));
+            json_object_set_new(pool, "max_in_flight", json_integer((json_int_t)ps.max_in_flight));
+        }
+        json_object_set_new(root, "db_pool", pool);
+    }
+    logstore_stats_t ls;
+    if (root && logstore_get_stats(&ls) == 0) {
+        json_object_set_new(root, "log_store",
+            json_pack("{s:I, s:I, s:I, s:I, s:f, s:I, s:I, s:I, s:I, s:i}",
+                      "keys", (json_int_t)ls.keys,
+                      "segments", (json_int_t)ls.segments,
+                      "disk_bytes", (json_int_t)ls.disk_bytes,
+                      "live_bytes", (json_int_t)ls.live_bytes,
+                      "live_ratio", ls.disk_bytes ? (double)ls.live_bytes / (double)ls.disk_bytes : 1.0,
+                      "compactions", (json_int_t)ls.compactions,
+                      "reclaimed_bytes", (json_int_t)ls.reclaimed_bytes,
+                      "appends", (json_int_t)ls.appends,
+                      "fsyncs", (json_int_t)ls.fsyncs,
+                      "fsync_ms", (int)ls.fsync_ms));
+    }
+    db_replica_stats_t rs;
+    if (root && db_get_replica_stats(&rs) == 0) {
+        json_t *list = json_array();
+        for (size_t i = 0; i < rs.n; ++i)
+            json_array_append_new(list, json_pack("{s:s, s:b, s:I, s:I, s:I, s:I}",
+                                  "host", rs.replicas[i].label,
+                                  "healthy", rs.replicas[i].healthy,
+                                  "lag_ms", (json_int_t)rs.replicas[i].lag_ms,
+                                  "reads", (json_int_t)rs.replicas[i].reads,
+                                  "errors", (json_int_t)rs.replicas[i].errors,
+                                  "broken_conns", (json_int_t)rs.replicas[i].broken));
+        json_object_set_new(root, "db_replicas",
+            json_pack("{s:i, s:I, s:I, s:o}",
+                      "max_lag_ms", (int)rs.max_lag_ms,
+                      "primary_reads", (json_int_t)rs.primary_reads,
+                      "recent_write_reads", (json_int_t)rs.recent_write_reads,
+                      "replicas", list));
+    }
+    db_invalidation_stats_t is;
+    if (root && db_get_invalidation_stats(&is) == 0) {
+        uint64_t from_peers = is.received - is.own;
+        json_object_set_new(root, "coherence",
+            json_pack("{s:b, s:I, s:I, s:I, s:I, s:I, s:f, s:I, s:I}",
+                      "connected", is.connected,
+                      "received", (json_int_t)is.received,
+                      "own", (json_int_t)is.own,
+                      "invalidated", (json_int_t)is.applied,
+                      "flushes", (json_int_t)is.flushes,
+                      "reconnects", (json_int_t)is.reconnects,
+                      "avg_lag_us", from_peers ? (double)is.lag_us_total / (double)from_peers : 0.0,
+                      "last_lag_us", (json_int_t)is.lag_us_last,
+                      "max_lag_us", (json_int_t)is.lag_us_max));
+    }
+    writeback_stats_t ws;
+    if (root && writeback_get_stats(&ws) == 0) {
+        json_object_set_new(root, "write_back",
+            json_pack("{s:I, s:I, s:I, s:I, s:I, s:f, s:f, s:I, s:I, s:I, s:I}",
+                      "appended", (json_int_t)ws.appended,
+                      "replayed", (json_int_t)ws.replayed,
+                      "applied", (json_int_t)ws.applied,
+                      "pending", (json_int_t)ws.pending,
+                      "batches", (json_int_t)ws.batches,
+                      "avg_batch", ws.batches ? (double)ws.applied / (double)ws.batches : 0.0,
+                      "avg_apply_us", ws.batches ? (double)ws.apply_ns / (double)ws.batches / 1e3 : 0.0,
+                      "retries", (json_int_t)ws.retries,
+                      "fsyncs", (json_int_t)ws.fsyncs,
+                      "checkpoint", (json_int_t)ws.checkpoint,
+                      "wal_bytes", (json_int_t)ws.wal_bytes));
+    }
+    group_commit_stats_t gs;
+    if (root && group_commit_get_stats(&gs) == 0) {
+        json_object_set_new(root, "group_commit",
+            json_pack("{s:I, s:I, s:I, s:I, s:f, s:I, s:f, s:I, s:I, s:I}",
+                      "max_batch", (json_int_t)gs.max_batch,
+                      "window_us", (json_int_t)gs.window_us,
+                      "batches", (json_int_t)gs.batches,
+                      "writes", (json_int_t)gs.ops,
+                      "avg_batch", gs.batches ? (double)gs.ops / (double)gs.batches : 0.0,
+                      "largest_batch", (json_int_t)gs.largest,
+                      "avg_flush_us", gs.batches ? (double)gs.flush_ns / (double)gs.batches / 1e3 : 0.0,
+                      "fallbacks", (json_int_t)gs.fallbacks,
+                      "lost", (json_int_t)gs.lost,
+                      "pending", (json_int_t)gs.pending));
+    }
+    key_filter_stats_t ks;
+    if (root && key_filter_get_stats(&ks) == 0) {
+        json_object_set_new(root, "bloom",
+            json_pack("{s:b, s:I, s:I, s:I, s:i, s:f, s:f, s:I, s:I}",
+                      "ready", ks.ready,
+                      "keys", (json_int_t)ks.keys,
+                      "capacity", (json_int_t)ks.capacity,
+                      "memory_bytes", (json_int_t)ks.memory_bytes,
+                      "hashes", (int)ks.hashes,
+                      "target_fpr", ks.target_fpr,
+                      "estimated_fpr", ks.estimated_fpr,
+                      "rebuilds", (json_int_t)ks.rebuilds,
+                      "db_reads_skipped", (json_int_t)ks.db_reads_skipped));
+    }
+    char *body = root ? json_dumps(root, JSON_COMPACT) : NULL;
+    json_decref(root);
+    if (!body) {
+        mg_printf(conn,
+                  "HTTP/1.1 500 Internal Server Error\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "Stats error\n");
+        return 1;
+    }
+    mg_printf(conn,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: application/json\r\n\r\n"
+              "%s\n", body);
+    free(body);
+    return 1;
+}
+
+/* GET /admin/hotkeys?n=20  busiest keys right now, hottest first */
+static int hotkeys_handler(struct mg_connection *conn, void *cbdata) {
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    const char *qs = req_info->query_string ? req_info->query_string : "";
+    size_t k;
+    unsigned sample;
+    double hot_rps;
+    if (hotkeys_get_config(&k, &sample, &hot_rps) != 0) {
+        mg_printf(conn,
+                  "HTTP/1.1 404 Not Found\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "Hot key tracking is off\n");
+        return 1;
+    }
+    size_t n = 20;
+    const char *p = strstr(qs, "n=");
+    if (p && atol(p + 2) > 0) n = (size_t)atol(p + 2);
+    if (n > k) n = k;
+
+    hotkey_t *top = malloc(n * sizeof(*top));
+    json_t *keys = json_array();
+    size_t got = top ? hotkeys_top(top, n) : 0;
+    for (size_t i = 0; i < got; ++i) {
+        json_array_append_new(keys,
+            json_pack("{s:s, s:f, s:f, s:f, s:f, s:I, s:I, s:b}",
+                      "key", top[i].key,
+                      "rate", top[i].rate,
+                      "get_rate", top[i].op_rate[HOTKEY_GET],
+                      "put_rate", top[i].op_rate[HOTKEY_PUT],
+                      "delete_rate", top[i].op_rate[HOTKEY_DELETE],
+                      "count", (json_int_t)top[i].count,
+                      "error", (json_int_t)top[i].error,
+                      "hot", top[i].hot));
+    }
+    free(top);
+    json_t *root = json_pack("{s:I, s:i, s:f, s:o}",
+                             "tracked", (json_int_t)k,
+                             "sample", (int)sample,
+                             "hot_rps", hot_rps,
+                             "keys", keys);
+    char *body = root ? json_dumps(root, JSON_COMPACT) : NULL;
+    json_decref(root);
+    if (!body) {
+        mg_printf(conn,
+                  "HTTP/1.1 500 Internal Server Error\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "Hot keys error\n");
+        return 1;
+    }
+    mg_printf(conn,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: application/json\r\n\r\n"
+              "%s\n", body);
+    free(body);
+    return 1;
+}
+
+/* rows per bulk commit; the cache is updated once each chunk is in */
+#define BULK_CHUNK_ROWS 50000
+#define BULK_READ_BYTES (256 * 1024)
+#define BULK_MAX_LINE (16 * 1024 * 1024)
+
+/* Rows of the chunk being loaded, kept for the cache until it commits */
+typedef struct {
+    storage_bulk_t *bulk;
+    int warm;
+    char **keys, **values;
+    long *ttls;
+    size_t n;
+    long rows, bad_lines, chunks;
+    int failed;
+} bulk_load_t;
+
+/* Commits the staged rows, then brings the cache in line with them */
+static int bulk_flush(bulk_load_t *l) {
+    /* before the commit, as in post_kv_handler */
+    for (size_t i = 0; i < l->n; ++i) key_filter_add(l->keys[i]);
+    long n = storage_bulk_commit(l->bulk);
+    if (n < 0) l->failed = 1;
+    else if (n > 0) l->chunks++;
+    for (size_t i = 0; i < l->n; ++i) {
+        if (n >= 0) {
+            l->rows++;
+            if (l->warm) lru_cache_put_ttl(global_cache, l->keys[i], l->values[i], (unsigned)l->ttls[i]);
+            else lru_cache_delete(global_cache, l->keys[i]);
+            sf_forget(global_flights, l->keys[i]);
+        }
+        free(l->keys[i]);
+        free(l->values[i]);
+    }
+    l->n = 0;
+    return n < 0 ? -1 : 0;
+}
+
+/* One NDJSON line: {"key":"k","value":"v"[,"ttl":secs]} */
+static int bulk_line(bulk_load_t *l, const char *line, size_t len) {
+    while (len && (line[len - 1] == '\r' || line[len - 1] == ' ')) len--;
+    if (!len) return 0;
+    json_error_t jerr;
+    json_t *row = json_loadb(line, len, 0, &jerr);
+    json_t *jkey = json_object_get(row, "key");
+    json_t *jval = json_object_get(row, "value");
+    json_t *jttl = json_object_get(row, "ttl");
+    if (!json_is_string(jkey) || !json_is_string(jval) ||
+        (jttl && (!json_is_integer(jttl) || json_integer_value(jttl) <= 0 ||
+                  json_integer_value(jttl) > UINT32_MAX / 2))) {
+        json_decref(row);
+        l->bad_lines++;
+        return 0;
+    }
+    const char *key = json_string_value(jkey), *val = json_string_value(jval);
+    long ttl = jttl ? (long)json_integer_value(jttl) : 0;
+    int rc = storage_bulk_add(l->bulk, key, val, ttl);
+    if (rc == 0) {
+        l->keys[l->n] = strdup(key);
+        l->values[l->n] = l->warm ? strdup(val) : NULL;
+        l->ttls[l->n++] = ttl;
+    }
+    json_decref(row);
+    if (rc != 0) {
+        l->failed = 1;
+        return -1;
+    }
+    return l->n == BULK_CHUNK_ROWS ? bulk_flush(l) : 0;
+}
+
+/* POST /admin/bulk[?warm=1]  NDJSON body, one {"key","value"[,"ttl"]} per
+ * line. Rows go into storage through its bulk path in chunks, bypassing
+ * group commit; warm=1 also puts them in the cache. Refused in write-back
+ * mode, where an unapplied write to the same key would keep being served
+ * and later overwrite the loaded row. */
+static int bulk_handler(struct mg_connection *conn, void *cbdata) {
+    (void)cbdata;
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "POST") != 0) {
+        mg_printf(conn,
+                  "HTTP/1.1 405 Method Not Allowed\r\n"
+                  "Content-Type: text/plain\r\n\r\n");
+        return 1;
+    }
+    writeback_stats_t ws;
+    if (writeback_get_stats(&ws) == 0) {
+        mg_printf(conn,
+                  "HTTP/1.1 409 Conflict\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "Bulk load is not available in write-back mode\n");
+        return 1;
+    }
+    const char *qs = req_info->query_string ? req_info->query_string : "";
+    bulk_load_t l = { .warm = strstr(qs, "warm=1") != NULL };
+    l.keys = malloc(BULK_CHUNK_ROWS * sizeof(*l.keys));
+    l.values = malloc(BULK_CHUNK_ROWS * sizeof(*l.values));
+    l.ttls = malloc(BULK_CHUNK_ROWS * sizeof(*l.ttls));
+    size_t cap = BULK_READ_BYTES, len = 0;
+    char *buf = malloc(cap);
+    l.bulk = l.keys && l.values && l.ttls && buf ? storage_bulk_begin() : NULL;
+    if (!l.bulk) {
+        free(l.keys);
+        free(l.values);
+        free(l.ttls);
+        free(buf);
+        mg_printf(conn,
+                  "HTTP/1.1 500 Internal Server Error\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "DB error\n");
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    /* streamed: the body can be far bigger than memory */
+    int eof = 0, too_long = 0;
+    while (!eof && !l.failed) {
+        if (len == cap) {
+            char *n = cap < BULK_MAX_LINE ? realloc(buf, cap * 2) : NULL;
+            if (!n) {
+                too_long = 1;
+                break;
+            }
+            buf = n;
+            cap *= 2;
+        }
+        int got = mg_read(conn, buf + len, cap - len);
+        if (got <= 0) eof = 1;
+        else len += (size_t)got;
+        size_t start = 0;
+        char *nl;
+        while (!l.failed && (nl = memchr(buf + start, '\n', len - start)) != NULL) {
+            bulk_line(&l, buf + start, (size_t)(nl - (buf + start)));
+            start = (size_t)(nl - buf) + 1;
+        }
+        memmove(buf, buf + start, len - start);
+        len -= start;
+    }
+    if (!l.failed && !too_long && len) bulk_line(&l, buf, len);
+    if (!l.failed && !too_long) bulk_flush(&l);
+    else {
+        /* staged rows never committed: nothing for the cache to learn */
+        for (size_t i = 0; i < l.n; ++i) {
+            free(l.keys[i]);
+            free(l.values[i]);
+        }
+    }
+    storage_bulk_end(l.bulk);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(buf);
+    free(l.keys);
+    free(l.values);
+    free(l.ttls);
+
+    double secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    json_t *root = json_pack("{s:I, s:I, s:I, s:f, s:f}",
+                             "rows", (json_int_t)l.rows,
+                             "bad_lines", (json_int_t)l.bad_lines,
+                             "chunks", (json_int_t)l.chunks,
+                             "seconds", secs,
+                             "rows_per_sec", secs > 0 ? (double)l.rows / secs : 0.0);
+    if (root && (l.failed || too_long))
+        json_object_set_new(root, "error", json_string(too_long ? "line too long" : "storage error"));
+    char *body = root ? json_dumps(root, JSON_COMPACT) : NULL;
+    json_decref(root);
+    const char *status = too_long ? "400 Bad Request" : l.failed ? "500 Internal Server Error" : "200 OK";
+    mg_printf(conn,
+              "HTTP/1.1 %s\r\n"
+              "Content-Type: application/json\r\n\r\n"
+              "%s\n", status, body ? body : "{}");
+    free(body);
+    return 1;
+}
+
+/* ops per /kv/batch request, and its body size */
+#define BATCH_MAX_OPS 10000
+#define BATCH_MAX_BODY (64 * 1024 * 1024)
+
+typedef struct {
+    hotkey_op_t op;
+    const char *key;    /* points into the parsed request */
+    const char *value;  /* put */
+    long ttl;
+    size_t prior;       /* 1 + index of the last earlier write to key in the batch, 0 = none */
+    size_t read;        /* 1 + index into the read list, 0 = not read */
+    char *found;        /* value read for a get, or a delete's proof the key exists */
+    int status;
+    const char *error;
+} batch_op_t;
+
+/* Whole request body, chunked or not; NULL with *too_big set past max */
+static char *read_all(struct mg_connection *conn, size_t max, size_t *len, int *too_big) {
+    size_t cap = 64 * 1024;
+    char *buf = malloc(cap + 1);
+    *len = 0;
+    *too_big = 0;
+    while (buf) {
+        if (*len == cap) {
+            if (cap >= max) {
+                *too_big = 1;
+                break;
+            }
+            char *n = realloc(buf, cap * 2 + 1);
+            if (!n) break;
+            buf = n;
+            cap *= 2;
+        }
+        int got = mg_read(conn, buf + *len, cap - *len);
+        if (got <= 0) {
+            buf[*len] = '\0';
+            return buf;
+        }
+        *len += (size_t)got;
+    }
+    free(buf);
+    return NULL;
+}
+
+static const char *batch_parse(batch_op_t *o, json_t *item) {
+    json_t *jop = json_object_get(item, "op");
+    json_t *jkey = json_object_get(item, "key");
+    json_t *jval = json_object_get(item, "value");
+    json_t *jttl = json_object_get(item, "ttl");
+    const char *op = json_string_value(jop);
+    if (!op || !json_is_string(jkey) || !*json_string_value(jkey)) return "missing op/key";
+    o->key = json_string_value(jkey);
+    if (strcmp(op, "get") == 0) {
+        o->op = HOTKEY_GET;
+    } else if (strcmp(op, "delete") == 0) {
+        o->op = HOTKEY_DELETE;
+    } else if (strcmp(op, "put") == 0) {
+        o->op = HOTKEY_PUT;
+        if (!json_is_string(jval)) return "missing value";
+        if (jttl && (!json_is_integer(jttl) || json_integer_value(jttl) <= 0 ||
+                     json_integer_value(jttl) > UINT32_MAX / 2))
+            return "ttl must be a positive number of seconds";
+        o->value = json_string_value(jval);
+        o->ttl = jttl ? (long)json_integer_value(jttl) : 0;
+    } else {
+        return "op must be get, put or delete";
+    }
+    return NULL;
+}
+
+/* Answers in request order; every op sees the ones before it */
+static json_t *batch_results(const batch_op_t *ops, size_t n) {
+    json_t *out = json_array();
+    for (size_t i = 0; out && i < n; ++i) {
+        const batch_op_t *o = &ops[i];
+        json_t *r = json_pack("{s:i}", "status", o->status);
+        if (r && o->key) json_object_set_new(r, "key", json_string(o->key));
+        if (r && o->op == HOTKEY_GET && o->status == 200) {
+            const char *v = o->prior ? ops[o->prior - 1].value : o->found;
+            json_object_set_new(r, "value", json_string(v));
+        }
+        if (r && o->error) json_object_set_new(r, "error", json_string(o->error));
+        json_array_append_new(out, r);
+    }
+    return out;
+}
+
+/* POST /kv/batch  JSON array of {"op":"get"|"put"|"delete","key":k
+ * [,"value":v][,"ttl":secs]}. Reads are answered from the cache where it
+ * can and otherwise by one storage read for all the misses, taken before
+ * any write; the batch's writes then go out as one write (one WAL sync in
+ * write-back mode), the last one per key winning. The reply is an array
+ * of {"key","status"[,"value"][,"error"]} in request order, with the
+ * statuses the single-key calls would have given had they run in turn. */
+static int batch_handler(struct mg_connection *conn, void *cbdata) {
+    (void)cbdata;
+    const struct mg_request_info *req_info = mg_get_request_info(conn);
+    if (strcmp(req_info->request_method, "POST") != 0) {
+        mg_printf(conn,
+                  "HTTP/1.1 405 Method Not Allowed\r\n"
+                  "Content-Type: text/plain\r\n\r\n");
+        return 1;
+    }
+    size_t len;
+    int too_big;
+    char *body = read_all(conn, BATCH_MAX_BODY, &len, &too_big);
+    json_error_t jerr;
+    json_t *root = body ? json_loadb(body, len, 0, &jerr) : NULL;
+    free(body);
+    size_t n = json_array_size(root);
+    if (!json_is_array(root) || n > BATCH_MAX_OPS) {
+        json_decref(root);
+        mg_printf(conn,
+                  "HTTP/1.1 %s\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "%s\n",
+                  too_big || n > BATCH_MAX_OPS ? "413 Payload Too Large" : "400 Bad Request",
+                  too_big ? "Body too large" : n > BATCH_MAX_OPS ? "Too many ops" : "Expected a JSON array");
+        return 1;
+    }
+
+    batch_op_t *ops = calloc(n ? n : 1, sizeof(*ops));
+    const char **keys = malloc((n ? n : 1) * sizeof(*keys));
+    const char **values = malloc((n ? n : 1) * sizeof(*values));
+    char **read_values = malloc((n ? n : 1) * sizeof(*read_values));
+    long *ttls = malloc((n ? n : 1) * sizeof(*ttls));
+    json_t *last_write = json_object(); /* key -> 1 + index */
+    json_t *read_index = json_object(); /* key -> 1 + index into keys */
+    if (!ops || !keys || !values || !read_values || !ttls || !last_write || !read_index) {
+        free(ops);
+        free(keys);
+        free(values);
+        free(read_values);
+        free(ttls);
+        json_decref(last_write);
+        json_decref(read_index);
+        json_decref(root);
+        mg_printf(conn,
+                  "HTTP/1.1 500 Internal Server Error\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "Out of memory\n");
+        return 1;
+    }
+
+    /* pass 1: parse, and see what each op depends on */
+    size_t n_reads = 0;
+    for (size_t i = 0; i < n; ++i) {
+        batch_op_t *o = &ops[i];
+        if ((o->error = batch_parse(o, json_array_get(root, i))) != NULL) {
+            o->status = 400;
+            continue;
+        }
+        hotkeys_record(o->key, o->op);
+        o->prior = (size_t)json_integer_value(json_object_get(last_write, o->key));
+        if (o->op != HOTKEY_GET) json_object_set_new(last_write, o->key, json_integer((json_int_t)i + 1));
+        if (o->prior || o->op == HOTKEY_PUT) continue;
+        /* a get or delete of the state before the batch */
+        char *cached = NULL;
+        if (lru_cache_get(global_cache, o->key, &cached) == 0) {
+            o->found = cached;
+        } else if (key_filter_may_contain(o->key)) {
+            o->read = (size_t)json_integer_value(json_object_get(read_index, o->key));
+            if (!o->read) {
+                keys[n_reads] = o->key;
+                o->read = ++n_reads;
+                json_object_set_new(read_index, o->key, json_integer((json_int_t)o->read));
+            }
+        }
+    }
+
+    /* pass 2: every miss in one read, before anything is written */
+    uint64_t seen = atomic_load(&peer_invalidations);
+    long got = n_reads ? writeback_get_many(n_reads, keys, read_values, ttls) : 0;
+    if (got > 0 && atomic_load(&peer_invalidations) == seen) {
+        for (size_t j = 0; j < n_reads; ++j)
+            if (read_values[j]) lru_cache_put_ttl(global_cache, keys[j], read_values[j], (unsigned)ttls[j]);
+        /* same re-check as fetch_and_fill */
+        if (atomic_load(&peer_invalidations) != seen) {
+            for (size_t j = 0; j < n_reads; ++j)
+                if (read_values[j]) lru_cache_delete(global_cache, keys[j]);
+        }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        batch_op_t *o = &ops[i];
+        if (o->status) continue;
+        if (o->op == HOTKEY_PUT) {
+            o->status = 200;
+        } else if (o->prior) {
+            o->status = ops[o->prior - 1].op == HOTKEY_PUT ? 200 : 404;
+        } else if (o->read && got < 0) {
+            o->status = 503;
+            o->error = "storage error";
+        } else {
+            if (o->read && read_values[o->read - 1]) o->found = strdup(read_values[o->read - 1]);
+            o->status = o->found ? 200 : 404;
+        }
+    }
+
+    /* pass 3: the last write to each key; a delete of a key that was never
+     * there has nothing to do */
+    size_t n_writes = 0;
+    for (size_t i = 0; i < n; ++i) {
+        batch_op_t *o = &ops[i];
+        if (o->op == HOTKEY_GET || o->status == 400) continue;
+        if (o->op == HOTKEY_DELETE && !o->prior && o->status != 200) continue;
+        if ((size_t)json_integer_value(json_object_get(last_write, o->key)) != i + 1) continue;
+        keys[n_writes] = o->key;
+        values[n_writes] = o->op == HOTKEY_PUT ? o->value : NULL;
+        ttls[n_writes++] = o->ttl;
+    }
+    /* before the write, as in post_kv_handler */
+    for (size_t j = 0; j < n_writes; ++j)
+        if (values[j]) key_filter_add(keys[j]);
+    int failed = n_writes && writeback_write_many(n_writes, keys, values, ttls) != 0;
+    for (size_t j = 0; j < n_writes; ++j) {
+        if (failed) {
+            /* some may have landed; don't let the cache say otherwise */
+            lru_cache_delete(global_cache, keys[j]);
+        } else if (values[j]) {
+            lru_cache_put_ttl(global_cache, keys[j], values[j], (unsigned)ttls[j]);
+        } else {
+            lru_cache_delete(global_cache, keys[j]);
+            key_filter_note_delete();
+        }
+        sf_forget(global_flights, keys[j]);
+    }
+    for (size_t i = 0; failed && i < n; ++i) {
+        /* writes, and reads answered from them */
+        batch_op_t *o = &ops[i];
+        if (o->status < 400 && (o->op != HOTKEY_GET || o->prior)) {
+            o->status = 503;
+            o->error = "storage error";
+        }
+    }
+
+    json_t *out = batch_results(ops, n);
+    char *resp = out ? json_dumps(out, JSON_COMPACT) : NULL;
+    json_decref(out);
+    for (size_t i = 0; i < n; ++i) free(ops[i].found);
+    for (size_t j = 0; got >= 0 && j < n_reads; ++j) free(read_values[j]);
+    free(ops);
+    free(keys);
+    free(values);
+    free(read_values);
+    free(ttls);
+    json_decref(last_write);
+    json_decref(read_index);
+    json_decref(root);
+    if (!resp) {
+        mg_printf(conn,
+                  "HTTP/1.1 500 Internal Server Error\r\n"
+                  "Content-Type: text/plain\r\n\r\n"
+                  "Batch error\n");
+        return 1;
+    }
+    size_t resp_len = strlen(resp);
+    mg_printf(conn,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: application/json\r\n"
+              "Content-Length: %zu\r\n\r\n", resp_len);
+    mg_write(conn, resp, resp_len);
+    free(resp);
+    return 1;
+}
+
 /* Unified request dispatcher */
 static int unified_handler(struct mg_connection *conn, void *cbdata) {
     const struct mg_request_info *req = mg_get_request_info(conn);
@@ -179,10 +943,28 @@ static int unified_handler(struct mg_connection *conn, void *cbdata) {
 }
 
 /* Server start */
-int http_server_start(int port, lru_cache_t *cache, const char *db_conninfo, int threads) {
+int http_server_start(int port, lru_cache_t *cache, int threads,
+                      const storage_backend_t *backend, const storage_config_t *cfg,
+                      const char *wal_dir, size_t wal_batch, int coherence) {
     global_cache = cache;
-    if (db_init(db_conninfo) != 0) {
-        fprintf(stderr, "Failed to initialize DB\n");
+    global_flights = sf_create((size_t)threads * 4);
+    if (!global_flights) {
+        fprintf(stderr, "Failed to create miss coalescing table\n");
+        return -1;
+    }
+    storage_config_t scfg = *cfg;
+    if (coherence) scfg.on_invalidate = invalidate_from_peer;
+    if (storage_open(backend, &scfg) != 0) {
+        fprintf(stderr, "Failed to open %s storage\n", backend->name);
+        sf_destroy(global_flights);
+        global_flights = NULL;
+        return -1;
+    }
+    if (wal_dir && writeback_start(wal_dir, wal_batch, replay_into_cache, NULL) != 0) {
+        fprintf(stderr, "Failed to open write-back WAL in %s\n", wal_dir);
+        storage_close();
+        sf_destroy(global_flights);
+        global_flights = NULL;
         return -1;
     }
 
@@ -206,11 +988,18 @@ int http_server_start(int port, lru_cache_t *cache, const char *db_conninfo, int
     global_ctx = mg_start(&callbacks, NULL, options);
     if (!global_ctx) {
         fprintf(stderr, "Failed to start CivetWeb\n");
-        db_close();
+        writeback_stop();
+        storage_close();
+        sf_destroy(global_flights);
+        global_flights = NULL;
         return -1;
     }
 
     mg_set_request_handler(global_ctx, "/kv", unified_handler, NULL);
+    mg_set_request_handler(global_ctx, "/kv/batch", batch_handler, NULL);
+    mg_set_request_handler(global_ctx, "/stats", stats_handler, NULL);
+    mg_set_request_handler(global_ctx, "/admin/hotkeys", hotkeys_handler, NULL);
+    mg_set_request_handler(global_ctx, "/admin/bulk", bulk_handler, NULL);
 
     printf("HTTP server listening on port %d\n", port);
     return 0;
@@ -221,5 +1010,15 @@ void http_server_stop(void) {
         mg_stop(global_ctx);
         global_ctx = NULL;
     }
-    db_close();
+    /* the last thing besides the workers that writes to the cache and
+     * the key filter */
+    db_invalidation_stop();
+}
+
+void http_server_close(void) {
+    /* no handler is left to log a write; apply what is still queued */
+    writeback_stop();
+    storage_close();
+    sf_destroy(global_flights);
+    global_flights = NULL;
 }
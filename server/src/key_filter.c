@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include "key_filter.h"
+#include "bloom.h"
+#include "storage.h"
+#include "writeback.h"
+#include "epoch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+/* rebuild once deletes reach this fraction of the keys built in */
+#define REBUILD_DELETE_RATIO 0.2
+/* new filters leave this much headroom over the current key count */
+#define GROWTH_FACTOR 2
+#define CHECK_INTERVAL_SEC 1
+
+static _Atomic(bloom_t *) live = NULL;  /* answers lookups */
+static _Atomic(bloom_t *) next = NULL;  /* being built; also gets every add */
+static epoch_domain_t epoch;            /* readers of live/next */
+static _Atomic int running = 0;
+static _Atomic size_t deletes = 0;
+static _Atomic size_t skipped = 0;
+static _Atomic size_t rebuilds = 0;
+static _Atomic size_t resets = 0;       /* key_filter_reset calls */
+static _Atomic size_t resets_seen = 0;  /* ...covered by the live filter's scan */
+static size_t min_keys;
+static double target_fpr;
+
+static pthread_t builder;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static int stop_requested = 0;
+
+static int scan_add(const char *key, void *arg) {
+    bloom_add((bloom_t *)arg, key);
+    /* let shutdown cut a long scan short */
+    return atomic_load_explicit(&running, memory_order_relaxed) ? 0 : 1;
+}
+
+/* Wait until no reader can still be looking at a filter unlinked now */
+static void wait_for_readers(void) {
+    uint64_t tag = epoch_now(&epoch);
+    while (epoch_safe(&epoch) <= tag) usleep(1000);
+}
+
+static int build(size_t size_for) {
+    bloom_t *b = bloom_create(size_for, target_fpr);
+    if (!b) return -1;
+    /* publish before scanning: a write committed after the scan's snapshot
+     * is added here by key_filter_add, anything earlier is in the scan */
+    atomic_store(&next, b);
+    size_t deletes_before = atomic_load(&deletes);
+    size_t resets_before = atomic_load(&resets);
+    /* unapplied write-back puts first: one applied meanwhile is in the
+     * storage scan that follows */
+    long n = writeback_scan_pending(scan_add, b);
+    if (n >= 0) n = storage_scan_keys(scan_add, b);
+    if (n < 0) {
+        atomic_store(&next, NULL);
+        wait_for_readers();
+        bloom_destroy(b);
+        return -1;
+    }
+    bloom_t *old = atomic_exchange(&live, b);
+    atomic_store(&next, NULL);
+    atomic_fetch_sub(&deletes, deletes_before);
+    atomic_store(&resets_seen, resets_before);
+    if (old) {
+        wait_for_readers();
+        bloom_destroy(old);
+        atomic_fetch_add(&rebuilds, 1);
+    }
+    return 0;
+}
+
+static int needs_rebuild(const bloom_t *b) {
+    size_t added = atomic_load_explicit(&b->added, memory_order_relaxed);
+    if (added > b->capacity) return 1;
+    return (double)atomic_load_explicit(&deletes, memory_order_relaxed) >
+           REBUILD_DELETE_RATIO * (double)(added ? added : 1);
+}
+
+static void *builder_main(void *arg) {
+    (void)arg;
+    int built = 0;
+    pthread_mutex_lock(&stop_lock);
+    while (!stop_requested) {
+        bloom_t *b = atomic_load(&live);
+        if (!built || needs_rebuild(b) || atomic_load(&resets) != atomic_load(&resets_seen)) {
+            pthread_mutex_unlock(&stop_lock);
+            size_t want = min_keys;
+            if (b) {
+                size_t have = atomic_load_explicit(&b->added, memory_order_relaxed);
+                if (have * GROWTH_FACTOR > want) want = have * GROWTH_FACTOR;
+            }
+            if (build(want) == 0) built = 1;
+            else fprintf(stderr, "key_filter: build failed, retrying\n");
+            pthread_mutex_lock(&stop_lock);
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += CHECK_INTERVAL_SEC;
+        pthread_cond_timedwait(&stop_cond, &stop_lock, &ts);
+    }
+    pthread_mutex_unlock(&stop_lock);
+    return NULL;
+}
+
+int key_filter_start(size_t expected_keys, double fpr) {
+    if (fpr <= 0.0 || fpr >= 1.0) return -1;
+    if (epoch_domain_init(&epoch) != 0) return -1;
+    min_keys = expected_keys ? expected_keys : 1;
+    target_fpr = fpr;
+    stop_requested = 0;
+    atomic_store(&running, 1);
+    if (pthread_create(&builder, NULL, builder_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        epoch_domain_destroy(&epoch);
+        return -1;
+    }
+    return 0;
+}
+
+/* Callers of add/may_contain must be gone */
+void key_filter_stop(void) {
+    if (!atomic_load(&running)) return;
+    atomic_store(&running, 0);
+    pthread_mutex_lock(&stop_lock);
+    stop_requested = 1;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&stop_lock);
+    pthread_join(builder, NULL);
+    bloom_destroy(atomic_exchange(&live, NULL));
+    bloom_destroy(atomic_exchange(&next, NULL));
+    epoch_domain_destroy(&epoch);
+}
+
+void key_filter_add(const char *key) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) return;
+    epoch_enter(&epoch);
+    /* next before live: the builder swaps live before clearing next, so
+     * whichever moment we look, the filter that ends up live gets the key */
+    bloom_t *n = atomic_load(&next);
+    if (n) bloom_add(n, key);
+    bloom_t *b = atomic_load(&live);
+    if (b && b != n) bloom_add(b, key);
+    epoch_exit(&epoch);
+}
+
+void key_filter_note_delete(void) {
+    if (atomic_load_explicit(&running, memory_order_relaxed))
+        atomic_fetch_add_explicit(&deletes, 1, memory_order_relaxed);
+}
+
+void key_filter_reset(void) {
+    if (!atomic_load(&running)) return;
+    atomic_fetch_add(&resets, 1);
+    pthread_mutex_lock(&stop_lock);
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&stop_lock);
+}
+
+int key_filter_may_contain(const char *key) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) return 1;
+    if (atomic_load_explicit(&resets, memory_order_relaxed) !=
+        atomic_load_explicit(&resets_seen, memory_order_relaxed)) return 1;
+    epoch_enter(&epoch);
+    bloom_t *b = atomic_load_explicit(&live, memory_order_acquire);
+    int maybe = b ? bloom_may_contain(b, key) : 1;
+    epoch_exit(&epoch);
+    if (!maybe) atomic_fetch_add_explicit(&skipped, 1, memory_order_relaxed);
+    return maybe;
+}
+
+int key_filter_get_stats(key_filter_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    if (!atomic_load(&running)) return -1;
+    st->target_fpr = target_fpr;
+    st->db_reads_skipped = atomic_load_explicit(&skipped, memory_order_relaxed);
+    epoch_enter(&epoch);
+    bloom_t *b = atomic_load(&live);
+    if (b) {
+        st->ready = 1;
+        st->keys = atomic_load_explicit(&b->added, memory_order_relaxed);
+        st->capacity = b->capacity;
+        st->memory_bytes = bloom_memory(b);
+        st->hashes = b->n_hashes;
+        st->estimated_fpr = bloom_estimated_fpr(b);
+    }
+    epoch_exit(&epoch);
+    st->rebuilds = atomic_load(&rebuilds);
+    return 0;
+}
@@ -0,0 +1,763 @@
+#define _GNU_SOURCE
+#include "logstore.h"
+#include "crc32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SEG_SUFFIX ".log"
+#define COMPACT_INTERVAL_SEC 10
+/* sealed segments with less than this share of live bytes get rewritten */
+#define COMPACT_LIVE_RATIO 0.5
+#define TOMBSTONE UINT32_MAX
+/* sanity bounds for records found on disk */
+#define KEY_MAX (1u << 16)
+#define VALUE_MAX (1u << 30)
+
+/* A record on disk, in host byte order (segments don't move between
+ * machines), followed by the key and, unless it is a tombstone, the
+ * value. crc covers everything after itself. */
+typedef struct {
+    uint32_t crc;
+    uint32_t klen;
+    uint32_t vlen;     /* TOMBSTONE for a delete */
+    uint32_t pad;
+    int64_t expires;   /* unix seconds, 0 = never */
+} rec_hdr_t;
+
+typedef struct {
+    uint32_t id;
+    int fd;
+    uint64_t size;     /* guarded by wlock */
+    uint64_t live;     /* bytes the index points at; guarded by idx_lock */
+    atomic_int refs;   /* readers in a pread */
+} seg_t;
+
+typedef struct {
+    char *key;         /* NULL = empty slot */
+    uint64_t hash;
+    seg_t *seg;
+    uint64_t off;
+    uint32_t len;      /* whole record */
+    int64_t expires;
+} entry_t;
+
+/* Writers (put, delete, purge, compaction) serialize on wlock, which also
+ * guards the segment list and the active segment. The index changes only
+ * under wlock plus idx_lock for writing, so writers can read it with
+ * wlock alone; readers take idx_lock for reading. */
+static pthread_mutex_t wlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t idx_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static char *dir_path;
+static size_t seg_bytes;
+static unsigned fsync_every_ms;
+static seg_t **segs;       /* oldest first; the last one is active */
+static size_t n_segs, cap_segs;
+static uint64_t write_seq; /* bytes ever appended, guarded by wlock */
+static size_t purge_pos;   /* guarded by wlock */
+
+static entry_t *table;
+static size_t table_mask, n_keys;
+
+/* durability, guarded by sync_lock */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static int syncing;
+static uint64_t synced_seq;
+
+static pthread_t maint;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static int stop_requested, running;
+static atomic_int stopping;  /* stop_requested, readable without stop_lock */
+
+static _Atomic uint64_t n_appends, n_fsyncs, n_compactions, reclaimed;
+
+/* FNV-1a */
+static uint64_t key_hash(const char *key, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int expired(const entry_t *e, int64_t now) {
+    return e->expires && e->expires <= now;
+}
+
+/* ---- index: linear probing, backward-shift delete ---- */
+
+static size_t idx_find(uint64_t h, const char *key, size_t klen) {
+    for (size_t i = h & table_mask;; i = (i + 1) & table_mask) {
+        const entry_t *e = &table[i];
+        if (!e->key) return SIZE_MAX;
+        if (e->hash == h && strncmp(e->key, key, klen) == 0 && e->key[klen] == '\0') return i;
+    }
+}
+
+static void idx_remove(size_t i) {
+    table[i].seg->live -= table[i].len;
+    free(table[i].key);
+    n_keys--;
+    for (size_t j = i;;) {
+        table[i].key = NULL;
+        for (;;) {
+            j = (j + 1) & table_mask;
+            if (!table[j].key) return;
+            size_t home = table[j].hash & table_mask;
+            /* move j back into the hole unless its home lies in (i, j] */
+            if (((j - home) & table_mask) >= ((j - i) & table_mask)) break;
+        }
+        table[i] = table[j];
+        i = j;
+    }
+}
+
+static int idx_grow(void) {
+    size_t old_size = table_mask + 1;
+    entry_t *old = table;
+    entry_t *t = calloc(old_size * 2, sizeof(*t));
+    if (!t) return -1;
+    table = t;
+    table_mask = old_size * 2 - 1;
+    for (size_t i = 0; i < old_size; ++i) {
+        if (!old[i].key) continue;
+        size_t j = old[i].hash & table_mask;
+        while (table[j].key) j = (j + 1) & table_mask;
+        table[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* Point key at a new record */
+static int idx_set(const char *key, size_t klen, uint64_t h, seg_t *seg, uint64_t off, uint32_t len,
+                   int64_t expires) {
+    size_t i = idx_find(h, key, klen);
+    if (i == SIZE_MAX) {
+        if ((n_keys + 1) * 10 > (table_mask + 1) * 7 && idx_grow() != 0) return -1;
+        char *copy = malloc(klen + 1);
+        if (!copy) return -1;
+        memcpy(copy, key, klen);
+        copy[klen] = '\0';
+        for (i = h & table_mask; table[i].key; i = (i + 1) & table_mask) {}
+        table[i].key = copy;
+        table[i].hash = h;
+        n_keys++;
+    } else {
+        table[i].seg->live -= table[i].len;
+    }
+    table[i].seg = seg;
+    table[i].off = off;
+    table[i].len = len;
+    table[i].expires = expires;
+    seg->live += len;
+    return 0;
+}
+
+/* ---- segments ---- */
+
+static char *seg_path(uint32_t id) {
+    char *p;
+    if (asprintf(&p, "%s/%08u" SEG_SUFFIX, dir_path, id) < 0) return NULL;
+    return p;
+}
+
+static seg_t *seg_open(uint32_t id, int create) {
+    char *path = seg_path(id);
+    if (!path) return NULL;
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    free(path);
+    if (fd < 0) return NULL;
+    struct stat st;
+    seg_t *s = calloc(1, sizeof(*s));
+    if (!s || fstat(fd, &st) != 0) {
+        free(s);
+        close(fd);
+        return NULL;
+    }
+    s->id = id;
+    s->fd = fd;
+    s->size = (uint64_t)st.st_size;
+    atomic_init(&s->refs, 0);
+    return s;
+}
+
+static int segs_push(seg_t *s) {
+    if (n_segs == cap_segs) {
+        size_t cap = cap_segs ? cap_segs * 2 : 16;
+        seg_t **n = realloc(segs, cap * sizeof(*n));
+        if (!n) return -1;
+        segs = n;
+        cap_segs = cap;
+    }
+    segs[n_segs++] = s;
+    return 0;
+}
+
+static void seg_free(seg_t *s, int unlink_file) {
+    /* readers hold a reference only across one pread */
+    while (atomic_load(&s->refs) > 0) sched_yield();
+    close(s->fd);
+    if (unlink_file) {
+        char *path = seg_path(s->id);
+        if (path) unlink(path);
+        free(path);
+    }
+    free(s);
+}
+
+/* Caller holds wlock. Seal the active segment (synced, so everything
+ * before the new one is durable) and start the next. */
+static int rotate(void) {
+    seg_t *cur = segs[n_segs - 1];
+    if (fdatasync(cur->fd) != 0) return -1;
+    atomic_fetch_add(&n_fsyncs, 1);
+    seg_t *next = seg_open(cur->id + 1, 1);
+    if (!next) return -1;
+    if (segs_push(next) != 0) {
+        seg_free(next, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/* Caller holds wlock. Appends one encoded record to the active segment. */
+static int append_locked(const void *rec, size_t len, seg_t **seg, uint64_t *off) {
+    seg_t *s = segs[n_segs - 1];
+    if (s->size > 0 && s->size + len > seg_bytes) {
+        if (rotate() != 0) return -1;
+        s = segs[n_segs - 1];
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(s->fd, (const char *)rec + done, len - done, (off_t)(s->size + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            /* a half-written record would stop the scan at startup */
+            if (ftruncate(s->fd, (off_t)s->size) != 0) {}
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    *seg = s;
+    *off = s->size;
+    s->size += len;
+    write_seq += len;
+    atomic_fetch_add(&n_appends, 1);
+    return 0;
+}
+
+static void *encode(const char *key, size_t klen, const char *value, uint32_t vlen, int64_t expires,
+                    size_t *len) {
+    size_t vbytes = vlen == TOMBSTONE ? 0 : vlen;
+    *len = sizeof(rec_hdr_t) + klen + vbytes;
+    char *buf = malloc(*len);
+    if (!buf) return NULL;
+    rec_hdr_t h = { 0, (uint32_t)klen, vlen, 0, expires };
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), key, klen);
+    if (vbytes) memcpy(buf + sizeof(h) + klen, value, vbytes);
+    h.crc = crc32_update(0, buf + sizeof(uint32_t), *len - sizeof(uint32_t));
+    memcpy(buf, &h.crc, sizeof(h.crc));
+    return buf;
+}
+
+/* Length of the valid record at p (at most avail bytes), 0 if there is
+ * none: a torn or corrupt tail */
+static size_t decode(const char *p, size_t avail, rec_hdr_t *h) {
+    if (avail < sizeof(*h)) return 0;
+    memcpy(h, p, sizeof(*h));
+    if (h->klen == 0 || h->klen > KEY_MAX) return 0;
+    if (h->vlen != TOMBSTONE && h->vlen > VALUE_MAX) return 0;
+    size_t len = sizeof(*h) + h->klen + (h->vlen == TOMBSTONE ? 0 : h->vlen);
+    if (len > avail) return 0;
+    if (crc32_update(0, p + sizeof(uint32_t), len - sizeof(uint32_t)) != h->crc) return 0;
+    return len;
+}
+
+/* ---- durability ---- */
+
+/* Returns once everything up to seq is on disk; seq 0 = whatever has been
+ * written so far. One caller syncs, the ones arriving meanwhile wait and
+ * are usually covered by the next sync. */
+static void sync_to(uint64_t seq) {
+    pthread_mutex_lock(&sync_lock);
+    int once = seq == 0;
+    while (once || synced_seq < seq) {
+        if (syncing) {
+            pthread_cond_wait(&sync_cond, &sync_lock);
+            continue;
+        }
+        syncing = 1;
+        pthread_mutex_unlock(&sync_lock);
+        /* sealed segments were synced when they were sealed */
+        pthread_mutex_lock(&wlock);
+        seg_t *s = segs[n_segs - 1];
+        uint64_t target = write_seq;
+        atomic_fetch_add(&s->refs, 1);
+        pthread_mutex_unlock(&wlock);
+        int rc = fdatasync(s->fd);
+        atomic_fetch_sub(&s->refs, 1);
+        atomic_fetch_add(&n_fsyncs, 1);
+        pthread_mutex_lock(&sync_lock);
+        syncing = 0;
+        if (rc == 0 && target > synced_seq) synced_seq = target;
+        pthread_cond_broadcast(&sync_cond);
+        if (rc != 0) {
+            fprintf(stderr, "logstore: fdatasync failed: %s\n", strerror(errno));
+            break;
+        }
+        once = 0;
+    }
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/* ---- compaction ---- */
+
+/* Caller holds wlock */
+static int has_older(const seg_t *s) {
+    return n_segs > 0 && segs[0] != s;
+}
+
+/* Rewrites the live records of the sealed segment with the least live
+ * data, if it is below COMPACT_LIVE_RATIO, then removes it. Returns 1 if
+ * a segment went away. */
+static int compact_one(void) {
+    pthread_mutex_lock(&wlock);
+    seg_t *cand = NULL;
+    pthread_rwlock_rdlock(&idx_lock);
+    for (size_t i = 0; i + 1 < n_segs; ++i) {
+        seg_t *s = segs[i];
+        if (s->size && (double)s->live >= (double)s->size * COMPACT_LIVE_RATIO) continue;
+        if (!cand || s->live * cand->size < cand->live * s->size) cand = s;
+    }
+    pthread_rwlock_unlock(&idx_lock);
+    pthread_mutex_unlock(&wlock);
+    if (!cand) return 0;
+
+    /* sealed, so nothing writes to it any more */
+    char *map = NULL;
+    if (cand->size) {
+        map = mmap(NULL, cand->size, PROT_READ, MAP_PRIVATE, cand->fd, 0);
+        if (map == MAP_FAILED) return 0;
+    }
+    int64_t now = (int64_t)time(NULL);
+    size_t off = 0, len;
+    rec_hdr_t h;
+    while (off < cand->size && (len = decode(map + off, cand->size - off, &h)) > 0) {
+        const char *key = map + off + sizeof(h);
+        uint64_t hash = key_hash(key, h.klen);
+        pthread_mutex_lock(&wlock);
+        size_t i = idx_find(hash, key, h.klen);
+        seg_t *seg;
+        uint64_t at;
+        if (h.vlen == TOMBSTONE) {
+            /* still needed only while an older segment could hold a put
+             * it cancels, and only if the key wasn't written again */
+            if (i == SIZE_MAX && has_older(cand)) append_locked(map + off, len, &seg, &at);
+        } else {
+            int mine = i != SIZE_MAX && table[i].seg == cand && table[i].off == off;
+            int dead = h.expires && h.expires <= now;
+            if (mine && !dead) {
+                pthread_rwlock_wrlock(&idx_lock);
+                if (append_locked(map + off, len, &seg, &at) == 0)
+                    idx_set(key, h.klen, hash, seg, at, (uint32_t)len, h.expires);
+                pthread_rwlock_unlock(&idx_lock);
+            } else if (dead && (mine || i == SIZE_MAX)) {
+                if (mine) {
+                    pthread_rwlock_wrlock(&idx_lock);
+                    idx_remove(i);
+                    pthread_rwlock_unlock(&idx_lock);
+                }
+                /* at startup the expired put hides an earlier put of the
+                 * key in an older segment; without it that one would come
+                 * back, so a tombstone takes its place */
+                size_t tlen;
+                void *tomb = has_older(cand) ? encode(key, h.klen, NULL, TOMBSTONE, 0, &tlen) : NULL;
+                if (tomb) append_locked(tomb, tlen, &seg, &at);
+                free(tomb);
+            }
+        }
+        pthread_mutex_unlock(&wlock);
+        off += len;
+    }
+    if (map) munmap(map, cand->size);
+
+    /* anything still pointing here (an append that failed) keeps it */
+    pthread_mutex_lock(&wlock);
+    uint64_t seq = write_seq;
+    pthread_mutex_unlock(&wlock);
+    sync_to(seq);
+    pthread_mutex_lock(&wlock);
+    pthread_rwlock_rdlock(&idx_lock);
+    int still_live = cand->live != 0;
+    pthread_rwlock_unlock(&idx_lock);
+    if (still_live) {
+        pthread_mutex_unlock(&wlock);
+        return 0;
+    }
+    size_t i = 0;
+    while (segs[i] != cand) ++i;
+    memmove(&segs[i], &segs[i + 1], (n_segs - i - 1) * sizeof(*segs));
+    n_segs--;
+    pthread_mutex_unlock(&wlock);
+    atomic_fetch_add(&reclaimed, cand->size);
+    atomic_fetch_add(&n_compactions, 1);
+    seg_free(cand, 1);
+    return 1;
+}
+
+static void *maint_main(void *arg) {
+    (void)arg;
+    unsigned tick_ms = fsync_every_ms ? fsync_every_ms : 1000;
+    time_t last_compact = time(NULL);
+    pthread_mutex_lock(&stop_lock);
+    while (!stop_requested) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += tick_ms / 1000;
+        ts.tv_nsec += (long)(tick_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&stop_cond, &stop_lock, &ts);
+        if (stop_requested) break;
+        pthread_mutex_unlock(&stop_lock);
+        if (fsync_every_ms) sync_to(0);
+        if (time(NULL) - last_compact >= COMPACT_INTERVAL_SEC) {
+            while (!atomic_load(&stopping) && compact_one()) {}
+            last_compact = time(NULL);
+        }
+        pthread_mutex_lock(&stop_lock);
+    }
+    pthread_mutex_unlock(&stop_lock);
+    return NULL;
+}
+
+/* ---- open / close ---- */
+
+static int by_id(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Replay one segment into the index. A bad record ends the scan; at the
+ * tail of the newest segment that is a torn append and gets cut off. */
+static void load_segment(seg_t *s, int newest, int64_t now) {
+    if (!s->size) return;
+    char *map = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, s->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "logstore: cannot map segment %u: %s\n", s->id, strerror(errno));
+        return;
+    }
+    madvise(map, s->size, MADV_SEQUENTIAL);
+    size_t off = 0, len;
+    rec_hdr_t h;
+    while (off < s->size && (len = decode(map + off, s->size - off, &h)) > 0) {
+        const char *key = map + off + sizeof(h);
+        uint64_t hash = key_hash(key, h.klen);
+        if (h.vlen == TOMBSTONE || (h.expires && h.expires <= now)) {
+            size_t i = idx_find(hash, key, h.klen);
+            if (i != SIZE_MAX) idx_remove(i);
+        } else {
+            idx_set(key, h.klen, hash, s, off, (uint32_t)len, h.expires);
+        }
+        off += len;
+    }
+    munmap(map, s->size);
+    if (off == s->size) return;
+    if (newest) {
+        fprintf(stderr, "logstore: cutting %llu torn bytes off segment %u\n",
+                (unsigned long long)(s->size - off), s->id);
+        if (ftruncate(s->fd, (off_t)off) == 0) s->size = off;
+    } else {
+        fprintf(stderr, "logstore: segment %u is corrupt after byte %zu, skipping the rest\n",
+                s->id, off);
+    }
+}
+
+static void free_all(void) {
+    for (size_t i = 0; i < n_segs; ++i) seg_free(segs[i], 0);
+    free(segs);
+    segs = NULL;
+    n_segs = cap_segs = 0;
+    if (table) {
+        for (size_t i = 0; i <= table_mask; ++i) free(table[i].key);
+    }
+    free(table);
+    table = NULL;
+    n_keys = 0;
+    free(dir_path);
+    dir_path = NULL;
+}
+
+int logstore_open(const char *dir, size_t segment_bytes, unsigned fsync_ms) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "logstore: cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "logstore: cannot open %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    dir_path = strdup(dir);
+    seg_bytes = segment_bytes ? segment_bytes : 64u << 20;
+    fsync_every_ms = fsync_ms;
+    table_mask = 1023;
+    table = calloc(table_mask + 1, sizeof(*table));
+    uint32_t *ids = NULL;
+    size_t n_ids = 0, cap_ids = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned id;
+        char suffix[8];
+        if (sscanf(de->d_name, "%8u%7s", &id, suffix) != 2 || strcmp(suffix, SEG_SUFFIX) != 0) continue;
+        if (n_ids == cap_ids) {
+            cap_ids = cap_ids ? cap_ids * 2 : 16;
+            uint32_t *n = realloc(ids, cap_ids * sizeof(*ids));
+            if (!n) break;
+            ids = n;
+        }
+        ids[n_ids++] = id;
+    }
+    closedir(d);
+    if (!dir_path || !table) goto fail;
+    qsort(ids, n_ids, sizeof(*ids), by_id);
+
+    int64_t now = (int64_t)time(NULL);
+    for (size_t i = 0; i < n_ids; ++i) {
+        seg_t *s = seg_open(ids[i], 0);
+        if (!s || segs_push(s) != 0) {
+            fprintf(stderr, "logstore: cannot open segment %u\n", ids[i]);
+            if (s) seg_free(s, 0);
+            goto fail;
+        }
+        load_segment(s, i + 1 == n_ids, now);
+    }
+    if (n_segs == 0) {
+        seg_t *s = seg_open(1, 1);
+        if (!s || segs_push(s) != 0) goto fail;
+    }
+    free(ids);
+    ids = NULL;
+    write_seq = synced_seq = 0;
+    purge_pos = 0;
+    stop_requested = 0;
+    atomic_store(&stopping, 0);
+    if (pthread_create(&maint, NULL, maint_main, NULL) != 0) goto fail;
+    running = 1;
+    printf("logstore: %zu keys in %zu segments under %s\n", n_keys, n_segs, dir);
+    return 0;
+fail:
+    free(ids);
+    free_all();
+    return -1;
+}
+
+void logstore_close(void) {
+    if (!running) return;
+    pthread_mutex_lock(&stop_lock);
+    stop_requested = 1;
+    atomic_store(&stopping, 1);
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&stop_lock);
+    pthread_join(maint, NULL);
+    sync_to(0);
+    /* under both locks, so a scan or read that comes late finds no table
+     * rather than a freed one */
+    pthread_mutex_lock(&wlock);
+    running = 0;
+    pthread_rwlock_wrlock(&idx_lock);
+    free_all();
+    pthread_rwlock_unlock(&idx_lock);
+    pthread_mutex_unlock(&wlock);
+}
+
+/* ---- operations ---- */
+
+int logstore_get(const char *key, char **out_value, long *ttl_left) {
+    size_t klen = strlen(key);
+    uint64_t h = key_hash(key, klen);
+    int64_t now = (int64_t)time(NULL);
+    pthread_rwlock_rdlock(&idx_lock);
+    size_t i = table ? idx_find(h, key, klen) : SIZE_MAX;
+    if (i == SIZE_MAX || expired(&table[i], now)) {
+        pthread_rwlock_unlock(&idx_lock);
+        return -1;
+    }
+    entry_t e = table[i];
+    atomic_fetch_add(&e.seg->refs, 1);
+    pthread_rwlock_unlock(&idx_lock);
+
+    char *buf = malloc(e.len);
+    ssize_t n = buf ? pread(e.seg->fd, buf, e.len, (off_t)e.off) : -1;
+    atomic_fetch_sub(&e.seg->refs, 1);
+    rec_hdr_t hdr;
+    if (n != (ssize_t)e.len || decode(buf, e.len, &hdr) != e.len || hdr.vlen == TOMBSTONE) {
+        fprintf(stderr, "logstore: bad record for %s in segment %u\n", key, e.seg->id);
+        free(buf);
+        return -1;
+    }
+    /* the value moves to the front of the buffer, which becomes the result */
+    memmove(buf, buf + sizeof(hdr) + hdr.klen, hdr.vlen);
+    buf[hdr.vlen] = '\0';
+    if (ttl_left) *ttl_left = e.expires ? (e.expires - now > 0 ? e.expires - now : 1) : 0;
+    *out_value = buf;
+    return 0;
+}
+
+int logstore_put(const char *key, const char *value, long ttl_sec) {
+    size_t klen = strlen(key), vlen = strlen(value);
+    if (klen == 0 || klen > KEY_MAX || vlen > VALUE_MAX) return -1;
+    int64_t expires = ttl_sec > 0 ? (int64_t)time(NULL) + ttl_sec : 0;
+    size_t len;
+    void *rec = encode(key, klen, value, (uint32_t)vlen, expires, &len);
+    if (!rec) return -1;
+    uint64_t h = key_hash(key, klen);
+    seg_t *seg;
+    uint64_t off;
+    pthread_mutex_lock(&wlock);
+    if (!running || append_locked(rec, len, &seg, &off) != 0) {
+        pthread_mutex_unlock(&wlock);
+        free(rec);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&idx_lock);
+    int rc = idx_set(key, klen, h, seg, off, (uint32_t)len, expires);
+    pthread_rwlock_unlock(&idx_lock);
+    uint64_t seq = write_seq;
+    pthread_mutex_unlock(&wlock);
+    free(rec);
+    if (rc == 0 && fsync_every_ms == 0) sync_to(seq);
+    return rc;
+}
+
+int logstore_delete(const char *key) {
+    size_t klen = strlen(key);
+    uint64_t h = key_hash(key, klen);
+    pthread_mutex_lock(&wlock);
+    size_t i = running ? idx_find(h, key, klen) : SIZE_MAX;
+    if (i == SIZE_MAX || expired(&table[i], (int64_t)time(NULL))) {
+        pthread_mutex_unlock(&wlock);
+        return -1;
+    }
+    size_t len;
+    void *rec = encode(key, klen, NULL, TOMBSTONE, 0, &len);
+    seg_t *seg;
+    uint64_t off;
+    if (!rec || append_locked(rec, len, &seg, &off) != 0) {
+        pthread_mutex_unlock(&wlock);
+        free(rec);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&idx_lock);
+    idx_remove(i);
+    pthread_rwlock_unlock(&idx_lock);
+    uint64_t seq = write_seq;
+    pthread_mutex_unlock(&wlock);
+    free(rec);
+    if (fsync_every_ms == 0) sync_to(seq);
+    return 0;
+}
+
+long logstore_purge_expired(int batch) {
+    int64_t now = (int64_t)time(NULL);
+    long n = 0;
+    pthread_mutex_lock(&wlock);
+    if (!running) {
+        pthread_mutex_unlock(&wlock);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&idx_lock);
+    /* resume where the last call stopped so a full batch doesn't make
+     * the next call rescan the same slots */
+    size_t size = table_mask + 1;
+    for (size_t seen = 0; seen < size && n < batch; ++seen) {
+        size_t i = (purge_pos + seen) & table_mask;
+        /* the backward shift may pull another expired entry into i */
+        while (table[i].key && expired(&table[i], now) && n < batch) {
+            idx_remove(i);
+            n++;
+        }
+        if (n == batch) {
+            purge_pos = i;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&idx_lock);
+    pthread_mutex_unlock(&wlock);
+    return n;
+}
+
+long logstore_scan_keys(int (*cb)(const char *key, void *arg), void *arg) {
+    int64_t now = (int64_t)time(NULL);
+    pthread_rwlock_rdlock(&idx_lock);
+    if (!table) {
+        pthread_rwlock_unlock(&idx_lock);
+        return -1;
+    }
+    size_t bytes = 0;
+    for (size_t i = 0; i <= table_mask; ++i)
+        if (table[i].key) bytes += strlen(table[i].key) + 1;
+    char *keys = malloc(bytes ? bytes : 1), *p = keys;
+    if (!keys) {
+        pthread_rwlock_unlock(&idx_lock);
+        return -1;
+    }
+    for (size_t i = 0; i <= table_mask; ++i) {
+        if (!table[i].key || expired(&table[i], now)) continue;
+        size_t l = strlen(table[i].key) + 1;
+        memcpy(p, table[i].key, l);
+        p += l;
+    }
+    pthread_rwlock_unlock(&idx_lock);
+    long n = 0;
+    for (char *k = keys; k < p; k += strlen(k) + 1) {
+        if (cb(k, arg) != 0) {
+            n = -1;
+            break;
+        }
+        n++;
+    }
+    free(keys);
+    return n;
+}
+
+int logstore_get_stats(logstore_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&wlock);
+    if (!running) {
+        pthread_mutex_unlock(&wlock);
+        return -1;
+    }
+    pthread_rwlock_rdlock(&idx_lock);
+    st->keys = n_keys;
+    st->segments = n_segs;
+    for (size_t i = 0; i < n_segs; ++i) {
+        st->disk_bytes += segs[i]->size;
+        st->live_bytes += segs[i]->live;
+    }
+    pthread_rwlock_unlock(&idx_lock);
+    pthread_mutex_unlock(&wlock);
+    st->compactions = atomic_load(&n_compactions);
+    st->reclaimed_bytes = atomic_load(&reclaimed);
+    st->appends = atomic_load(&n_appends);
+    st->fsyncs = atomic_load(&n_fsyncs);
+    st->fsync_ms = fsync_every_ms;
+    return 0;
+}
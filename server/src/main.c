@@ -3,17 +3,103 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 #include "cache.h"
 #include "http_server.h"
+#include "key_filter.h"
+#include "hotkeys.h"
+#include "group_commit.h"
+#include "storage.h"
+
+#define TTL_PURGE_BATCH 1000
+/* requests per hot-key sample, and read copies for keys past --hot-key-rps */
+#define HOTKEYS_SAMPLE 16
+#define HOT_KEY_REPLICAS 8
+/* threads applying write batches; more than one keeps a slow commit from
+ * holding up the next batch */
+#define GROUP_COMMIT_FLUSHERS 2
 
 static volatile int keep_running = 1;
 void int_handler(int dummy) { keep_running = 0; }
 
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [cache_capacity] [threads] [--cache-shards N] [--cache-hugepages]\n"
+        "          [--cache-bytes SIZE] [--cache-max-entry SIZE] [--cache-policy clock|tinylfu]\n"
+        "          [--cache-l1 N] [--cache-compress SIZE] [--snapshot PATH] [--snapshot-max-age SECS]\n"
+        "          [--bloom-fpr P] [--bloom-keys N] [--ttl-purge-interval SECS]\n"
+        "          [--hot-keys K] [--hot-key-rps R] [--db CONNINFO] [--db-pool N]\n"
+        "          [--db-replica CONNINFO]... [--replica-max-lag MS]\n"
+        "          [--db-mode sync|pipeline] [--group-commit N] [--group-commit-window USECS]\n"
+        "          [--storage postgres|log] [--log-dir PATH] [--log-segment SIZE] [--log-fsync MS]\n"
+        "          [--write-back DIR] [--write-back-batch N] [--coherence]\n"
+        "Defaults: cache_capacity=1000 threads=16 cache-shards=%d cache-max-entry=1M cache-policy=clock cache-l1=0 (off) cache-compress=0 (off) snapshot-max-age=3600\n"
+        "          bloom filter off unless --bloom-fpr is given (e.g. 0.01), bloom-keys=1000000\n"
+        "          ttl-purge-interval=10 (0 = never delete expired rows)\n"
+        "          hot-keys=128 (0 = off) hot-key-rps=0 (no hot key replication) db-pool=8 db-mode=sync\n"
+        "          db=kvdb on localhost:5432, no replicas (up to %d, each with db-pool connections) replica-max-lag=1000\n"
+        "          group-commit=64 (0 = one transaction per write) group-commit-window=100\n"
+        "          storage=postgres log-dir=kvlog log-segment=64M log-fsync=0 (sync before every reply)\n"
+        "          write-back off (writes commit to storage before the reply) write-back-batch=1000\n"
+        "          coherence off (--coherence follows other servers' writes, postgres only)\n"
+        "SIZE takes an optional K, M or G suffix; cache_capacity 0 = bounded by bytes only\n",
+        prog, LRU_CACHE_DEFAULT_SHARDS, DB_MAX_REPLICAS);
+}
+
+/* "512", "64K", "256M", "2G" -> bytes; returns -1 on junk */
+static int parse_size(const char *s, size_t *out) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s) return -1;
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0') return -1;
+    *out = (size_t)v;
+    return 0;
+}
+
+/* Hot keys get per-thread read copies in the cache */
+static void replicate_hot(const char *key, void *arg) {
+    lru_cache_replicate((lru_cache_t *)arg, key);
+}
+
 int main(int argc, char **argv) {
     int port = 8080;
     int threads = 16;
     size_t cache_capacity = 1000;
+    size_t cache_shards = LRU_CACHE_DEFAULT_SHARDS;
+    int cache_hugepages = 0;
+    size_t cache_bytes = 0;
+    size_t cache_max_entry = 1 << 20;
+    lru_cache_policy_t cache_policy = LRU_POLICY_CLOCK;
+    size_t cache_l1 = 0;
+    size_t cache_compress = 0;
+    const char *snapshot_path = NULL;
+    unsigned snapshot_max_age = 3600;
+    double bloom_fpr = 0.0;
+    size_t bloom_keys = 1000000;
+    unsigned ttl_purge_interval = 10;
+    size_t hot_keys = 128;
+    double hot_key_rps = 0.0;
+    int db_pool = 8;
+    db_mode_t db_mode = DB_MODE_SYNC;
+    size_t group_commit = 64;
+    unsigned group_commit_window = 100;
     const char *db_conninfo = "host=localhost port=5432 dbname=kvdb user=kvuser password=kvpass";
+    const char *db_replicas[DB_MAX_REPLICAS];
+    size_t n_db_replicas = 0;
+    unsigned replica_max_lag = 1000;
+    const storage_backend_t *backend = &storage_postgres;
+    const char *log_dir = "kvlog";
+    size_t log_segment = 64u << 20;
+    unsigned log_fsync = 0;
+    const char *wal_dir = NULL;
+    size_t wal_batch = 1000;
+    int coherence = 0;
 
     // if (argc >= 2) port = atoi(argv[1]);
     // if (argc >= 3) cache_capacity = atoi(argv[2]);
@@ -22,28 +108,179 @@ int main(int argc, char **argv) {
     if (argc >= 2) cache_capacity = atoi(argv[1]);
     if (argc >= 3) threads = atoi(argv[2]);
 
+    /* optional tuning flags follow the positional arguments */
+    for (int i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "--cache-shards") == 0 && i+1 < argc) {
+            cache_shards = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-hugepages") == 0) {
+            cache_hugepages = 1;
+        } else if (strcmp(argv[i], "--cache-bytes") == 0 && i+1 < argc) {
+            if (parse_size(argv[++i], &cache_bytes) != 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--cache-max-entry") == 0 && i+1 < argc) {
+            if (parse_size(argv[++i], &cache_max_entry) != 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--cache-policy") == 0 && i+1 < argc) {
+            const char *p = argv[++i];
+            if (strcmp(p, "clock") == 0) cache_policy = LRU_POLICY_CLOCK;
+            else if (strcmp(p, "tinylfu") == 0) cache_policy = LRU_POLICY_TINYLFU;
+            else { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--cache-l1") == 0 && i+1 < argc) {
+            cache_l1 = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-compress") == 0 && i+1 < argc) {
+            if (parse_size(argv[++i], &cache_compress) != 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i+1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot-max-age") == 0 && i+1 < argc) {
+            snapshot_max_age = (unsigned)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--bloom-fpr") == 0 && i+1 < argc) {
+            bloom_fpr = atof(argv[++i]);
+            if (bloom_fpr <= 0.0 || bloom_fpr >= 1.0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--bloom-keys") == 0 && i+1 < argc) {
+            bloom_keys = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--ttl-purge-interval") == 0 && i+1 < argc) {
+            ttl_purge_interval = (unsigned)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--hot-keys") == 0 && i+1 < argc) {
+            hot_keys = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--hot-key-rps") == 0 && i+1 < argc) {
+            hot_key_rps = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--db") == 0 && i+1 < argc) {
+            db_conninfo = argv[++i];
+        } else if (strcmp(argv[i], "--db-replica") == 0 && i+1 < argc) {
+            if (n_db_replicas == DB_MAX_REPLICAS) { usage(argv[0]); return 1; }
+            db_replicas[n_db_replicas++] = argv[++i];
+        } else if (strcmp(argv[i], "--replica-max-lag") == 0 && i+1 < argc) {
+            replica_max_lag = (unsigned)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--db-pool") == 0 && i+1 < argc) {
+            db_pool = atoi(argv[++i]);
+            if (db_pool < 1) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--db-mode") == 0 && i+1 < argc) {
+            const char *m = argv[++i];
+            if (strcmp(m, "sync") == 0) db_mode = DB_MODE_SYNC;
+            else if (strcmp(m, "pipeline") == 0) db_mode = DB_MODE_PIPELINE;
+            else { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--group-commit") == 0 && i+1 < argc) {
+            group_commit = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--group-commit-window") == 0 && i+1 < argc) {
+            group_commit_window = (unsigned)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--storage") == 0 && i+1 < argc) {
+            backend = storage_find(argv[++i]);
+            if (!backend) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--log-dir") == 0 && i+1 < argc) {
+            log_dir = argv[++i];
+        } else if (strcmp(argv[i], "--log-segment") == 0 && i+1 < argc) {
+            if (parse_size(argv[++i], &log_segment) != 0 || log_segment == 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--log-fsync") == 0 && i+1 < argc) {
+            log_fsync = (unsigned)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--write-back") == 0 && i+1 < argc) {
+            wal_dir = argv[++i];
+        } else if (strcmp(argv[i], "--write-back-batch") == 0 && i+1 < argc) {
+            wal_batch = (size_t)atol(argv[++i]);
+            if (wal_batch == 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--coherence") == 0) {
+            coherence = 1;
+        } else {
+            fprintf(stderr, "Unknown arg: %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (coherence && backend != &storage_postgres) {
+        fprintf(stderr, "--coherence needs --storage postgres\n");
+        return 1;
+    }
+    if (n_db_replicas && backend != &storage_postgres) {
+        fprintf(stderr, "--db-replica needs --storage postgres\n");
+        return 1;
+    }
+
     signal(SIGINT, int_handler);
     signal(SIGTERM, int_handler);
 
-    lru_cache_t *cache = lru_cache_create(cache_capacity);
+    lru_cache_config_t cache_cfg = {
+        .capacity = cache_capacity,
+        .max_bytes = cache_bytes,
+        .max_entry_bytes = cache_max_entry,
+        .n_shards = cache_shards,
+        .hugepages = cache_hugepages,
+        .policy = cache_policy,
+        .l1_size = cache_l1,
+        .compress_min = cache_compress,
+        .hot_replicas = hot_keys && hot_key_rps > 0 ? HOT_KEY_REPLICAS : 0,
+    };
+    lru_cache_t *cache = lru_cache_create_with(&cache_cfg);
     if (!cache) {
         fprintf(stderr, "Failed to create cache\n");
         return 1;
     }
 
-    if (http_server_start(port, cache, db_conninfo, threads) != 0) {
+    /* warm the cache before the first request can miss */
+    if (snapshot_path && coherence) {
+        /* other servers may have written while we were down */
+        printf("Not loading %s: a snapshot can't be trusted with --coherence\n", snapshot_path);
+    } else if (snapshot_path) {
+        long n = lru_cache_load(cache, snapshot_path, snapshot_max_age);
+        if (n >= 0) printf("Loaded %ld cache entries from %s\n", n, snapshot_path);
+        else printf("No usable cache snapshot at %s, starting cold\n", snapshot_path);
+    }
+
+    storage_config_t storage_cfg = {
+        .conninfo = db_conninfo,
+        .db_conns = db_pool,
+        .db_mode = db_mode,
+        .db_replicas = db_replicas,
+        .n_db_replicas = n_db_replicas,
+        .replica_max_lag_ms = replica_max_lag,
+        .log_dir = log_dir,
+        .log_segment_bytes = log_segment,
+        .log_fsync_ms = log_fsync,
+    };
+    if (http_server_start(port, cache, threads, backend, &storage_cfg, wal_dir, wal_batch, coherence) != 0) {
         fprintf(stderr, "Failed to start http server\n");
         lru_cache_destroy(cache);
         return 1;
     }
 
+    /* in write-back mode the WAL applier batches writes instead, and the
+     * log backend has nothing to combine: its fsync is already shared by
+     * every writer, which flusher threads would cut down to a few */
+    if (!wal_dir && storage_backend()->write_batch &&
+        group_commit_start(group_commit, group_commit_window, GROUP_COMMIT_FLUSHERS) != 0)
+        fprintf(stderr, "Failed to start group commit, writing one transaction per request\n");
+
+    /* built in the background; lookups pass through until it is ready */
+    if (bloom_fpr > 0.0 && key_filter_start(bloom_keys, bloom_fpr) != 0)
+        fprintf(stderr, "Failed to start key filter, continuing without it\n");
+
+    if (hot_keys && hotkeys_start(hot_keys, HOTKEYS_SAMPLE, hot_key_rps, replicate_hot, cache) != 0)
+        fprintf(stderr, "Failed to start hot key tracking, continuing without it\n");
+
     printf("Server running. Press Ctrl-C to stop.\n");
+    time_t last_purge = time(NULL);
     while (keep_running) {
         sleep(1);
+        if (!ttl_purge_interval || time(NULL) - last_purge < ttl_purge_interval) continue;
+        /* expired rows are already invisible; this just reclaims them, a
+         * batch at a time so the purge never holds storage for long */
+        long n;
+        do {
+            n = storage_purge_expired(TTL_PURGE_BATCH);
+            for (long i = 0; i < n; ++i) key_filter_note_delete();
+        } while (n == TTL_PURGE_BATCH && keep_running);
+        last_purge = time(NULL);
     }
 
     printf("Shutting down...\n");
+    /* drains queued writes; stragglers go to the DB directly until the
+     * workers stop */
+    group_commit_stop();
     http_server_stop();
+    hotkeys_stop();
+    /* its builder may be scanning storage, so before that closes */
+    key_filter_stop();
+    http_server_close();
+    /* workers are gone, nothing can change the cache under us */
+    if (snapshot_path && lru_cache_save(cache, snapshot_path) != 0)
+        fprintf(stderr, "Failed to write cache snapshot to %s\n", snapshot_path);
     lru_cache_destroy(cache);
     return 0;
 }
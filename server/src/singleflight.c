@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include "singleflight.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Calls hang off a fixed array of mutex-protected buckets. A call lives
+ * until its leader and every waiter have let go of it. */
+
+typedef struct call {
+    struct call *next; /* bucket chain; unlinked once done or forgotten */
+    char *key;
+    unsigned long hash;
+    int done;
+    int linked;
+    int rc;
+    char *value;       /* leader's result, waiters copy it */
+    unsigned refs;     /* leader + waiters */
+} call_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    call_t *calls;
+} __attribute__((aligned(64))) bucket_t;
+
+struct singleflight {
+    bucket_t *buckets;
+    size_t n_buckets;
+    _Atomic size_t leaders;
+    _Atomic size_t coalesced;
+};
+
+static unsigned long hash_key(const char *s) {
+    unsigned long h = 5381;
+    int c;
+    while ((c = *s++)) h = ((h << 5) + h) + c;
+    return h;
+}
+
+singleflight_t *sf_create(size_t n_buckets) {
+    if (n_buckets == 0) n_buckets = 64;
+    singleflight_t *sf = calloc(1, sizeof(*sf));
+    if (!sf) return NULL;
+    if (posix_memalign((void **)&sf->buckets, 64, n_buckets * sizeof(bucket_t)) != 0) {
+        free(sf);
+        return NULL;
+    }
+    sf->n_buckets = n_buckets;
+    for (size_t i = 0; i < n_buckets; ++i) {
+        pthread_mutex_init(&sf->buckets[i].lock, NULL);
+        pthread_cond_init(&sf->buckets[i].cond, NULL);
+        sf->buckets[i].calls = NULL;
+    }
+    atomic_init(&sf->leaders, 0);
+    atomic_init(&sf->coalesced, 0);
+    return sf;
+}
+
+/* Only once no call can be in flight */
+void sf_destroy(singleflight_t *sf) {
+    if (!sf) return;
+    for (size_t i = 0; i < sf->n_buckets; ++i) {
+        pthread_mutex_destroy(&sf->buckets[i].lock);
+        pthread_cond_destroy(&sf->buckets[i].cond);
+    }
+    free(sf->buckets);
+    free(sf);
+}
+
+static void unlink_call(bucket_t *b, call_t *c) {
+    if (!c->linked) return;
+    call_t **pp = &b->calls;
+    while (*pp != c) pp = &(*pp)->next;
+    *pp = c->next;
+    c->linked = 0;
+}
+
+/* Caller holds the bucket lock */
+static void put_call(call_t *c) {
+    if (--c->refs > 0) return;
+    free(c->value);
+    free(c->key);
+    free(c);
+}
+
+int sf_do(singleflight_t *sf, const char *key, sf_fetch_fn fetch, void *arg,
+          char **out_value, int *shared) {
+    unsigned long h = hash_key(key);
+    bucket_t *b = &sf->buckets[h % sf->n_buckets];
+    if (shared) *shared = 0;
+
+    pthread_mutex_lock(&b->lock);
+    call_t *c = b->calls;
+    while (c && (c->hash != h || strcmp(c->key, key) != 0)) c = c->next;
+    if (c) {
+        /* someone is already fetching this key: wait for their answer */
+        c->refs++;
+        atomic_fetch_add_explicit(&sf->coalesced, 1, memory_order_relaxed);
+        while (!c->done) pthread_cond_wait(&b->cond, &b->lock);
+        int rc = c->rc;
+        *out_value = NULL;
+        if (rc == 0) {
+            *out_value = c->value ? strdup(c->value) : NULL;
+            if (!*out_value) rc = -1;
+        }
+        put_call(c);
+        pthread_mutex_unlock(&b->lock);
+        if (shared) *shared = 1;
+        return rc;
+    }
+
+    c = calloc(1, sizeof(*c));
+    char *kcopy = strdup(key);
+    if (!c || !kcopy) {
+        pthread_mutex_unlock(&b->lock);
+        free(c);
+        free(kcopy);
+        /* no table entry, but the caller still gets an answer */
+        return fetch(key, out_value, arg);
+    }
+    c->key = kcopy;
+    c->hash = h;
+    c->refs = 1;
+    c->linked = 1;
+    c->next = b->calls;
+    b->calls = c;
+    pthread_mutex_unlock(&b->lock);
+
+    atomic_fetch_add_explicit(&sf->leaders, 1, memory_order_relaxed);
+    char *value = NULL;
+    int rc = fetch(key, &value, arg);
+
+    pthread_mutex_lock(&b->lock);
+    c->rc = rc;
+    /* waiters copy from the call, the leader keeps the original */
+    if (rc == 0 && value && c->refs > 1) c->value = strdup(value);
+    c->done = 1;
+    unlink_call(b, c);
+    pthread_cond_broadcast(&b->cond);
+    put_call(c);
+    pthread_mutex_unlock(&b->lock);
+    *out_value = value;
+    return rc;
+}
+
+void sf_forget(singleflight_t *sf, const char *key) {
+    unsigned long h = hash_key(key);
+    bucket_t *b = &sf->buckets[h % sf->n_buckets];
+    pthread_mutex_lock(&b->lock);
+    call_t *c = b->calls;
+    while (c && (c->hash != h || strcmp(c->key, key) != 0)) c = c->next;
+    if (c) unlink_call(b, c);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void sf_get_stats(singleflight_t *sf, sf_stats_t *st) {
+    st->leaders = atomic_load_explicit(&sf->leaders, memory_order_relaxed);
+    st->coalesced = atomic_load_explicit(&sf->coalesced, memory_order_relaxed);
+}
@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+#include "sketch.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* keep the counter table modest for entry-unbounded caches */
+#define SKETCH_MAX_COUNTERS (1UL << 22)
+
+static const uint64_t row_seed[SKETCH_ROWS] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+    0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+};
+
+/* The caller's hash has constant top bits inside one cache shard, so every
+ * row remixes it before picking a counter. */
+static inline void locate(const sketch_t *sk, uint64_t hash, int row, size_t *word, unsigned *shift) {
+    uint64_t h = (hash ^ row_seed[row]) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+    *word = (size_t)row * sk->words_per_row + (size_t)((h >> 4) & (sk->words_per_row - 1));
+    *shift = (unsigned)(h & 15) * 4;
+}
+
+int sketch_init(sketch_t *sk, size_t capacity) {
+    memset(sk, 0, sizeof(*sk));
+    size_t counters = 64;
+    while (counters < capacity && counters < SKETCH_MAX_COUNTERS) counters *= 2;
+    sk->words_per_row = counters / 16;
+    sk->sample_size = counters * 10;
+    sk->table = calloc(SKETCH_ROWS * sk->words_per_row, sizeof(*sk->table));
+    if (!sk->table) return -1;
+    atomic_init(&sk->additions, 0);
+    return 0;
+}
+
+void sketch_destroy(sketch_t *sk) {
+    free((void *)sk->table);
+    sk->table = NULL;
+}
+
+static void halve(sketch_t *sk) {
+    size_t n = SKETCH_ROWS * sk->words_per_row;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t w = atomic_load_explicit(&sk->table[i], memory_order_relaxed);
+        /* shift every nibble right by one without borrowing across them */
+        atomic_store_explicit(&sk->table[i], (w >> 1) & 0x7777777777777777ULL, memory_order_relaxed);
+    }
+}
+
+void sketch_increment(sketch_t *sk, uint64_t hash) {
+    int added = 0;
+    for (int r = 0; r < SKETCH_ROWS; ++r) {
+        size_t word;
+        unsigned shift;
+        locate(sk, hash, r, &word, &shift);
+        uint64_t w = atomic_load_explicit(&sk->table[word], memory_order_relaxed);
+        while (((w >> shift) & 15) != 15) {
+            if (atomic_compare_exchange_weak_explicit(&sk->table[word], &w, w + (1ULL << shift),
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                added = 1;
+                break;
+            }
+        }
+    }
+    if (!added) return;
+    /* exactly one thread sees the count cross the threshold and ages */
+    if (atomic_fetch_add_explicit(&sk->additions, 1, memory_order_relaxed) + 1 == sk->sample_size) {
+        halve(sk);
+        atomic_fetch_sub_explicit(&sk->additions, sk->sample_size / 2, memory_order_relaxed);
+    }
+}
+
+unsigned sketch_estimate(const sketch_t *sk, uint64_t hash) {
+    unsigned est = 15;
+    for (int r = 0; r < SKETCH_ROWS; ++r) {
+        size_t word;
+        unsigned shift;
+        locate(sk, hash, r, &word, &shift);
+        unsigned v = (unsigned)(atomic_load_explicit(&sk->table[word], memory_order_relaxed) >> shift) & 15;
+        if (v < est) est = v;
+    }
+    return est;
+}
+
+size_t sketch_memory(const sketch_t *sk) {
+    return SKETCH_ROWS * sk->words_per_row * sizeof(*sk->table);
+}
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "storage.h"
+#include "logstore.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const storage_backend_t *active = NULL;
+
+/* ---- postgres ---- */
+
+static int pg_open(const storage_config_t *cfg) {
+    if (db_init(cfg->conninfo, cfg->db_conns, cfg->db_mode) != 0) return -1;
+    if (cfg->n_db_replicas &&
+        db_replicas_start(cfg->db_replicas, cfg->n_db_replicas, cfg->db_conns, cfg->replica_max_lag_ms) != 0) {
+        db_close();
+        return -1;
+    }
+    if (cfg->on_invalidate && db_invalidation_start(cfg->on_invalidate, cfg->invalidate_arg) != 0) {
+        db_close();
+        return -1;
+    }
+    return 0;
+}
+
+static void *pg_bulk_begin(void) {
+    return db_bulk_begin();
+}
+
+static int pg_bulk_add(void *bulk, const char *key, const char *value, long ttl_sec) {
+    return db_bulk_add(bulk, key, value, ttl_sec);
+}
+
+static long pg_bulk_commit(void *bulk) {
+    return db_bulk_commit(bulk);
+}
+
+static void pg_bulk_end(void *bulk) {
+    db_bulk_end(bulk);
+}
+
+const storage_backend_t storage_postgres = {
+    .name = "postgres",
+    .open = pg_open,
+    .close = db_close,
+    .get = db_get,
+    .put = db_put,
+    .del = db_delete,
+    .write_batch = db_write_batch,
+    .purge_expired = db_purge_expired,
+    .scan_keys = db_scan_keys,
+    .get_many = db_get_many,
+    .bulk_begin = pg_bulk_begin,
+    .bulk_add = pg_bulk_add,
+    .bulk_commit = pg_bulk_commit,
+    .bulk_end = pg_bulk_end,
+};
+
+/* ---- log ---- */
+
+static int log_open(const storage_config_t *cfg) {
+    return logstore_open(cfg->log_dir, cfg->log_segment_bytes, cfg->log_fsync_ms);
+}
+
+const storage_backend_t storage_log = {
+    .name = "log",
+    .open = log_open,
+    .close = logstore_close,
+    .get = logstore_get,
+    .put = logstore_put,
+    .del = logstore_delete,
+    /* appends are already batched at the fsync */
+    .write_batch = NULL,
+    .purge_expired = logstore_purge_expired,
+    .scan_keys = logstore_scan_keys,
+};
+
+static const storage_backend_t *const backends[] = { &storage_postgres, &storage_log };
+
+const storage_backend_t *storage_find(const char *name) {
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i)
+        if (strcmp(backends[i]->name, name) == 0) return backends[i];
+    return NULL;
+}
+
+int storage_open(const storage_backend_t *backend, const storage_config_t *cfg) {
+    if (backend->open(cfg) != 0) return -1;
+    active = backend;
+    return 0;
+}
+
+void storage_close(void) {
+    if (!active) return;
+    active->close();
+    active = NULL;
+}
+
+const storage_backend_t *storage_backend(void) {
+    return active;
+}
+
+int storage_get(const char *key, char **out_value, long *ttl_left) {
+    return active ? active->get(key, out_value, ttl_left) : -1;
+}
+
+int storage_put(const char *key, const char *value, long ttl_sec) {
+    return active ? active->put(key, value, ttl_sec) : -1;
+}
+
+int storage_delete(const char *key) {
+    return active ? active->del(key) : -1;
+}
+
+long storage_get_many(size_t n, const char *const *keys, char **values, long *ttls) {
+    if (!active) return -1;
+    if (active->get_many) return active->get_many(n, keys, values, ttls);
+    long found = 0;
+    for (size_t i = 0; i < n; ++i) {
+        long left = 0;
+        if (active->get(keys[i], &values[i], &left) == 0) found++;
+        else values[i] = NULL;
+        if (ttls) ttls[i] = values[i] ? left : 0;
+    }
+    return found;
+}
+
+int storage_write_batch(size_t n_put, const char *const *put_keys, const char *const *put_values,
+                        const long *put_ttls, size_t n_del, const char *const *del_keys, int *deleted) {
+    if (!active || !active->write_batch) return -1;
+    return active->write_batch(n_put, put_keys, put_values, put_ttls, n_del, del_keys, deleted);
+}
+
+long storage_purge_expired(int batch) {
+    if (!active) return -1;
+    return active->purge_expired ? active->purge_expired(batch) : 0;
+}
+
+long storage_scan_keys(int (*cb)(const char *key, void *arg), void *arg) {
+    if (!active || !active->scan_keys) return -1;
+    return active->scan_keys(cb, arg);
+}
+
+struct storage_bulk {
+    void *handle;   /* backend's own, NULL when rows go through put */
+    long staged;
+    int failed;
+};
+
+storage_bulk_t *storage_bulk_begin(void) {
+    if (!active) return NULL;
+    storage_bulk_t *b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    if (active->bulk_begin && !(b->handle = active->bulk_begin())) {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+int storage_bulk_add(storage_bulk_t *b, const char *key, const char *value, long ttl_sec) {
+    if (b->handle) return active->bulk_add(b->handle, key, value, ttl_sec);
+    if (active->put(key, value, ttl_sec) != 0) {
+        b->failed = 1;
+        return -1;
+    }
+    b->staged++;
+    return 0;
+}
+
+long storage_bulk_commit(storage_bulk_t *b) {
+    if (b->handle) return active->bulk_commit(b->handle);
+    if (b->failed) return -1;
+    long n = b->staged;
+    b->staged = 0;
+    return n;
+}
+
+void storage_bulk_end(storage_bulk_t *b) {
+    if (!b) return;
+    if (b->handle) active->bulk_end(b->handle);
+    free(b);
+}
@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include "timer_wheel.h"
+#include <string.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+
+static void push(tw_link_t **head, tw_link_t *link) {
+    link->next = *head;
+    if (*head) (*head)->pprev = &link->next;
+    link->pprev = head;
+    *head = link;
+}
+
+/* Lowest level whose block holds both now and the deadline */
+static void place(timer_wheel_t *tw, tw_link_t *link, uint32_t expires) {
+    for (int l = 0; l < TW_LEVELS; ++l) {
+        unsigned shift = TW_BITS * (l + 1);
+        if ((uint64_t)expires >> shift == (uint64_t)tw->now >> shift) {
+            push(&tw->slots[l][(expires >> (TW_BITS * l)) & TW_MASK], link);
+            return;
+        }
+    }
+    push(&tw->overflow, link);
+}
+
+void tw_init(timer_wheel_t *tw, uint32_t now, tw_expires_fn expires_of) {
+    memset(tw, 0, sizeof(*tw));
+    tw->now = now;
+    tw->expires_of = expires_of;
+}
+
+void tw_add(timer_wheel_t *tw, tw_link_t *link) {
+    uint32_t expires = tw->expires_of(link);
+    /* the slot for now has already been run this tick */
+    if (expires <= tw->now) expires = tw->now + 1;
+    place(tw, link, expires);
+    tw->count++;
+}
+
+void tw_del(timer_wheel_t *tw, tw_link_t *link) {
+    if (!link->pprev) return;
+    *link->pprev = link->next;
+    if (link->next) link->next->pprev = link->pprev;
+    link->next = NULL;
+    link->pprev = NULL;
+    tw->count--;
+}
+
+/* Re-place every timer of a slot one level down (or further) */
+static void cascade(timer_wheel_t *tw, tw_link_t **slot) {
+    tw_link_t *l = *slot;
+    *slot = NULL;
+    while (l) {
+        tw_link_t *nx = l->next;
+        uint32_t expires = tw->expires_of(l);
+        place(tw, l, expires < tw->now ? tw->now : expires);
+        l = nx;
+    }
+}
+
+void tw_advance(timer_wheel_t *tw, uint32_t now, tw_expire_fn expire, void *arg) {
+    while (tw->now != now) {
+        tw->now++;
+        /* entering a new block at some level: pull its timers down, top
+         * level first so they can keep falling */
+        if ((tw->now & ((1u << (TW_BITS * TW_LEVELS)) - 1)) == 0) cascade(tw, &tw->overflow);
+        for (int l = TW_LEVELS - 1; l >= 1; --l) {
+            if ((tw->now & ((1u << (TW_BITS * l)) - 1)) == 0)
+                cascade(tw, &tw->slots[l][(tw->now >> (TW_BITS * l)) & TW_MASK]);
+        }
+        tw_link_t **slot = &tw->slots[0][tw->now & TW_MASK];
+        tw_link_t *l = *slot;
+        *slot = NULL;
+        while (l) {
+            tw_link_t *nx = l->next;
+            l->next = NULL;
+            l->pprev = NULL;
+            tw->count--;
+            expire(l, arg);
+            l = nx;
+        }
+    }
+}
@@ -0,0 +1,896 @@
+#define _GNU_SOURCE
+#include "writeback.h"
+#include "group_commit.h"
+#include "storage.h"
+#include "crc32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define WAL_SUFFIX ".wal"
+#define WAL_SEGMENT_BYTES (64u << 20)
+/* logged writes held in memory before writers wait for the applier */
+#define MAX_PENDING 1000000
+#define OVERLAY_BUCKETS (1u << 17)
+/* how long the applier lets a short batch fill, and backs off after a
+ * failed one */
+#define APPLY_WAIT_MS 5
+#define RETRY_MS 1000
+#define TOMBSTONE UINT32_MAX
+#define KEY_MAX (1u << 16)
+#define VALUE_MAX (1u << 30)
+
+/* A WAL record in host byte order, followed by the key and, unless it is
+ * a delete, the value. crc covers everything after itself. */
+typedef struct {
+    uint32_t crc;
+    uint32_t klen;
+    uint32_t vlen;     /* TOMBSTONE for a delete */
+    uint32_t pad;
+    uint64_t seq;
+    int64_t expires;   /* unix seconds, 0 = never */
+} wal_hdr_t;
+
+/* A logged write that isn't in storage yet */
+typedef struct wb_op {
+    struct wb_op *next;    /* apply order */
+    struct wb_op *chain;   /* overlay bucket */
+    int in_overlay;        /* still the newest write to its key */
+    uint64_t seq;
+    uint64_t hash;
+    int64_t expires;
+    char *value;           /* NULL = delete; same allocation as key */
+    char key[];
+} wb_op_t;
+
+typedef struct {
+    uint64_t first_seq;
+    uint64_t bytes;
+} wal_seg_t;
+
+/* Everything below is guarded by lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static wb_op_t *head, *tail;
+static size_t n_pending;
+static wb_op_t **overlay;
+static char *wal_dir;
+static int wal_fd = -1;
+static wal_seg_t *segs;    /* oldest first; the last one is being written */
+static size_t n_segs, cap_segs;
+static uint64_t last_seq, checkpoint_seq;
+static int running;
+static size_t apply_batch;
+static uint64_t n_appended, n_replayed, n_applied, n_batches, apply_ns, n_retries;
+
+/* lets the calls skip the lock entirely when write-back is off */
+static atomic_int enabled;
+static _Atomic uint64_t n_fsyncs;
+
+/* durability, guarded by sync_lock */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static int syncing;
+static uint64_t synced_seq;
+
+static pthread_t applier;
+
+/* applier scratch, sized for apply_batch */
+static wb_op_t **batch;
+static const char **put_keys, **put_values, **del_keys, **seen;
+static long *put_ttls;
+static int *deleted;
+static size_t seen_mask;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* FNV-1a */
+static uint64_t key_hash(const char *key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *key; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int expired(const wb_op_t *op, int64_t now) {
+    return op->expires && op->expires <= now;
+}
+
+static long ttl_left_of(const wb_op_t *op, int64_t now) {
+    if (!op->expires) return 0;
+    return op->expires - now > 0 ? (long)(op->expires - now) : 1;
+}
+
+static wb_op_t *op_new(const char *key, size_t klen, const char *value, size_t vlen, int64_t expires) {
+    wb_op_t *op = malloc(sizeof(*op) + klen + 1 + (value ? vlen + 1 : 0));
+    if (!op) return NULL;
+    memcpy(op->key, key, klen);
+    op->key[klen] = '\0';
+    op->value = NULL;
+    if (value) {
+        op->value = op->key + klen + 1;
+        memcpy(op->value, value, vlen);
+        op->value[vlen] = '\0';
+    }
+    op->next = op->chain = NULL;
+    op->in_overlay = 0;
+    op->hash = key_hash(op->key);
+    op->expires = expires;
+    return op;
+}
+
+/* ---- overlay: newest unapplied write per key; caller holds lock ---- */
+
+static wb_op_t **overlay_slot(uint64_t h, const char *key) {
+    wb_op_t **pp = &overlay[h & (OVERLAY_BUCKETS - 1)];
+    while (*pp && ((*pp)->hash != h || strcmp((*pp)->key, key) != 0)) pp = &(*pp)->chain;
+    return pp;
+}
+
+static void overlay_set(wb_op_t *op) {
+    wb_op_t **pp = overlay_slot(op->hash, op->key);
+    if (*pp) {
+        op->chain = (*pp)->chain;
+        (*pp)->in_overlay = 0;
+        (*pp)->chain = NULL;
+    } else {
+        op->chain = NULL;
+    }
+    *pp = op;
+    op->in_overlay = 1;
+}
+
+static void overlay_drop(wb_op_t *op) {
+    if (!op->in_overlay) return;
+    wb_op_t **pp = overlay_slot(op->hash, op->key);
+    *pp = op->chain;
+    op->in_overlay = 0;
+}
+
+static void enqueue(wb_op_t *op) {
+    op->next = NULL;
+    if (tail) tail->next = op;
+    else head = op;
+    tail = op;
+    overlay_set(op);
+    n_pending++;
+}
+
+/* ---- segments ---- */
+
+static char *seg_path(uint64_t first_seq) {
+    char *p;
+    if (asprintf(&p, "%s/%020llu" WAL_SUFFIX, wal_dir, (unsigned long long)first_seq) < 0) return NULL;
+    return p;
+}
+
+static int segs_push(uint64_t first_seq, uint64_t bytes) {
+    if (n_segs == cap_segs) {
+        size_t cap = cap_segs ? cap_segs * 2 : 16;
+        wal_seg_t *n = realloc(segs, cap * sizeof(*n));
+        if (!n) return -1;
+        segs = n;
+        cap_segs = cap;
+    }
+    segs[n_segs].first_seq = first_seq;
+    segs[n_segs].bytes = bytes;
+    n_segs++;
+    return 0;
+}
+
+/* Starts the segment whose first record will be first_seq. A file by
+ * that name can only hold a torn record, so it is emptied. */
+static int seg_create(uint64_t first_seq) {
+    char *path = seg_path(first_seq);
+    if (!path) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    free(path);
+    if (fd < 0) return -1;
+    if (n_segs && segs[n_segs - 1].first_seq == first_seq) {
+        segs[n_segs - 1].bytes = 0;
+    } else if (segs_push(first_seq, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Caller holds lock */
+static int append_locked(const void *rec, size_t len, uint64_t seq) {
+    wal_seg_t *s = &segs[n_segs - 1];
+    if (s->bytes > 0 && s->bytes + len > WAL_SEGMENT_BYTES) {
+        /* everything before the new segment is durable from here on */
+        if (fdatasync(wal_fd) != 0) return -1;
+        atomic_fetch_add(&n_fsyncs, 1);
+        int fd = seg_create(seq);
+        if (fd < 0) return -1;
+        close(wal_fd);
+        wal_fd = fd;
+        s = &segs[n_segs - 1];
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(wal_fd, (const char *)rec + done, len - done, (off_t)(s->bytes + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            /* a half-written record would end the replay early */
+            if (ftruncate(wal_fd, (off_t)s->bytes) != 0) {}
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    s->bytes += len;
+    return 0;
+}
+
+static void *encode(const wb_op_t *op, size_t *len) {
+    size_t klen = strlen(op->key), vlen = op->value ? strlen(op->value) : 0;
+    *len = sizeof(wal_hdr_t) + klen + vlen;
+    char *buf = malloc(*len);
+    if (!buf) return NULL;
+    wal_hdr_t h = { 0, (uint32_t)klen, op->value ? (uint32_t)vlen : TOMBSTONE, 0, op->seq, op->expires };
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), op->key, klen);
+    if (vlen) memcpy(buf + sizeof(h) + klen, op->value, vlen);
+    h.crc = crc32_update(0, buf + sizeof(uint32_t), *len - sizeof(uint32_t));
+    memcpy(buf, &h.crc, sizeof(h.crc));
+    return buf;
+}
+
+/* Length of the valid record at p, 0 at a torn or corrupt tail */
+static size_t decode(const char *p, size_t avail, wal_hdr_t *h) {
+    if (avail < sizeof(*h)) return 0;
+    memcpy(h, p, sizeof(*h));
+    if (h->klen == 0 || h->klen > KEY_MAX) return 0;
+    if (h->vlen != TOMBSTONE && h->vlen > VALUE_MAX) return 0;
+    size_t len = sizeof(*h) + h->klen + (h->vlen == TOMBSTONE ? 0 : h->vlen);
+    if (len > avail) return 0;
+    if (crc32_update(0, p + sizeof(uint32_t), len - sizeof(uint32_t)) != h->crc) return 0;
+    return len;
+}
+
+/* Returns once every record up to seq is on disk. One caller syncs, the
+ * ones arriving meanwhile wait and are usually covered by the next sync. */
+static int sync_to(uint64_t seq) {
+    int rc = 0;
+    pthread_mutex_lock(&sync_lock);
+    while (synced_seq < seq) {
+        if (syncing) {
+            pthread_cond_wait(&sync_cond, &sync_lock);
+            continue;
+        }
+        syncing = 1;
+        pthread_mutex_unlock(&sync_lock);
+        /* a dup survives the segment being rotated and closed meanwhile;
+         * segments before it were synced when they were sealed */
+        pthread_mutex_lock(&lock);
+        uint64_t target = last_seq;
+        int fd = dup(wal_fd);
+        pthread_mutex_unlock(&lock);
+        rc = fd >= 0 ? fdatasync(fd) : -1;
+        if (fd >= 0) close(fd);
+        atomic_fetch_add(&n_fsyncs, 1);
+        pthread_mutex_lock(&sync_lock);
+        syncing = 0;
+        if (rc == 0 && target > synced_seq) synced_seq = target;
+        pthread_cond_broadcast(&sync_cond);
+        if (rc != 0) {
+            fprintf(stderr, "write-back: WAL sync failed: %s\n", strerror(errno));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return rc;
+}
+
+static wb_op_t *wal_op(const char *key, const char *value, long ttl_sec) {
+    size_t klen = strlen(key), vlen = value ? strlen(value) : 0;
+    if (klen == 0 || klen > KEY_MAX || vlen > VALUE_MAX) return NULL;
+    int64_t expires = value && ttl_sec > 0 ? (int64_t)time(NULL) + ttl_sec : 0;
+    return op_new(key, klen, value, vlen, expires);
+}
+
+/* Logs ops in order and syncs once for all of them; takes the ops. -2 if
+ * write-back is not running. On -1 a prefix may have been logged, and
+ * will be applied. */
+static int wal_log(wb_op_t **ops, size_t n) {
+    pthread_mutex_lock(&lock);
+    while (running && n_pending >= MAX_PENDING) pthread_cond_wait(&space_cond, &lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        for (size_t i = 0; i < n; ++i) free(ops[i]);
+        return -2;
+    }
+    uint64_t first = last_seq + 1;
+    int rc = 0;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        wb_op_t *op = ops[i];
+        op->seq = last_seq + 1;
+        size_t len;
+        void *rec = encode(op, &len);
+        int ok = rec && append_locked(rec, len, op->seq) == 0;
+        free(rec);
+        if (!ok) {
+            rc = -1;
+            break;
+        }
+        last_seq = op->seq;
+        enqueue(op);
+        n_appended++;
+    }
+    for (size_t j = i; j < n; ++j) free(ops[j]);
+    uint64_t seq = last_seq;
+    if (i > 0) pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lock);
+    if (seq < first) return rc;
+    return sync_to(seq) == 0 ? rc : -1;
+}
+
+/* Logs one write; -2 if write-back is not running */
+static int wal_write(const char *key, const char *value, long ttl_sec) {
+    wb_op_t *op = wal_op(key, value, ttl_sec);
+    return op ? wal_log(&op, 1) : -1;
+}
+
+/* ---- applier ---- */
+
+/* Returns 0 if key was already in the set, 1 if it was added */
+static int seen_add(const char *key, uint64_t h) {
+    for (size_t i = h & seen_mask;; i = (i + 1) & seen_mask) {
+        if (!seen[i]) {
+            seen[i] = key;
+            return 1;
+        }
+        if (strcmp(seen[i], key) == 0) return 0;
+    }
+}
+
+/* Applies batch[0..n) to storage, newest write per key only */
+static int apply(size_t n) {
+    memset(seen, 0, (seen_mask + 1) * sizeof(*seen));
+    int64_t now = (int64_t)time(NULL);
+    size_t n_put = 0, n_del = 0;
+    for (size_t i = n; i-- > 0;) {
+        wb_op_t *op = batch[i];
+        if (!seen_add(op->key, op->hash)) continue;
+        if (op->value && !expired(op, now)) {
+            put_keys[n_put] = op->key;
+            put_values[n_put] = op->value;
+            put_ttls[n_put++] = ttl_left_of(op, now);
+        } else {
+            /* an expired put leaves nothing behind either */
+            del_keys[n_del++] = op->key;
+        }
+    }
+    if (storage_write_batch(n_put, put_keys, put_values, put_ttls, n_del, del_keys, deleted) == 0)
+        return 0;
+    /* no batch write, or it failed: one at a time, which is safe to repeat */
+    for (size_t i = 0; i < n_put; ++i)
+        if (storage_put(put_keys[i], put_values[i], put_ttls[i]) != 0) return -1;
+    /* -1 here also means "wasn't there", which is fine */
+    for (size_t i = 0; i < n_del; ++i) storage_delete(del_keys[i]);
+    return 0;
+}
+
+/* Written to a temp file and renamed over the old one. Losing it only
+ * means applying some writes twice. */
+static void write_checkpoint(uint64_t seq) {
+    char *path = NULL, *tmp = NULL;
+    if (asprintf(&path, "%s/checkpoint", wal_dir) < 0) path = NULL;
+    if (asprintf(&tmp, "%s/checkpoint.tmp", wal_dir) < 0) tmp = NULL;
+    int fd = path && tmp ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (fd >= 0) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%llu\n", (unsigned long long)seq);
+        int ok = write(fd, buf, (size_t)len) == len && fdatasync(fd) == 0;
+        close(fd);
+        if (ok && rename(tmp, path) == 0) {
+            free(path);
+            free(tmp);
+            return;
+        }
+    }
+    fprintf(stderr, "write-back: cannot write checkpoint: %s\n", strerror(errno));
+    free(path);
+    free(tmp);
+}
+
+static uint64_t read_checkpoint(void) {
+    char *path;
+    if (asprintf(&path, "%s/checkpoint", wal_dir) < 0) return 0;
+    FILE *f = fopen(path, "r");
+    free(path);
+    unsigned long long seq = 0;
+    if (f) {
+        if (fscanf(f, "%llu", &seq) != 1) seq = 0;
+        fclose(f);
+    }
+    return seq;
+}
+
+/* Caller holds lock. Removes sealed segments with nothing left to apply. */
+static void drop_applied_segments(void) {
+    while (n_segs > 1 && segs[1].first_seq - 1 <= checkpoint_seq) {
+        char *path = seg_path(segs[0].first_seq);
+        if (path) unlink(path);
+        free(path);
+        memmove(&segs[0], &segs[1], (n_segs - 1) * sizeof(*segs));
+        n_segs--;
+    }
+}
+
+static struct timespec deadline_ms(unsigned ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+static void *applier_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!head && running) pthread_cond_wait(&work_cond, &lock);
+        if (!head) break;
+        /* big batches are the point; a short wait costs nobody a reply */
+        if (n_pending < apply_batch && running) {
+            struct timespec ts = deadline_ms(APPLY_WAIT_MS);
+            while (n_pending < apply_batch && running)
+                if (pthread_cond_timedwait(&work_cond, &lock, &ts) == ETIMEDOUT) break;
+            if (!head) continue;
+        }
+        size_t n = 0;
+        while (head && n < apply_batch) {
+            batch[n++] = head;
+            head = head->next;
+        }
+        if (!head) tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        uint64_t t0 = now_ns();
+        int rc = apply(n);
+        uint64_t spent = now_ns() - t0;
+        if (rc == 0) write_checkpoint(batch[n - 1]->seq);
+
+        pthread_mutex_lock(&lock);
+        n_batches++;
+        apply_ns += spent;
+        if (rc != 0) {
+            /* back in front, in order, for the next attempt */
+            batch[n - 1]->next = head;
+            head = batch[0];
+            if (!tail) tail = batch[n - 1];
+            n_retries++;
+            if (!running) break;
+            fprintf(stderr, "write-back: applying %zu writes failed, retrying\n", n);
+            struct timespec ts = deadline_ms(RETRY_MS);
+            while (running)
+                if (pthread_cond_timedwait(&work_cond, &lock, &ts) == ETIMEDOUT) break;
+            continue;
+        }
+        checkpoint_seq = batch[n - 1]->seq;
+        for (size_t i = 0; i < n; ++i) {
+            overlay_drop(batch[i]);
+            free(batch[i]);
+        }
+        n_pending -= n;
+        n_applied += n;
+        drop_applied_segments();
+        pthread_cond_broadcast(&space_cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* ---- start / stop ---- */
+
+static int by_first_seq(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Queues the records of one segment past the checkpoint. A bad record
+ * ends the segment; in the newest one that is a torn append, cut off. */
+static int load_segment(uint64_t first_seq, int newest) {
+    char *path = seg_path(first_seq);
+    int fd = path ? open(path, O_RDWR | O_CLOEXEC) : -1;
+    free(path);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size, got = 0;
+    char *buf = malloc(size ? size : 1);
+    while (buf && got < size) {
+        ssize_t n = pread(fd, buf + got, size - got, (off_t)got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    if (!buf || got < size) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    size_t off = 0, len;
+    wal_hdr_t h;
+    while (off < size && (len = decode(buf + off, size - off, &h)) > 0) {
+        if (h.seq > last_seq) {
+            const char *key = buf + off + sizeof(h);
+            wb_op_t *op = op_new(key, h.klen, h.vlen == TOMBSTONE ? NULL : key + h.klen, h.vlen,
+                                 h.expires);
+            if (!op) break;
+            op->seq = h.seq;
+            enqueue(op);
+            n_replayed++;
+            last_seq = h.seq;
+        }
+        off += len;
+    }
+    free(buf);
+    if (off < size) {
+        if (newest) {
+            fprintf(stderr, "write-back: cutting %zu torn bytes off the WAL\n", size - off);
+            if (ftruncate(fd, (off_t)off) == 0) size = off;
+        } else {
+            fprintf(stderr, "write-back: WAL segment %llu is corrupt after byte %zu\n",
+                    (unsigned long long)first_seq, off);
+        }
+    }
+    close(fd);
+    return segs_push(first_seq, size);
+}
+
+static void free_all(void) {
+    while (head) {
+        wb_op_t *op = head;
+        head = op->next;
+        free(op);
+    }
+    tail = NULL;
+    n_pending = 0;
+    free(overlay);
+    overlay = NULL;
+    if (wal_fd >= 0) close(wal_fd);
+    wal_fd = -1;
+    free(segs);
+    segs = NULL;
+    n_segs = cap_segs = 0;
+    free(wal_dir);
+    wal_dir = NULL;
+    free(batch);
+    free(put_keys);
+    free(put_values);
+    free(del_keys);
+    free(seen);
+    free(put_ttls);
+    free(deleted);
+    batch = NULL;
+    put_keys = put_values = del_keys = seen = NULL;
+    put_ttls = NULL;
+    deleted = NULL;
+}
+
+int writeback_start(const char *dir, size_t max_batch, writeback_replay_fn replay, void *arg) {
+    if (max_batch == 0) max_batch = 1;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "write-back: cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "write-back: cannot open %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_lock(&lock);
+    wal_dir = strdup(dir);
+    overlay = calloc(OVERLAY_BUCKETS, sizeof(*overlay));
+    apply_batch = max_batch;
+    size_t slots = 1;
+    while (slots < 2 * max_batch) slots *= 2;
+    seen_mask = slots - 1;
+    batch = malloc(max_batch * sizeof(*batch));
+    put_keys = malloc(max_batch * sizeof(*put_keys));
+    put_values = malloc(max_batch * sizeof(*put_values));
+    del_keys = malloc(max_batch * sizeof(*del_keys));
+    put_ttls = malloc(max_batch * sizeof(*put_ttls));
+    deleted = malloc(max_batch * sizeof(*deleted));
+    seen = malloc(slots * sizeof(*seen));
+    uint64_t *firsts = NULL;
+    size_t n_firsts = 0, cap_firsts = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned long long first;
+        char suffix[8];
+        if (sscanf(de->d_name, "%20llu%7s", &first, suffix) != 2 || strcmp(suffix, WAL_SUFFIX) != 0)
+            continue;
+        if (n_firsts == cap_firsts) {
+            cap_firsts = cap_firsts ? cap_firsts * 2 : 16;
+            uint64_t *n = realloc(firsts, cap_firsts * sizeof(*firsts));
+            if (!n) break;
+            firsts = n;
+        }
+        firsts[n_firsts++] = first;
+    }
+    closedir(d);
+    if (!wal_dir || !overlay || !batch || !put_keys || !put_values || !del_keys || !put_ttls ||
+        !deleted || !seen)
+        goto fail;
+    qsort(firsts, n_firsts, sizeof(*firsts), by_first_seq);
+
+    n_appended = n_replayed = n_applied = n_batches = apply_ns = n_retries = 0;
+    checkpoint_seq = last_seq = read_checkpoint();
+    for (size_t i = 0; i < n_firsts; ++i) {
+        if (load_segment(firsts[i], i + 1 == n_firsts) != 0) {
+            fprintf(stderr, "write-back: cannot read WAL segment %llu\n",
+                    (unsigned long long)firsts[i]);
+            goto fail;
+        }
+    }
+    free(firsts);
+    firsts = NULL;
+    /* new writes always start a fresh segment */
+    wal_fd = seg_create(last_seq + 1);
+    if (wal_fd < 0) goto fail;
+    synced_seq = last_seq;
+    drop_applied_segments();
+
+    /* bring the cache in line with writes that never reached storage */
+    int64_t now = (int64_t)time(NULL);
+    for (wb_op_t *op = head; op && replay; op = op->next) {
+        if (op->value && !expired(op, now)) replay(op->key, op->value, ttl_left_of(op, now), arg);
+        else replay(op->key, NULL, 0, arg);
+    }
+    running = 1;
+    if (pthread_create(&applier, NULL, applier_main, NULL) != 0) {
+        running = 0;
+        goto fail;
+    }
+    atomic_store(&enabled, 1);
+    pthread_mutex_unlock(&lock);
+    printf("write-back: WAL in %s, %zu unapplied writes replayed\n", dir, n_pending);
+    return 0;
+fail:
+    free(firsts);
+    free_all();
+    pthread_mutex_unlock(&lock);
+    return -1;
+}
+
+void writeback_stop(void) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_broadcast(&work_cond);
+    pthread_cond_broadcast(&space_cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(applier, NULL);
+    atomic_store(&enabled, 0);
+    pthread_mutex_lock(&lock);
+    if (n_pending)
+        fprintf(stderr, "write-back: %zu writes left in %s for the next start\n", n_pending, wal_dir);
+    free_all();
+    pthread_mutex_unlock(&lock);
+}
+
+/* ---- calls ---- */
+
+int writeback_put(const char *key, const char *value, long ttl_sec) {
+    int rc = atomic_load(&enabled) ? wal_write(key, value, ttl_sec) : -2;
+    return rc == -2 ? group_commit_put(key, value, ttl_sec) : rc;
+}
+
+int writeback_delete(const char *key) {
+    if (!atomic_load(&enabled)) return group_commit_delete(key);
+    /* 404 without logging anything if there is nothing to delete */
+    char *value;
+    if (writeback_get(key, &value, NULL) != 0) return -1;
+    free(value);
+    int rc = wal_write(key, NULL, 0);
+    return rc == -2 ? group_commit_delete(key) : rc;
+}
+
+int writeback_get(const char *key, char **out_value, long *ttl_left) {
+    if (atomic_load(&enabled)) {
+        uint64_t h = key_hash(key);
+        pthread_mutex_lock(&lock);
+        wb_op_t *op = overlay ? *overlay_slot(h, key) : NULL;
+        if (op) {
+            int64_t now = (int64_t)time(NULL);
+            int rc = -1;
+            if (op->value && !expired(op, now)) {
+                *out_value = strdup(op->value);
+                if (*out_value) rc = 0;
+                if (ttl_left) *ttl_left = ttl_left_of(op, now);
+            }
+            pthread_mutex_unlock(&lock);
+            return rc;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return storage_get(key, out_value, ttl_left);
+}
+
+int writeback_write_many(size_t n, const char *const *keys, const char *const *values, const long *ttls) {
+    if (n == 0) return 0;
+    if (atomic_load(&enabled)) {
+        wb_op_t **ops = malloc(n * sizeof(*ops));
+        if (!ops) return -1;
+        size_t i;
+        for (i = 0; i < n; ++i)
+            if (!(ops[i] = wal_op(keys[i], values[i], values[i] ? ttls[i] : 0))) break;
+        int rc = -1;
+        if (i == n) rc = wal_log(ops, n);
+        else while (i > 0) free(ops[--i]);
+        free(ops);
+        if (rc != -2) return rc;
+    }
+    /* straight to storage, in one transaction when the backend has them */
+    const char **put_keys = malloc(n * sizeof(char *));
+    const char **put_values = malloc(n * sizeof(char *));
+    const char **del_keys = malloc(n * sizeof(char *));
+    long *put_ttls = malloc(n * sizeof(long));
+    int *deleted = malloc(n * sizeof(int));
+    int rc = -1;
+    if (put_keys && put_values && del_keys && put_ttls && deleted) {
+        size_t n_put = 0, n_del = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (values[i]) {
+                put_keys[n_put] = keys[i];
+                put_values[n_put] = values[i];
+                put_ttls[n_put++] = ttls[i];
+            } else {
+                del_keys[n_del++] = keys[i];
+            }
+        }
+        if (storage_backend()->write_batch) {
+            rc = storage_write_batch(n_put, put_keys, put_values, put_ttls, n_del, del_keys, deleted);
+        } else {
+            rc = 0;
+            for (size_t i = 0; i < n_put && rc == 0; ++i) rc = storage_put(put_keys[i], put_values[i], put_ttls[i]);
+            /* -1 from a delete only means there was nothing to delete */
+            for (size_t i = 0; i < n_del && rc == 0; ++i) storage_delete(del_keys[i]);
+        }
+    }
+    free(put_keys);
+    free(put_values);
+    free(del_keys);
+    free(put_ttls);
+    free(deleted);
+    return rc;
+}
+
+long writeback_get_many(size_t n, const char *const *keys, char **values, long *ttls) {
+    if (!atomic_load(&enabled)) return storage_get_many(n, keys, values, ttls);
+    size_t *rest = malloc((n ? n : 1) * sizeof(*rest));
+    const char **rest_keys = malloc((n ? n : 1) * sizeof(*rest_keys));
+    char **rest_values = malloc((n ? n : 1) * sizeof(*rest_values));
+    long *rest_ttls = malloc((n ? n : 1) * sizeof(*rest_ttls));
+    if (!rest || !rest_keys || !rest_values || !rest_ttls) {
+        free(rest);
+        free(rest_keys);
+        free(rest_values);
+        free(rest_ttls);
+        return -1;
+    }
+    /* the overlay answers for what it holds, storage for the rest in one go */
+    long found = 0;
+    size_t m = 0;
+    int64_t now = (int64_t)time(NULL);
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < n; ++i) {
+        values[i] = NULL;
+        if (ttls) ttls[i] = 0;
+        wb_op_t *op = overlay ? *overlay_slot(key_hash(keys[i]), keys[i]) : NULL;
+        if (!op) {
+            rest[m] = i;
+            rest_keys[m++] = keys[i];
+        } else if (op->value && !expired(op, now) && (values[i] = strdup(op->value)) != NULL) {
+            if (ttls) ttls[i] = ttl_left_of(op, now);
+            found++;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    long got = m ? storage_get_many(m, rest_keys, rest_values, rest_ttls) : 0;
+    for (size_t j = 0; got >= 0 && j < m; ++j) {
+        values[rest[j]] = rest_values[j];
+        if (ttls) ttls[rest[j]] = rest_ttls[j];
+    }
+    if (got < 0) {
+        for (size_t i = 0; i < n; ++i) {
+            free(values[i]);
+            values[i] = NULL;
+        }
+    }
+    free(rest);
+    free(rest_keys);
+    free(rest_values);
+    free(rest_ttls);
+    return got < 0 ? -1 : found + got;
+}
+
+long writeback_scan_pending(int (*cb)(const char *key, void *arg), void *arg) {
+    if (!atomic_load(&enabled)) return 0;
+    int64_t now = (int64_t)time(NULL);
+    pthread_mutex_lock(&lock);
+    if (!overlay) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    /* the overlay, not the queue: it also holds writes the applier is
+     * committing right now */
+    size_t bytes = 0;
+    for (size_t b = 0; b < OVERLAY_BUCKETS; ++b)
+        for (wb_op_t *op = overlay[b]; op; op = op->chain)
+            if (op->value && !expired(op, now)) bytes += strlen(op->key) + 1;
+    char *keys = malloc(bytes ? bytes : 1), *p = keys;
+    if (!keys) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    for (size_t b = 0; b < OVERLAY_BUCKETS; ++b) {
+        for (wb_op_t *op = overlay[b]; op; op = op->chain) {
+            if (!op->value || expired(op, now)) continue;
+            size_t l = strlen(op->key) + 1;
+            memcpy(p, op->key, l);
+            p += l;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    long n = 0;
+    for (char *k = keys; k < p; k += strlen(k) + 1) {
+        if (cb(k, arg) != 0) {
+            n = -1;
+            break;
+        }
+        n++;
+    }
+    free(keys);
+    return n;
+}
+
+int writeback_get_stats(writeback_stats_t *st) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    st->appended = n_appended;
+    st->replayed = n_replayed;
+    st->applied = n_applied;
+    st->pending = n_pending;
+    st->batches = n_batches;
+    st->apply_ns = apply_ns;
+    st->retries = n_retries;
+    st->fsyncs = atomic_load(&n_fsyncs);
+    st->checkpoint = checkpoint_seq;
+    st->wal_bytes = 0;
+    for (size_t i = 0; i < n_segs; ++i) st->wal_bytes += segs[i].bytes;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}